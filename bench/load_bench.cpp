@@ -0,0 +1,458 @@
+/**
+ * @file load_bench.cpp
+ * @brief End-to-end load generator for a running proxy.
+ * * Starts its own origin on loopback, an HTTP server answering
+ * "GET /bytes/N" with N bytes and a TCP echo server for CONNECT tunnels,
+ * then drives the proxy from a fixed number of client threads for a fixed
+ * time. Every client issues requests back to back:
+ *
+ * - a share of them (--connect) open a CONNECT tunnel to the echo server
+ *   and bounce --size bytes through it;
+ * - the rest are plain GETs for --size bytes, each of which keeps its
+ *   connection for the next request with probability --keepalive.
+ *
+ * Latency runs from the first byte sent (or the TCP connect, for a new
+ * connection) to the last byte received. The result is printed as one
+ * JSON object so that runs can be compared by script.
+ *
+ * Build with "make bench", start the proxy, then for example:
+ *   ./bench/load_bench --concurrency=64 --duration=10 --size=16384 --keepalive=0.9 --connect=0.1
+ * --direct sends the same load straight to the origin, as a baseline.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net_compat.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+const unsigned kTimeoutMs = 10000;
+const size_t kChunk = 16384;
+
+struct Options
+{
+    std::string proxy_host = "127.0.0.1";
+    int proxy_port = 8888;
+    size_t concurrency = 16;
+    unsigned duration_s = 10;
+    size_t size = 1024;       ///< Response body, or bytes bounced through a tunnel.
+    double keepalive = 1.0;   ///< Chance that a GET leaves its connection open for the next one.
+    double connect = 0.0;     ///< Share of requests that are CONNECT tunnels.
+    bool cacheable = false;   ///< Origin allows caching; by default it sends no-store.
+    bool direct = false;      ///< Bypass the proxy.
+    int origin_port = 0;      ///< 0 picks a free port.
+};
+
+struct Stats
+{
+    std::vector<uint32_t> latency_us;
+    uint64_t gets = 0;
+    uint64_t tunnels = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0; ///< Payload bytes received.
+    uint64_t connects = 0;
+};
+
+bool send_all(SOCKET s, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        int r = send(s, data, (int)std::min(len, kChunk), 0);
+        if (r <= 0)
+            return false;
+        data += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+std::string lower(std::string s)
+{
+    for (char &ch : s)
+        ch = (char)std::tolower((unsigned char)ch);
+    return s;
+}
+
+SOCKET open_listener(int port, int &bound)
+{
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    socklen_t len = sizeof(addr);
+    if (bind(s, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(s, (sockaddr *)&addr, &len) == SOCKET_ERROR)
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    bound = ntohs(addr.sin_port);
+    return s;
+}
+
+SOCKET open_connection(const std::string &host, int port)
+{
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+        return INVALID_SOCKET;
+    SOCKET s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (s != INVALID_SOCKET && connect(s, res->ai_addr, (int)res->ai_addrlen) == SOCKET_ERROR)
+    {
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    if (s == INVALID_SOCKET)
+        return s;
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+    set_recv_timeout(s, kTimeoutMs);
+    return s;
+}
+
+/// Reads from s into in until it holds a complete head. Returns the head length, or 0.
+size_t read_head(SOCKET s, std::string &in)
+{
+    char buf[kChunk];
+    size_t end;
+    while ((end = in.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (in.size() > 65536)
+            return 0;
+        int r = recv(s, buf, sizeof(buf), 0);
+        if (r <= 0)
+            return 0;
+        in.append(buf, (size_t)r);
+    }
+    return end + 4;
+}
+
+// ---- Origin stand-in ------------------------------------------------------
+
+/// Answers "GET /bytes/N" with N bytes until the client closes or asks to.
+void serve_http(SOCKET s, const std::string *payload, bool cacheable)
+{
+    std::string in;
+    for (;;)
+    {
+        size_t n = read_head(s, in);
+        if (n == 0)
+            break;
+        std::string head = lower(in.substr(0, n));
+        in.erase(0, n);
+
+        size_t size = 0;
+        size_t at = head.find("/bytes/");
+        if (at != std::string::npos)
+            size = std::min<size_t>(std::strtoull(head.c_str() + at + 7, nullptr, 10), payload->size());
+        bool close = head.find("\r\nconnection: close") != std::string::npos;
+
+        std::string out = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                          std::to_string(size) + "\r\nCache-Control: " +
+                          (cacheable ? "max-age=3600" : "no-store") + "\r\n" +
+                          (close ? "Connection: close\r\n" : "") + "\r\n";
+        if (!send_all(s, out.data(), out.size()) || !send_all(s, payload->data(), size) || close)
+            break;
+    }
+    shutdown(s, SD_SEND);
+    closesocket(s);
+}
+
+void serve_echo(SOCKET s)
+{
+    char buf[kChunk];
+    int r;
+    while ((r = recv(s, buf, sizeof(buf), 0)) > 0)
+        if (!send_all(s, buf, (size_t)r))
+            break;
+    shutdown(s, SD_SEND);
+    closesocket(s);
+}
+
+template <typename Serve>
+void accept_loop(SOCKET listener, Serve serve)
+{
+    for (;;)
+    {
+        SOCKET c = accept(listener, nullptr, nullptr);
+        if (c == INVALID_SOCKET)
+            return;
+        int one = 1;
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+        std::thread(serve, c).detach();
+    }
+}
+
+// ---- Clients --------------------------------------------------------------
+
+class Client
+{
+public:
+    Client(const Options &o, int http_port, int echo_port, unsigned seed)
+        : m_opt(o), m_httpPort(http_port), m_echoPort(echo_port), m_rng(seed)
+    {
+        m_payload.assign(kChunk, 'x');
+    }
+
+    void run(Clock::time_point until, Stats &st)
+    {
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        while (Clock::now() < until)
+        {
+            auto started = Clock::now();
+            bool tunnel = coin(m_rng) < m_opt.connect;
+            bool ok = tunnel ? bounce(st) : get(coin(m_rng) < m_opt.keepalive, st);
+            if (!ok)
+            {
+                ++st.errors;
+                drop();
+                continue;
+            }
+            ++(tunnel ? st.tunnels : st.gets);
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count();
+            st.latency_us.push_back((uint32_t)std::min<int64_t>(us, UINT32_MAX));
+        }
+        drop();
+    }
+
+private:
+    void drop()
+    {
+        if (m_conn != INVALID_SOCKET)
+            closesocket(m_conn);
+        m_conn = INVALID_SOCKET;
+        m_in.clear();
+    }
+
+    bool get(bool keep, Stats &st)
+    {
+        if (m_conn == INVALID_SOCKET)
+        {
+            m_conn = m_opt.direct ? open_connection("127.0.0.1", m_httpPort)
+                                  : open_connection(m_opt.proxy_host, m_opt.proxy_port);
+            if (m_conn == INVALID_SOCKET)
+                return false;
+            ++st.connects;
+        }
+        std::string origin = "127.0.0.1:" + std::to_string(m_httpPort);
+        std::string req = "GET " + (m_opt.direct ? std::string() : "http://" + origin) + "/bytes/" +
+                          std::to_string(m_opt.size) + " HTTP/1.1\r\nHost: " + origin + "\r\n" +
+                          (keep ? "" : "Connection: close\r\n") + "\r\n";
+        if (!send_all(m_conn, req.data(), req.size()))
+            return false;
+
+        size_t n = read_head(m_conn, m_in);
+        if (n == 0 || m_in.compare(0, 12, "HTTP/1.1 200") != 0)
+            return false;
+        std::string head = lower(m_in.substr(0, n));
+        m_in.erase(0, n);
+        size_t at = head.find("\r\ncontent-length:");
+        if (at == std::string::npos)
+            return false;
+        size_t length = std::strtoull(head.c_str() + at + 17, nullptr, 10);
+
+        char buf[kChunk];
+        while (m_in.size() < length)
+        {
+            int r = recv(m_conn, buf, sizeof(buf), 0);
+            if (r <= 0)
+                return false;
+            m_in.append(buf, (size_t)r);
+        }
+        m_in.erase(0, length);
+        st.bytes += length;
+        if (!keep || head.find("\r\nconnection: close") != std::string::npos)
+            drop();
+        return true;
+    }
+
+    /// A CONNECT tunnel to the echo server, with --size bytes sent through it and back.
+    bool bounce(Stats &st)
+    {
+        drop();
+        m_conn = m_opt.direct ? open_connection("127.0.0.1", m_echoPort)
+                              : open_connection(m_opt.proxy_host, m_opt.proxy_port);
+        if (m_conn == INVALID_SOCKET)
+            return false;
+        ++st.connects;
+        if (!m_opt.direct)
+        {
+            std::string target = "127.0.0.1:" + std::to_string(m_echoPort);
+            std::string req = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+            if (!send_all(m_conn, req.data(), req.size()))
+                return false;
+            size_t n = read_head(m_conn, m_in);
+            if (n == 0 || m_in.compare(9, 3, "200") != 0)
+                return false;
+            m_in.erase(0, n);
+        }
+
+        // One chunk in flight at a time, so neither side can block on a full buffer.
+        char buf[kChunk];
+        size_t sent = 0, received = m_in.size();
+        while (received < m_opt.size)
+        {
+            if (sent == received)
+            {
+                size_t n = std::min(kChunk, m_opt.size - sent);
+                if (!send_all(m_conn, m_payload.data(), n))
+                    return false;
+                sent += n;
+            }
+            int r = recv(m_conn, buf, sizeof(buf), 0);
+            if (r <= 0)
+                return false;
+            received += (size_t)r;
+        }
+        st.bytes += received;
+        drop();
+        return true;
+    }
+
+    const Options &m_opt;
+    int m_httpPort;
+    int m_echoPort;
+    std::mt19937 m_rng;
+    std::string m_payload;
+    SOCKET m_conn = INVALID_SOCKET;
+    std::string m_in; ///< Bytes received past the current response.
+};
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+bool parse_options(int argc, char **argv, Options &o)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto value = [&arg](const char *prefix) -> const char *
+        { return arg.rfind(prefix, 0) == 0 ? arg.c_str() + std::strlen(prefix) : nullptr; };
+        const char *v;
+        if ((v = value("--proxy=")))
+        {
+            std::string hp = v;
+            size_t colon = hp.rfind(':');
+            if (colon == std::string::npos)
+                return false;
+            o.proxy_host = hp.substr(0, colon);
+            o.proxy_port = std::atoi(hp.c_str() + colon + 1);
+        }
+        else if ((v = value("--concurrency=")))
+            o.concurrency = std::max(1ul, std::strtoul(v, nullptr, 10));
+        else if ((v = value("--duration=")))
+            o.duration_s = (unsigned)std::max(1ul, std::strtoul(v, nullptr, 10));
+        else if ((v = value("--size=")))
+            o.size = std::strtoul(v, nullptr, 10);
+        else if ((v = value("--keepalive=")))
+            o.keepalive = std::atof(v);
+        else if ((v = value("--connect=")))
+            o.connect = std::atof(v);
+        else if ((v = value("--origin-port=")))
+            o.origin_port = std::atoi(v);
+        else if (arg == "--cacheable")
+            o.cacheable = true;
+        else if (arg == "--direct")
+            o.direct = true;
+        else
+            return false;
+    }
+    return true;
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        std::cerr << "usage: load_bench [--proxy=HOST:PORT] [--concurrency=N] [--duration=S] [--size=BYTES]\n"
+                     "                  [--keepalive=0..1] [--connect=0..1] [--cacheable] [--direct] [--origin-port=N]\n";
+        return 1;
+    }
+    net_startup();
+
+    int http_port = 0, echo_port = 0;
+    SOCKET http = open_listener(opt.origin_port, http_port);
+    SOCKET echo = open_listener(0, echo_port);
+    if (http == INVALID_SOCKET || echo == INVALID_SOCKET)
+    {
+        std::cerr << "could not open the origin listeners" << std::endl;
+        return 1;
+    }
+    const std::string payload(opt.size, 'x');
+    bool cacheable = opt.cacheable;
+    std::thread([http, &payload, cacheable]
+                { accept_loop(http, [&payload, cacheable](SOCKET c)
+                              { serve_http(c, &payload, cacheable); }); })
+        .detach();
+    std::thread([echo]
+                { accept_loop(echo, serve_echo); })
+        .detach();
+
+    std::vector<Stats> stats(opt.concurrency);
+    std::vector<std::thread> clients;
+    auto start = Clock::now();
+    auto until = start + std::chrono::seconds(opt.duration_s);
+    for (size_t i = 0; i < opt.concurrency; ++i)
+        clients.emplace_back([&, i]
+                             { Client(opt, http_port, echo_port, (unsigned)(i * 7919 + 1)).run(until, stats[i]); });
+    for (std::thread &t : clients)
+        t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Stats total;
+    for (Stats &s : stats)
+    {
+        total.gets += s.gets;
+        total.tunnels += s.tunnels;
+        total.errors += s.errors;
+        total.bytes += s.bytes;
+        total.connects += s.connects;
+        total.latency_us.insert(total.latency_us.end(), s.latency_us.begin(), s.latency_us.end());
+    }
+    std::sort(total.latency_us.begin(), total.latency_us.end());
+    uint64_t requests = total.gets + total.tunnels;
+
+    std::printf("{\"config\":{\"target\":\"%s\",\"concurrency\":%zu,\"duration_s\":%u,\"size\":%zu,"
+                "\"keepalive\":%g,\"connect\":%g,\"cacheable\":%s},",
+                opt.direct ? "direct" : (opt.proxy_host + ":" + std::to_string(opt.proxy_port)).c_str(),
+                opt.concurrency, opt.duration_s, opt.size, opt.keepalive, opt.connect,
+                opt.cacheable ? "true" : "false");
+    std::printf("\"requests\":%llu,\"gets\":%llu,\"tunnels\":%llu,\"errors\":%llu,\"connections\":%llu,"
+                "\"elapsed_s\":%.3f,\"req_per_s\":%.1f,\"mb_per_s\":%.2f,",
+                (unsigned long long)requests, (unsigned long long)total.gets, (unsigned long long)total.tunnels,
+                (unsigned long long)total.errors, (unsigned long long)total.connects, elapsed, requests / elapsed,
+                total.bytes / elapsed / 1e6);
+    const std::vector<uint32_t> &l = total.latency_us;
+    std::printf("\"latency_us\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n", percentile(l, 0.5),
+                percentile(l, 0.9), percentile(l, 0.99), percentile(l, 0.999), l.empty() ? 0 : l.back());
+
+    closesocket(http);
+    closesocket(echo);
+    net_cleanup();
+    return total.errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,180 @@
+/**
+ * @file parser_bench.cpp
+ * @brief Compares RequestParser against the istringstream parser it replaced.
+ * * Two workloads: a typical browser request head arriving in one read,
+ * and the same head trickling in a few bytes per read, which is where the
+ * old find("\r\n\r\n") after every recv turned quadratic.
+ *
+ * Build and run with: make bench && ./bench/parser_bench
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "http_request.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+/// The parser before the rewrite, condensed into one function.
+struct LegacyRequest
+{
+    std::string request_line, method, target, version, host, port;
+    std::map<std::string, std::string> headers;
+};
+
+std::string legacy_trim(const std::string &s)
+{
+    size_t start = 0;
+    while (start < s.size() && std::isspace((unsigned char)s[start]))
+        ++start;
+    size_t end = s.size();
+    while (end > start && std::isspace((unsigned char)s[end - 1]))
+        --end;
+    return s.substr(start, end - start);
+}
+
+std::string legacy_lower(const std::string &s)
+{
+    std::string r = s;
+    std::transform(r.begin(), r.end(), r.begin(), [](unsigned char c)
+                   { return (char)std::tolower(c); });
+    return r;
+}
+
+void legacy_parse(const std::string &data, LegacyRequest &req)
+{
+    std::istringstream rs(data);
+    std::getline(rs, req.request_line);
+    if (!req.request_line.empty() && req.request_line.back() == '\r')
+        req.request_line.pop_back();
+    std::istringstream rl(req.request_line);
+    rl >> req.method >> req.target >> req.version;
+
+    std::string line;
+    while (std::getline(rs, line) && line != "\r" && !line.empty())
+    {
+        if (line.back() == '\r')
+            line.pop_back();
+        size_t pos = line.find(':');
+        if (pos != std::string::npos)
+            req.headers[legacy_lower(legacy_trim(line.substr(0, pos)))] = legacy_trim(line.substr(pos + 1));
+    }
+
+    req.port = "80";
+    auto it = req.headers.find("host");
+    if (it != req.headers.end())
+    {
+        size_t colon = it->second.find(':');
+        req.host = it->second.substr(0, colon);
+        if (colon != std::string::npos)
+            req.port = it->second.substr(colon + 1);
+    }
+}
+
+const char kHead[] =
+    "GET http://www.example.com/assets/app.3f9c2d.js?v=1 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com/products/index.html\r\n"
+    "Cookie: session=4c0a5f1e9d8b7a6c5b4a3f2e1d0c9b8a; theme=dark; consent=1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n";
+
+template <typename F>
+double ns_per_head(size_t iterations, F &&parse_one)
+{
+    size_t sink = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        sink += parse_one();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    if (sink == 0)
+        std::cerr << "no host parsed" << std::endl;
+    return static_cast<double>(ns) / iterations;
+}
+
+/// Old engine loop: append, search the whole buffer, parse once complete.
+size_t legacy_incremental(const std::string &head, size_t step)
+{
+    std::string buf;
+    size_t end = std::string::npos;
+    for (size_t i = 0; end == std::string::npos && i < head.size(); i += step)
+    {
+        buf.append(head, i, step);
+        end = buf.find("\r\n\r\n");
+    }
+    LegacyRequest req;
+    legacy_parse(buf.substr(0, end + 4), req);
+    return req.host.size();
+}
+
+size_t parser_incremental(const std::string &head, size_t step)
+{
+    std::string buf, rest;
+    HttpRequest req;
+    RequestParser parser;
+    RequestParser::Result r = RequestParser::Result::Incomplete;
+    for (size_t i = 0; r == RequestParser::Result::Incomplete && i < head.size(); i += step)
+    {
+        buf.append(head, i, step);
+        r = parser.parse(buf, req);
+    }
+    parser.finish(buf, req, rest);
+    return req.host().size();
+}
+}
+
+int main()
+{
+    const std::string head(kHead);
+    HttpRequest req;
+
+    // Both parsers must agree on what matters to the proxy.
+    LegacyRequest legacy;
+    legacy_parse(head, legacy);
+    parse_request_head(head, req);
+    if (legacy.host != req.host() || legacy.port != req.port() || legacy.method != req.method() ||
+        legacy.headers["cookie"] != req.header("cookie"))
+    {
+        std::cerr << "parsers disagree" << std::endl;
+        return 1;
+    }
+
+    std::printf("%-22s %14s %14s\n", "workload", "legacy ns/op", "parser ns/op");
+
+    double legacy_ns = ns_per_head(200000, [&]()
+                                   { LegacyRequest r; legacy_parse(head, r); return r.host.size(); });
+    double parser_ns = ns_per_head(200000, [&]()
+                                   {
+        HttpRequest r;
+        RequestParser p;
+        p.parse(head, r);
+        return r.host_span.len; });
+    std::printf("%-22s %14.1f %14.1f\n", "whole head", legacy_ns, parser_ns);
+
+    for (size_t step : {size_t(64), size_t(8), size_t(1)})
+    {
+        size_t iterations = step == 1 ? 5000 : 50000;
+        legacy_ns = ns_per_head(iterations, [&]()
+                                { return legacy_incremental(head, step); });
+        parser_ns = ns_per_head(iterations, [&]()
+                                { return parser_incremental(head, step); });
+        std::string name = std::to_string(step) + " bytes per read";
+        std::printf("%-22s %14.1f %14.1f\n", name.c_str(), legacy_ns, parser_ns);
+    }
+    return 0;
+}
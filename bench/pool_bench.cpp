@@ -0,0 +1,212 @@
+/**
+ * @file pool_bench.cpp
+ * @brief Compares the work-stealing ThreadPool against the single-queue pool it replaced.
+ * * Two workloads at 1 to 64 threads: short tasks submitted from outside
+ * the pool, as the accept loop and the DNS resolver do, and a fork-join
+ * tree whose tasks spawn their own children. Reports tasks per second and
+ * the delay from enqueue to the start of each task.
+ *
+ * Build and run with: make bench && ./bench/pool_bench
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+/// The pool before the rewrite: one queue, one mutex, std::function tasks.
+class LegacyPool
+{
+public:
+    explicit LegacyPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this]
+                                 {
+                for (;;)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex);
+                        condition.wait(lock, [this]
+                                       { return stop || !tasks.empty(); });
+                        if (stop && tasks.empty())
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                } });
+    }
+
+    void enqueue(std::function<void()> task)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            tasks.push(std::move(task));
+        }
+        condition.notify_one();
+    }
+
+    ~LegacyPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (std::thread &w : workers)
+            w.join();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop = false;
+};
+
+struct Result
+{
+    double tasks_per_sec = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+};
+
+/// Roughly 200 ns of work that the compiler cannot drop.
+void spin_work(std::atomic<uint64_t> &sink)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < 64; ++i)
+        x ^= x << 7, x ^= x >> 9;
+    sink.fetch_add(x & 1, std::memory_order_relaxed);
+}
+
+void wait_for(const std::atomic<size_t> &done, size_t expected)
+{
+    while (done.load(std::memory_order_acquire) < expected)
+        std::this_thread::yield();
+}
+
+void fill_percentiles(std::vector<int64_t> &ns, Result &r)
+{
+    std::sort(ns.begin(), ns.end());
+    auto at = [&](double q)
+    { return ns[std::min(ns.size() - 1, (size_t)(q * ns.size()))] / 1000.0; };
+    r.p50_us = at(0.50);
+    r.p99_us = at(0.99);
+    r.p999_us = at(0.999);
+}
+
+/// Tasks enqueued one by one from the benchmark thread.
+template <typename Pool>
+Result external(size_t threads, size_t tasks)
+{
+    std::vector<int64_t> delay(tasks);
+    std::atomic<size_t> done{0};
+    std::atomic<uint64_t> sink{0};
+    Result r;
+    {
+        Pool pool(threads);
+        auto start = Clock::now();
+        for (size_t i = 0; i < tasks; ++i)
+        {
+            auto queued = Clock::now();
+            pool.enqueue([&, i, queued]()
+                         {
+                delay[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - queued).count();
+                spin_work(sink);
+                done.fetch_add(1, std::memory_order_release); });
+        }
+        wait_for(done, tasks);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        r.tasks_per_sec = tasks / secs;
+    }
+    fill_percentiles(delay, r);
+    return r;
+}
+
+/// A binary tree of tasks: every inner task enqueues its two children.
+template <typename Pool>
+struct ForkJoin
+{
+    Pool *pool = nullptr;
+    std::atomic<size_t> done{0};
+    std::atomic<uint64_t> sink{0};
+    std::vector<int64_t> delay;
+    std::atomic<size_t> next{0};
+
+    void spawn(unsigned depth)
+    {
+        auto queued = Clock::now();
+        pool->enqueue([this, depth, queued]()
+                      {
+            size_t slot = next.fetch_add(1, std::memory_order_relaxed);
+            delay[slot] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - queued).count();
+            spin_work(sink);
+            if (depth > 0)
+            {
+                spawn(depth - 1);
+                spawn(depth - 1);
+            }
+            done.fetch_add(1, std::memory_order_release); });
+    }
+};
+
+template <typename Pool>
+Result fork_join(size_t threads, unsigned depth)
+{
+    size_t tasks = (size_t(1) << (depth + 1)) - 1;
+    ForkJoin<Pool> tree;
+    tree.delay.resize(tasks);
+    Result r;
+    {
+        Pool pool(threads);
+        tree.pool = &pool;
+        auto start = Clock::now();
+        tree.spawn(depth);
+        wait_for(tree.done, tasks);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        r.tasks_per_sec = tasks / secs;
+    }
+    fill_percentiles(tree.delay, r);
+    return r;
+}
+
+void print(const char *workload, size_t threads, const char *pool, const Result &r)
+{
+    std::printf("%-10s %7zu %-9s %12.0f %9.1f %9.1f %9.1f\n", workload, threads, pool, r.tasks_per_sec, r.p50_us,
+                r.p99_us, r.p999_us);
+}
+}
+
+int main()
+{
+    const size_t kTasks = 200000;
+    const unsigned kDepth = 17; // 262143 tasks
+
+    std::printf("%-10s %7s %-9s %12s %9s %9s %9s\n", "workload", "threads", "pool", "tasks/s", "p50 us", "p99 us",
+                "p99.9 us");
+    for (size_t threads : {1, 2, 4, 8, 16, 32, 64})
+    {
+        print("external", threads, "legacy", external<LegacyPool>(threads, kTasks));
+        print("external", threads, "stealing", external<ThreadPool>(threads, kTasks));
+        print("fork-join", threads, "legacy", fork_join<LegacyPool>(threads, kDepth));
+        print("fork-join", threads, "stealing", fork_join<ThreadPool>(threads, kDepth));
+    }
+    return 0;
+}
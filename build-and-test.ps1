@@ -5,7 +5,7 @@ $projRoot = Get-Location
 Write-Host "--- Starting Full Build and Test Cycle ---" -ForegroundColor Cyan
 
 Write-Host "[1/4] Compiling Proxy..." -ForegroundColor Yellow
-g++ -Iinclude src\main.cpp src\proxy_server.cpp src\filter_manager.cpp src\logger.cpp src\metrics.cpp -lws2_32 -o proxy.exe
+g++ -Iinclude src\main.cpp src\proxy_server.cpp src\filter_manager.cpp src\file_watcher.cpp src\logger.cpp src\metrics.cpp src\http_request.cpp src\http_response.cpp src\body_framer.cpp src\upstream_pool.cpp src\dns_resolver.cpp src\request_handler.cpp src\event_loop.cpp src\uring_loop.cpp src\thread_pool.cpp src\buffer_pool.cpp src\rate_limiter.cpp src\timer_wheel.cpp src\happy_eyeballs.cpp src\response_cache.cpp -lws2_32 -o proxy.exe
 
 Write-Host "[2/4] Running CONNECT and Filter tests..." -ForegroundColor Yellow
 powershell -ExecutionPolicy Bypass -File .\tests\connect_tests.ps1
@@ -0,0 +1,104 @@
+#ifndef BODY_FRAMER_H
+#define BODY_FRAMER_H
+
+/**
+ * @file body_framer.h
+ * @brief Finds where an HTTP/1.x message body ends as its bytes stream past.
+ * * Bodies are relayed unmodified; the framer only counts them so that a
+ * connection can be reused for the next message once the current one is
+ * complete. Chunked bodies are scanned byte by byte, Content-Length bodies
+ * are just counted and may be moved without being looked at (see skip()).
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+struct HttpRequest;
+struct HttpResponse;
+
+/**
+ * @class BodyFramer
+ * @brief Incremental body delimiter for one message.
+ */
+class BodyFramer
+{
+public:
+    enum class Mode
+    {
+        None,      ///< No body (HEAD, 1xx, 204, 304, or a request without one).
+        Length,    ///< Content-Length bytes.
+        Chunked,   ///< Transfer-Encoding: chunked, up to and including the trailers.
+        UntilClose ///< Response without a length: the body ends when the origin closes.
+    };
+
+    BodyFramer() = default;
+    BodyFramer(Mode mode, uint64_t length);
+
+    /**
+     * @brief A framer in the error state, for heads whose framing headers are invalid.
+     */
+    static BodyFramer malformed();
+
+    /**
+     * @brief Accounts for the next bytes of the stream.
+     * @return How many of the n bytes belong to this body. Anything beyond
+     * that belongs to the next message.
+     */
+    size_t consume(const char *data, size_t n);
+
+    /**
+     * @brief Accounts for bytes that were relayed without being inspected.
+     * * Only valid while opaque() is true; n must not exceed remaining().
+     */
+    void skip(size_t n);
+
+    /**
+     * @brief True if the body can be counted without looking at its bytes.
+     */
+    bool opaque() const { return m_mode == Mode::Length || m_mode == Mode::UntilClose; }
+
+    /**
+     * @brief Bytes left in an opaque body (UINT64_MAX for UntilClose).
+     */
+    uint64_t remaining() const;
+
+    bool done() const { return m_state == State::Done; }
+    bool error() const { return m_state == State::Error; }
+    Mode mode() const { return m_mode; }
+
+private:
+    enum class State
+    {
+        Body,
+        ChunkSize,
+        ChunkExt,
+        ChunkData,
+        ChunkDataEnd,
+        TrailerStart,
+        TrailerLine,
+        TrailerEnd,
+        Done,
+        Error
+    };
+
+    Mode m_mode = Mode::None;
+    State m_state = State::Done;
+    uint64_t m_left = 0;
+    bool m_sawDigit = false;
+};
+
+/**
+ * @brief Framing of a request body (Content-Length or chunked; otherwise none).
+ * * A malformed Content-Length yields a framer in the error state.
+ */
+BodyFramer request_framer(const HttpRequest &req);
+
+/**
+ * @brief Framing of a response body per RFC 9112 section 6.3.
+ * @param request_method The method of the request being answered ("HEAD" has no body).
+ */
+BodyFramer response_framer(const HttpResponse &resp, std::string_view request_method);
+
+#endif // BODY_FRAMER_H
@@ -0,0 +1,199 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+/**
+ * @file buffer_pool.h
+ * @brief Pooled relay buffers and slab storage for connection objects.
+ * * Both recycle what they hand out instead of returning it to the heap,
+ * so once the proxy has reached its working set of connections, serving
+ * more of them no longer allocates. pool_stats() reports how many blocks
+ * and objects were ever allocated against how many were reused, which
+ * makes that visible under load.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * @struct PoolStats
+ * @brief Process-wide counters of IoBuffer and Slab.
+ */
+struct PoolStats
+{
+    uint64_t buffers_allocated = 0; ///< Blocks taken from the heap.
+    uint64_t buffers_reused = 0;    ///< acquire() calls served by a recycled block.
+    uint64_t buffers_in_use = 0;    ///< Blocks currently held by at least one handle.
+    uint64_t objects_allocated = 0; ///< Slab objects constructed.
+    uint64_t objects_reused = 0;    ///< Slab acquisitions served by a released object.
+};
+
+PoolStats pool_stats();
+
+/// Counts a Slab acquisition; called by the template below.
+void note_slab_acquire(bool reused);
+
+/**
+ * @class IoBuffer
+ * @brief Reference-counted handle to a fixed-size pooled buffer.
+ * * Copies share the block, and the last handle to go recycles it. Each
+ * thread keeps a small cache of free blocks; beyond that, and when a
+ * thread exits, blocks go to a shared depot. That way the short-lived
+ * relay threads of CONNECT tunnels reuse blocks as well. A block may be
+ * released on a different thread than the one that acquired it.
+ */
+class IoBuffer
+{
+public:
+    static constexpr size_t kSize = 16384;
+
+    struct Block
+    {
+        std::atomic<uint32_t> refs{1};
+        Block *next = nullptr;
+        alignas(64) char bytes[kSize];
+    };
+
+    IoBuffer() = default;
+    IoBuffer(const IoBuffer &other) noexcept : m_block(other.m_block)
+    {
+        if (m_block)
+            m_block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    IoBuffer(IoBuffer &&other) noexcept : m_block(other.m_block) { other.m_block = nullptr; }
+    IoBuffer &operator=(IoBuffer other) noexcept
+    {
+        std::swap(m_block, other.m_block);
+        return *this;
+    }
+    ~IoBuffer() { reset(); }
+
+    /**
+     * @brief A free block from this thread's cache, the depot, or the heap, in that order.
+     */
+    static IoBuffer acquire();
+
+    /**
+     * @brief Drops this handle; the block is recycled if it was the last one.
+     */
+    void reset();
+
+    char *data() const { return m_block->bytes; }
+    static constexpr size_t size() { return kSize; }
+    explicit operator bool() const { return m_block != nullptr; }
+
+private:
+    explicit IoBuffer(Block *block) : m_block(block) {}
+
+    Block *m_block = nullptr;
+};
+
+/**
+ * @class Slab
+ * @brief Connection objects addressed by id, recycled rather than freed.
+ * * Owned and used by a single event loop thread. A released object is
+ * kept, so the strings and vectors inside it keep their capacity for the
+ * next connection. T needs a uint64_t member named id and a reset()
+ * that returns the object to its initial state without freeing that
+ * memory. An id combines a slot with a sequence number, so find() with
+ * the id of a released object fails even after its slot has been
+ * reused.
+ */
+template <typename T>
+class Slab
+{
+public:
+    Slab() = default;
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    ~Slab()
+    {
+        for (T *obj : m_slots)
+            delete obj;
+        for (T *obj : m_spare)
+            delete obj;
+    }
+
+    /**
+     * @brief Returns an object in its initial state with a fresh id.
+     */
+    T *acquire()
+    {
+        bool reused = !m_spare.empty();
+        T *obj;
+        if (reused)
+        {
+            obj = m_spare.back();
+            m_spare.pop_back();
+        }
+        else
+            obj = new T();
+        note_slab_acquire(reused);
+
+        uint64_t slot;
+        if (!m_free.empty())
+        {
+            slot = m_free.back();
+            m_free.pop_back();
+        }
+        else
+        {
+            slot = m_slots.size();
+            m_slots.push_back(nullptr);
+        }
+        m_slots[slot] = obj;
+        obj->id = (++m_seq << kSlotBits) | slot;
+        ++m_live;
+        return obj;
+    }
+
+    /**
+     * @brief Resets obj and keeps it for a later acquire().
+     */
+    void release(T *obj)
+    {
+        uint32_t slot = static_cast<uint32_t>(obj->id & kSlotMask);
+        m_slots[slot] = nullptr;
+        m_free.push_back(slot);
+        obj->reset();
+        m_spare.push_back(obj);
+        --m_live;
+    }
+
+    /**
+     * @return The live object with this id, or nullptr.
+     */
+    T *find(uint64_t id) const
+    {
+        uint64_t slot = id & kSlotMask;
+        if (slot >= m_slots.size())
+            return nullptr;
+        T *obj = m_slots[slot];
+        return obj && obj->id == id ? obj : nullptr;
+    }
+
+    size_t size() const { return m_live; }
+
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (T *obj : m_slots)
+            if (obj)
+                f(*obj);
+    }
+
+private:
+    static constexpr unsigned kSlotBits = 24;
+    static constexpr uint64_t kSlotMask = (uint64_t(1) << kSlotBits) - 1;
+
+    std::vector<T *> m_slots; ///< Live objects by slot; nullptr if free.
+    std::vector<uint32_t> m_free;
+    std::vector<T *> m_spare; ///< Released objects awaiting reuse.
+    uint64_t m_seq = 0;
+    size_t m_live = 0;
+};
+
+#endif // BUFFER_POOL_H
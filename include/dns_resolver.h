@@ -0,0 +1,105 @@
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
+/**
+ * @file dns_resolver.h
+ * @brief Header for the DnsResolver class.
+ * * An in-process cache in front of getaddrinfo(). Lookups never block the
+ * caller: a cache hit is answered inline and a miss is handed to a small
+ * pool of resolver threads, whose answer is delivered through a callback.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "net_compat.h"
+
+/**
+ * @class DnsResolver
+ * @brief Sharded, coalescing, refresh-ahead DNS cache.
+ * * - Entries are keyed by host and port and live for a fixed TTL.
+ *   getaddrinfo() does not report record TTLs, so this TTL is an upper
+ *   bound on how stale an answer may get.
+ * - "No such host" answers are cached for a shorter negative TTL.
+ *   Transient failures (EAI_AGAIN) are not cached at all.
+ * - Concurrent misses for the same key share one getaddrinfo() call.
+ * - Once an entry has used most of its TTL, the next hit still returns
+ *   the cached answer but also starts a background refresh, so popular
+ *   hosts never expire in front of a request.
+ * - Each entry also remembers which address family last connected, so
+ *   that the next connection race starts with it (see happy_eyeballs.h).
+ */
+class DnsResolver
+{
+public:
+    using Addresses = std::shared_ptr<addrinfo>; ///< Owning pointer to a getaddrinfo() list.
+
+    /**
+     * @brief Receives the outcome of a lookup.
+     * @param addrs The address list, or null on failure.
+     * @param rc 0 on success, otherwise a getaddrinfo() error code.
+     */
+    using Callback = std::function<void(Addresses addrs, int rc)>;
+
+    struct Stats
+    {
+        uint64_t hits = 0;          ///< Answered from cache (positive or negative).
+        uint64_t misses = 0;        ///< Needed a getaddrinfo() call.
+        uint64_t negative_hits = 0; ///< Hits on a cached failure.
+        uint64_t coalesced = 0;     ///< Misses that joined a lookup already in flight.
+        uint64_t refreshes = 0;     ///< Background refresh-ahead lookups started.
+        size_t entries = 0;
+    };
+
+    /**
+     * @param threads Resolver threads running getaddrinfo().
+     * @param ttl Lifetime of a successful answer.
+     * @param negative_ttl Lifetime of a "no such host" answer.
+     */
+    DnsResolver(size_t threads = 8,
+                std::chrono::seconds ttl = std::chrono::seconds(60),
+                std::chrono::seconds negative_ttl = std::chrono::seconds(10));
+
+    /**
+     * @brief Destructor. Waits for lookups in flight; their callbacks still run.
+     */
+    ~DnsResolver();
+
+    /**
+     * @brief Starts a lookup.
+     * @return true if the answer came from cache: addrs and rc are filled
+     * in and cb is never called. false: cb will be called exactly once from
+     * a resolver thread.
+     */
+    bool resolve(const std::string &host, const std::string &port, Addresses &addrs, int &rc, Callback cb);
+
+    /**
+     * @brief Blocking form of resolve() for the thread engine.
+     * @return 0 on success, otherwise a getaddrinfo() error code.
+     */
+    int resolve_sync(const std::string &host, const std::string &port, Addresses &addrs);
+
+    /**
+     * @brief The address family that last connected to host:port.
+     * @return AF_INET, AF_INET6, or AF_UNSPEC if nothing is known.
+     */
+    int preferred_family(const std::string &host, const std::string &port) const;
+
+    /**
+     * @brief Records that an address of family won a connection race to host:port.
+     * * Only kept while the answer for host:port is cached.
+     */
+    void record_family(const std::string &host, const std::string &port, int family);
+
+    Stats get_stats() const;
+
+private:
+    struct Impl;
+    Impl *pimpl = nullptr;
+};
+
+#endif // DNS_RESOLVER_H
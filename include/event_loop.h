@@ -0,0 +1,89 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/**
+ * @file event_loop.h
+ * @brief Event-driven data plane used on Linux.
+ * * Each EventLoop owns one thread. Accept, header read, upstream connect
+ * and the bidirectional relay are driven as a per-connection state
+ * machine, so an idle keep-alive or CONNECT tunnel costs a few hundred
+ * bytes of state instead of one or more OS threads. Two backends exist:
+ * an edge-triggered epoll reactor and an io_uring completion loop. Both
+ * route requests through request_handler.h, so they behave identically.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+struct ProxyContext;
+class DnsResolver;
+
+/**
+ * @class EventLoop
+ * @brief One event-loop thread servicing any number of proxied connections.
+ */
+class EventLoop
+{
+public:
+    /**
+     * @brief Creates an edge-triggered epoll loop.
+     * @param ctx Shared filter/logger/metrics services.
+     * @param resolver Caching resolver; misses run off the loop thread.
+     * @param index Position of this loop among its siblings (used for diagnostics).
+     */
+    static std::unique_ptr<EventLoop> create_epoll(ProxyContext &ctx, DnsResolver &resolver, int index);
+
+    /**
+     * @brief Creates an io_uring loop (multishot accept, provided buffer ring).
+     * @return nullptr if the running kernel lacks the io_uring features it needs.
+     */
+    static std::unique_ptr<EventLoop> create_uring(ProxyContext &ctx, DnsResolver &resolver, int index);
+
+    /**
+     * @brief Stops the loop thread and closes every connection it owns.
+     */
+    virtual ~EventLoop() = default;
+
+    /**
+     * @brief Registers a listening socket with this loop.
+     * * The socket may be shared with sibling loops; EPOLLEXCLUSIVE makes
+     * sure only one of them is woken per incoming connection. With
+     * SO_REUSEPORT sharding each loop gets a listener of its own instead.
+     * Ownership stays with the caller.
+     * @return false if the socket could not be registered.
+     */
+    virtual bool add_listener(int fd) = 0;
+
+    /**
+     * @brief Restricts the loop thread to a single CPU. Must be called before start().
+     * @param cpu Zero-based CPU index, or -1 to leave scheduling to the OS.
+     */
+    virtual void pin_to_cpu(int cpu) = 0;
+
+    /**
+     * @brief Spawns the loop thread.
+     */
+    virtual void start() = 0;
+
+    /**
+     * @brief Signals the loop thread to exit and joins it.
+     */
+    virtual void stop() = 0;
+
+    /**
+     * @brief Queues a task to run on the loop thread. Safe to call from any thread.
+     */
+    virtual void post(std::function<void()> task) = 0;
+
+protected:
+    static constexpr size_t kMaxHeaderBytes = 65536;
+    static constexpr std::chrono::seconds kHeaderTimeout{10};  ///< Accept until the request head is complete.
+    static constexpr std::chrono::seconds kConnectTimeout{10}; ///< Resolve plus upstream connect.
+    static constexpr std::chrono::seconds kIdleTimeout{60};    ///< No relay progress in either direction.
+    static constexpr std::chrono::hours kMaxLifetime{24};      ///< Longest a client connection may stay open.
+    static constexpr std::chrono::seconds kPruneInterval{1};   ///< How often idle pooled upstreams are checked.
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,48 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+/**
+ * @file file_watcher.h
+ * @brief Header for the FileWatcher class.
+ * * Runs a callback on a background thread whenever a configuration file
+ * changes, so rules can be reloaded without restarting the proxy.
+ */
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+/**
+ * @class FileWatcher
+ * @brief Watches one file and reports changes after they settle.
+ * * On Linux the file's directory is watched with inotify, which also
+ * catches editors that save by writing a temporary file and renaming it
+ * over the original. Elsewhere the modification time is polled once a
+ * second. Bursts of events are coalesced: the callback runs once the file
+ * has been quiet for a short moment.
+ */
+class FileWatcher
+{
+public:
+    /**
+     * @param path File to watch.
+     * @param on_change Called from the watcher thread after each change.
+     */
+    FileWatcher(const std::string &path, std::function<void()> on_change);
+
+    /**
+     * @brief Destructor. Stops and joins the watcher thread.
+     */
+    ~FileWatcher();
+
+private:
+    void run();
+
+    std::string m_path;
+    std::function<void()> m_onChange;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+#endif // FILE_WATCHER_H
@@ -8,7 +8,10 @@
  * restricted traffic based on a configuration file.
  */
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 /**
  * @class FilterManager
@@ -19,6 +22,39 @@
 class FilterManager
 {
 public:
+    /**
+     * @struct LoadStats
+     * @brief What the last successful load() read and built.
+     */
+    struct LoadStats
+    {
+        size_t rules = 0;        ///< Distinct rules, as get_rule_count().
+        size_t duplicates = 0;   ///< Rule lines that repeated an earlier rule.
+        size_t rejected = 0;     ///< Skipped lines with a '/' that are not an address range.
+        size_t file_bytes = 0;
+        size_t memory_bytes = 0; ///< Held by the compiled ruleset.
+        size_t threads = 0;      ///< Slices the file was parsed in, in parallel.
+        uint64_t load_us = 0;    ///< Wall time from opening the file to publishing the rules.
+        bool snapshot = false;   ///< Mapped by load_snapshot() rather than parsed.
+    };
+
+    /**
+     * @struct FilterStats
+     * @brief How well the Bloom filter in front of the domain table works.
+     * * Every label suffix of a host is checked against the filter before
+     * the table. rejected counts suffixes it ruled out; false_positives
+     * those it let through that the table did not hold, so the observed
+     * false-positive rate is false_positives / (rejected + false_positives).
+     * Each thread adds its rejections in batches, so they lag slightly.
+     */
+    struct FilterStats
+    {
+        size_t bytes = 0;
+        double expected_fp_rate = 0; ///< Predicted from how full the filter is.
+        uint64_t rejected = 0;
+        uint64_t false_positives = 0;
+    };
+
     /**
      * @brief Default constructor.
      */
@@ -36,18 +72,67 @@ public:
      * - Exact domains: example.com
      * - Wildcard domains: *.example.com
      * - Exact IPs: 192.0.2.5
+     * - CIDR ranges: 10.0.0.0/8, 2001:db8::/32
+     * * The file is memory-mapped and cut at line boundaries into slices
+     * of at least 1 MiB, parsed on one thread per core. Repeated rules
+     * are counted once.
+     * * Rules are compiled into a hash table of domains and a sorted list of
+     * address ranges, then published as a new immutable snapshot. May be
+     * called at any time; lookups in flight finish on the old snapshot.
+     * If the file cannot be opened the current rules stay in force.
      * * @param path The relative or absolute path to blocked_domains.txt.
      * @return true if the file was successfully opened and parsed, false otherwise.
      */
     bool load(const std::string &path);
 
+    /**
+     * @brief Maps a precompiled ruleset written by save_snapshot().
+     * * The file is used in place, read-only: nothing is parsed or copied,
+     * and every process mapping the same snapshot shares its pages. It is
+     * refused if its format version or byte order differ from this build,
+     * if it is truncated, or if source_path exists and its size or
+     * modification time no longer match the text it was compiled from.
+     * The current rules stay in force when it is refused.
+     * * @param path The snapshot, e.g. config/blocked_domains.bin.
+     * @param source_path The text blocklist the snapshot stands in for.
+     * @return true if the snapshot is now the active ruleset.
+     */
+    bool load_snapshot(const std::string &path, const std::string &source_path);
+
+    /**
+     * @brief Writes the active ruleset as a snapshot for load_snapshot().
+     * * The file is written beside path and renamed over it, so processes
+     * mapping the previous snapshot are not disturbed.
+     * * @param source_path The text file the rules were loaded from; its
+     * size and modification time are recorded to detect a stale snapshot.
+     * @return false if the file could not be written.
+     */
+    bool save_snapshot(const std::string &path, const std::string &source_path) const;
+
     /**
      * @brief Evaluates whether a target should be blocked.
-     * * Compares the provided host or IP against the loaded ruleset.
+     * * Compares the provided host or IP against the loaded ruleset. Costs
+     * O(length of the host) for names and O(log ranges) for addresses,
+     * independent of how many rules are loaded. A Bloom filter answers
+     * for most suffixes of a host that matches no rule, one cache line
+     * each. Takes no lock unless the rules changed since this thread's
+     * previous call.
      * * @param hostOrIp The string to check (e.g., "badsite.com" or "10.0.0.1").
      * @return true if the target is found in the blacklist (block it), false if allowed.
      */
-    bool is_blocked(const std::string &hostOrIp) const;
+    bool is_blocked(std::string_view hostOrIp) const;
+
+    /**
+     * @brief Number of rules in the current snapshot.
+     */
+    size_t get_rule_count() const;
+
+    LoadStats get_load_stats() const;
+
+    /**
+     * @brief Filter counters for the current snapshot; they restart on every load.
+     */
+    FilterStats get_filter_stats() const;
 
 private:
     /**
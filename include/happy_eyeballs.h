@@ -0,0 +1,53 @@
+#ifndef HAPPY_EYEBALLS_H
+#define HAPPY_EYEBALLS_H
+
+/**
+ * @file happy_eyeballs.h
+ * @brief Racing connection attempts over every resolved address (RFC 8305).
+ * * A destination that resolves to several addresses is no longer tied to
+ * the first one. Attempts start one after another, kAttemptDelay apart or
+ * as soon as the previous one fails, and the first to connect wins; the
+ * others are abandoned. Address families alternate, starting with the one
+ * that last connected to the destination, so an unreachable IPv6 or IPv4
+ * path costs one attempt delay instead of a connect timeout.
+ */
+
+#include <chrono>
+#include <cstddef>
+
+#include "net_compat.h"
+
+/// RFC 8305 "Connection Attempt Delay": the head start each attempt gets over the next.
+inline constexpr std::chrono::milliseconds kAttemptDelay{250};
+
+/**
+ * @struct ConnectPlan
+ * @brief The addresses to try, in order. Points into a getaddrinfo() list.
+ */
+struct ConnectPlan
+{
+    static constexpr size_t kMaxAddresses = kMaxConnectWait; ///< Addresses past this are not tried.
+
+    const addrinfo *addrs[kMaxAddresses] = {};
+    size_t count = 0;
+};
+
+/**
+ * @brief Orders the addresses of list for racing.
+ * * IPv6 and IPv4 addresses alternate, each family keeping the order
+ * getaddrinfo() gave it. The first address is of family preferred, or
+ * IPv6 if that is AF_UNSPEC, as RFC 8305 recommends. list must outlive
+ * the plan.
+ */
+void plan_connect(const addrinfo *list, int preferred, ConnectPlan &plan);
+
+/**
+ * @brief Runs the race on blocking sockets, for the thread engine.
+ * @param timeout_ms Budget for the whole race.
+ * @param family Receives the family of the winning address.
+ * @param timed_out Set if the budget ran out with attempts still pending.
+ * @return The connected socket, back in blocking mode, or INVALID_SOCKET.
+ */
+SOCKET race_connect(const ConnectPlan &plan, unsigned timeout_ms, int &family, bool &timed_out);
+
+#endif // HAPPY_EYEBALLS_H
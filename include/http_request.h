@@ -0,0 +1,181 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+/**
+ * @file http_request.h
+ * @brief Parsing of the HTTP/1.x request head shared by every I/O engine.
+ * * RequestParser works on the engine's own receive buffer: each call only
+ * looks at bytes it has not seen before, and what it finds is recorded as
+ * offsets into that buffer, so nothing is copied or allocated while a
+ * head is being read. Once the head is complete it is moved into the
+ * HttpRequest, whose accessors return views into it.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <string>
+#include <string_view>
+
+/**
+ * @struct HttpRequest
+ * @brief A parsed request line plus headers and the derived target.
+ * * Every field is a view into head, so a request stays valid when it is
+ * copied or moved.
+ */
+struct HttpRequest
+{
+    static constexpr size_t kMaxHeaders = 64; ///< Heads with more fields are rejected.
+
+    struct Span
+    {
+        uint32_t off = 0;
+        uint32_t len = 0;
+    };
+
+    struct Field
+    {
+        Span name;  ///< As sent (not case-folded).
+        Span value; ///< Without surrounding whitespace.
+    };
+
+    std::string head; ///< The raw head, up to and including the blank line.
+    Span line;        ///< Request line without the trailing CRLF.
+    Span method_span;
+    Span target_span;
+    Span version_span;
+    Span host_span; ///< Empty if no host could be derived.
+    Span port_span; ///< Empty: use the default port for the method.
+    Field fields[kMaxHeaders];
+    uint32_t field_count = 0;
+
+    std::string_view request_line() const { return view(line); }
+    std::string_view method() const { return view(method_span); }
+    std::string_view target() const { return view(target_span); }
+    std::string_view version() const { return view(version_span); }
+    std::string_view host() const { return view(host_span); } ///< From the CONNECT target or the Host header.
+    std::string_view port() const;                            ///< "443" for CONNECT, "80" otherwise by default.
+
+    std::string_view header_name(size_t i) const { return view(fields[i].name); }
+    std::string_view header_value(size_t i) const { return view(fields[i].value); }
+
+    /**
+     * @brief Value of the first header called name (compared case-insensitively).
+     * @return An empty view if there is none.
+     */
+    std::string_view header(std::string_view name) const;
+    bool has_header(std::string_view name) const;
+
+    std::string_view view(Span s) const { return std::string_view(head.data() + s.off, s.len); }
+
+    /**
+     * @brief Empties the request but keeps the capacity of head.
+     */
+    void clear();
+};
+
+/**
+ * @class RequestParser
+ * @brief Resumable request-head parser.
+ * * Feed it the same buffer again after every receive; it picks up where it
+ * stopped, so a head that trickles in byte by byte is still scanned once.
+ * Line ends are found with SSE2 on x86-64, 16 bytes per step, and the same
+ * scan rejects control characters.
+ */
+class RequestParser
+{
+public:
+    enum class Result
+    {
+        Incomplete, ///< Need more bytes.
+        Complete,   ///< The head ends at head_length().
+        Invalid     ///< Malformed; the connection should be dropped.
+    };
+
+    /**
+     * @brief Parses the bytes of buffer not examined by an earlier call.
+     * @param req Receives the fields, as offsets into buffer.
+     */
+    Result parse(const char *buffer, size_t size, HttpRequest &req);
+    Result parse(const std::string &buffer, HttpRequest &req) { return parse(buffer.data(), buffer.size(), req); }
+
+    /**
+     * @brief Moves a completed head out of buffer into req.head.
+     * * Bytes past the head (a pipelined request) are left in rest. An
+     * invalid head is moved as well, so the request line can be logged.
+     * buffer is left empty with the capacity req.head had, so that both
+     * strings can be reused without allocating.
+     */
+    void finish(std::string &buffer, HttpRequest &req, std::string &rest);
+
+    size_t head_length() const { return m_pos; }
+    void reset() { *this = RequestParser(); }
+
+private:
+    enum class State
+    {
+        RequestLine,
+        Headers,
+        Done,
+        Error
+    };
+
+    Result parse_line(const char *buffer, size_t begin, size_t end, HttpRequest &req);
+    bool derive_target(const char *buffer, HttpRequest &req);
+
+    State m_state = State::RequestLine;
+    size_t m_pos = 0;  ///< Start of the line being read.
+    size_t m_scan = 0; ///< Bytes of that line already searched for its end.
+};
+
+/**
+ * @brief Parses a complete request head (everything up to and including "\r\n\r\n").
+ * @param data Raw bytes received from the client; copied into req.head.
+ * @param req Receives the parsed request. host is left empty if it cannot be derived.
+ */
+void parse_request_head(const std::string &data, HttpRequest &req);
+
+/**
+ * @brief Reads "Name: value" lines up to the blank line that ends a head.
+ * * Used by the response parser. Keys are lower-cased and trimmed; a
+ * repeated header keeps its last value.
+ */
+void parse_header_fields(std::istream &in, std::map<std::string, std::string> &headers);
+
+/**
+ * @brief Case-insensitive search for a token in a comma-separated header value.
+ */
+bool header_has_token(std::string_view value, std::string_view token);
+
+/**
+ * @brief Whether the client wants its connection kept open after this request.
+ * * Proxy-Connection takes precedence over Connection, since that is what
+ * clients talking to an explicit proxy send.
+ */
+bool request_keep_alive(const HttpRequest &req);
+
+/// Most pieces forward_request_pieces() can produce.
+inline constexpr size_t kMaxForwardPieces = HttpRequest::kMaxHeaders + 2;
+
+/**
+ * @brief Lays out the head that is sent upstream for a plain HTTP request.
+ * * The client's bytes are reused as they are: the pieces are the runs of
+ * lines in req.head between hop-by-hop headers (Connection,
+ * Proxy-Connection, Keep-Alive, TE, Proxy-Authorization and any header
+ * named in Connection), followed by a "Connection: keep-alive" (pooled
+ * upstream) or "Connection: close" line and the blank line. Send them
+ * with one gathered write. Content-Length is dropped as well when the
+ * request carries Transfer-Encoding, so that the origin frames the body
+ * the way the proxy did.
+ * @param pieces Room for kMaxForwardPieces views.
+ * @return How many pieces were filled in.
+ */
+size_t forward_request_pieces(const HttpRequest &req, bool keep_alive, std::string_view *pieces);
+
+/**
+ * @brief The same head as forward_request_pieces(), copied into one string.
+ */
+std::string build_forward_request(const HttpRequest &req, bool keep_alive = false);
+
+#endif // HTTP_REQUEST_H
@@ -0,0 +1,51 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+/**
+ * @file http_response.h
+ * @brief Parsing of the HTTP/1.x response head relayed back to the client.
+ * * The proxy only needs a handful of facts about a response: its status,
+ * whether the origin will keep the connection open, and how the body is
+ * delimited (see body_framer.h). The head itself is passed through
+ * verbatim except for the hop-by-hop connection headers.
+ */
+
+#include <map>
+#include <string>
+
+/**
+ * @struct HttpResponse
+ * @brief A parsed status line plus headers.
+ */
+struct HttpResponse
+{
+    std::string status_line; ///< First line without the trailing CRLF.
+    std::string version;
+    int status = 0;
+    std::map<std::string, std::string> headers; ///< Keys are lower-cased and trimmed.
+};
+
+/**
+ * @brief Parses a complete response head (everything up to and including "\r\n\r\n").
+ * @return false if the status line is not a valid HTTP/1.x status line.
+ */
+bool parse_response_head(const std::string &data, HttpResponse &resp);
+
+/**
+ * @brief Whether the origin allows the connection to be reused after this response.
+ * * HTTP/1.1 defaults to persistent unless "Connection: close" is present;
+ * HTTP/1.0 is persistent only with an explicit "Connection: keep-alive".
+ */
+bool response_keep_alive(const HttpResponse &resp);
+
+/**
+ * @brief Rewrites the hop-by-hop connection headers of a raw response head.
+ * * Connection, Keep-Alive and Proxy-Connection lines are dropped and a
+ * single "Connection: keep-alive" or "Connection: close" is appended,
+ * reflecting what the proxy will do with the client connection. All other
+ * lines keep their original order and spelling.
+ * @param head Raw head including the terminating blank line.
+ */
+std::string rewrite_response_head(const std::string &head, bool keep_alive);
+
+#endif // HTTP_RESPONSE_H
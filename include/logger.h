@@ -1,25 +1,54 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+/**
+ * @file logger.h
+ * @brief Header for the Logger class.
+ * * Access logging off the request path: callers format a record into a
+ * per-thread ring buffer and a background writer batches the rings into
+ * large writes to the log file.
+ */
+
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 class Logger
 {
 public:
+    struct Options
+    {
+        unsigned flush_ms = 100;                  ///< Longest a record waits before it is written.
+        size_t ring_bytes = 256 * 1024;           ///< Per-thread buffer; a record that does not fit is dropped.
+        size_t max_file_bytes = 64 * 1024 * 1024; ///< Rotate once the file grows past this (0 = never).
+        unsigned keep_files = 3;                  ///< Rotated files kept as path.1 .. path.N.
+        bool echo_stdout = true;                  ///< Also copy every batch to stdout.
+    };
+
     Logger() = default;
     ~Logger();
 
-   
-    bool init(const std::string &path);
+    /**
+     * @brief Opens the log file in append mode and starts the writer thread.
+     */
+    bool init(const std::string &path, const Options &options);
+    bool init(const std::string &path); ///< init() with default Options.
 
-   
-    void log(const std::string &client, const std::string &hostport,
-             const std::string &request_line, const std::string &action,
+    /**
+     * @brief Queues one access record. Never blocks on I/O.
+     * * Control characters, quotes and backslashes in the fields are
+     * escaped, so every record is exactly one line whatever the client sent.
+     */
+    void log(std::string_view client, std::string_view hostport,
+             std::string_view request_line, std::string_view action,
              int status, size_t bytes_transferred);
 
+    uint64_t get_dropped() const; ///< Records discarded because a ring was full.
+
 private:
     struct Impl;
     Impl *pimpl = nullptr;
 };
 
-#endif 
+#endif
@@ -8,7 +8,9 @@
  * and domain frequency tracking using a thread-safe sliding window approach.
  */
 
+#include <chrono>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <utility>
@@ -19,10 +21,64 @@
  * * This class maintains a background thread to manage time-based data slots,
  * allowing for accurate RPM calculations and identifying the most
  * frequently visited domains.
+ * * Each recording thread writes only to its own shard of counters; the
+ * getters merge the shards. Domain counts are kept in a bounded
+ * heavy-hitters summary, so memory does not grow with distinct hosts and
+ * the least frequent hosts may be approximate.
  */
 class Metrics
 {
 public:
+    /**
+     * @brief Stages of a request that are timed separately.
+     */
+    enum class Phase
+    {
+        HeaderRead, ///< First byte of the request head to its blank line.
+        Dns,        ///< Resolver lookup (cache hits included).
+        Connect,    ///< TCP connect to the origin (pooled connections skip it).
+        FirstByte,  ///< Request sent upstream to first response byte from the origin.
+        Total,      ///< First request byte to the end of the response (plain HTTP only).
+        Count
+    };
+
+    /**
+     * @brief Reasons a connection is closed by a deadline.
+     */
+    enum class Timeout
+    {
+        Header,   ///< The request head did not arrive in time.
+        Connect,  ///< Resolving and connecting to the origin took too long.
+        Idle,     ///< No relay progress in either direction.
+        Lifetime, ///< The connection reached its maximum age.
+        Count
+    };
+
+    /**
+     * @brief Latency quantiles for one phase, in microseconds.
+     * * Values come from log-bucketed histograms and are accurate to
+     * within 1/16 of the reported value.
+     */
+    struct LatencySummary
+    {
+        uint64_t count = 0;
+        uint64_t sum_us = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+    };
+
+    /**
+     * @brief Stable lower-case name of a phase, e.g. "header_read".
+     */
+    static const char *phase_name(Phase phase);
+
+    /**
+     * @brief Stable lower-case name of a timeout reason, e.g. "idle".
+     */
+    static const char *timeout_name(Timeout kind);
+
     /**
      * @brief Initializes the metrics system.
      * @param window_seconds The timeframe for RPM calculation (default: 60s).
@@ -52,7 +108,51 @@ public:
      * @brief Records a single request for a specific domain.
      * @param domain The host string (e.g., "example.com"). If empty, it defaults to "unknown".
      */
-    void record_request(const std::string &domain);
+    void record_request(std::string_view domain);
+
+    /**
+     * @brief Accounts payload bytes relayed between a client and its upstream.
+     * @param bytes Number of bytes delivered to the destination socket.
+     * @param zero_copy true if they were moved with splice(2) and never copied through user space.
+     * @param to_client true for upstream -> client (bytes out), false for client -> upstream (bytes in).
+     */
+    void record_relay(uint64_t bytes, bool zero_copy, bool to_client);
+
+    /**
+     * @brief Adds one sample to the histogram of a phase.
+     */
+    void record_latency(Phase phase, std::chrono::steady_clock::duration elapsed);
+
+    /**
+     * @brief Tracks the number of open client connections.
+     */
+    void connection_opened();
+    void connection_closed();
+
+    /**
+     * @brief Counts a connection closed because a deadline expired.
+     */
+    void record_timeout(Timeout kind);
+
+    uint64_t get_bytes_in() const;  ///< Total client -> upstream bytes relayed.
+    uint64_t get_bytes_out() const; ///< Total upstream -> client bytes relayed.
+    int64_t get_active_connections() const;
+    uint64_t get_timeouts(Timeout kind) const;
+
+    /**
+     * @brief Merges every thread's histogram for a phase and reads its quantiles.
+     */
+    LatencySummary get_latency(Phase phase) const;
+
+    /**
+     * @brief Total relayed bytes moved with splice(2).
+     */
+    uint64_t get_zero_copy_bytes() const;
+
+    /**
+     * @brief Total relayed bytes copied through a user-space buffer.
+     */
+    uint64_t get_copied_bytes() const;
 
     /**
      * @brief Calculates the current traffic load.
@@ -63,7 +163,9 @@ public:
     /**
      * @brief Retrieves the most frequently requested domains.
      * @param k The number of results to return.
-     * @return A vector of pairs containing the domain name and the hit count.
+     * @return A vector of pairs containing the domain name and the hit count,
+     * most frequent first. Counts may be overestimated for hosts that
+     * displaced others from a full summary.
      */
     std::vector<std::pair<std::string, uint64_t>> get_top_k(size_t k) const;
 
@@ -0,0 +1,376 @@
+#ifndef NET_COMPAT_H
+#define NET_COMPAT_H
+
+/**
+ * @file net_compat.h
+ * @brief Thin portability layer over Winsock and BSD sockets.
+ * * Lets the proxy core use one spelling (SOCKET, closesocket, SD_SEND, ...)
+ * on both Windows and Linux. Platform specific engines (such as the epoll
+ * reactor) include the native headers on top of this.
+ */
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_SEND SHUT_WR
+#define SD_BOTH SHUT_RDWR
+
+inline int closesocket(SOCKET s) { return ::close(s); }
+#endif
+
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief One buffer of a gathered send: WSABUF on Windows, iovec elsewhere.
+ */
+#ifdef _WIN32
+typedef WSABUF IoSlice;
+inline IoSlice make_slice(const char *data, size_t len)
+{
+    IoSlice s;
+    s.buf = const_cast<char *>(data);
+    s.len = (ULONG)len;
+    return s;
+}
+inline size_t slice_len(const IoSlice &s) { return s.len; }
+inline void slice_advance(IoSlice &s, size_t n)
+{
+    s.buf += n;
+    s.len -= (ULONG)n;
+}
+#else
+typedef iovec IoSlice;
+inline IoSlice make_slice(const char *data, size_t len) { return iovec{const_cast<char *>(data), len}; }
+inline size_t slice_len(const IoSlice &s) { return s.iov_len; }
+inline void slice_advance(IoSlice &s, size_t n)
+{
+    s.iov_base = static_cast<char *>(s.iov_base) + n;
+    s.iov_len -= n;
+}
+#endif
+
+/**
+ * @brief Drops the first n sent bytes from a slice list.
+ * @return Index of the first slice with bytes left (count if none).
+ */
+inline size_t consume_slices(IoSlice *slices, size_t count, size_t n)
+{
+    size_t i = 0;
+    while (i < count && n >= slice_len(slices[i]))
+        n -= slice_len(slices[i++]);
+    if (i < count)
+        slice_advance(slices[i], n);
+    return i;
+}
+
+/**
+ * @brief Sends every byte of a slice list on a blocking socket.
+ * * One writev (WSASend) per call in the common case; short writes are
+ * resumed where they stopped. The slices are modified.
+ */
+inline bool send_slices(SOCKET s, IoSlice *slices, size_t count)
+{
+    while (count > 0)
+    {
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(s, slices, (DWORD)count, &sent, 0, nullptr, nullptr) != 0)
+            return false;
+#else
+        msghdr msg{};
+        msg.msg_iov = slices;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+#endif
+        size_t done = consume_slices(slices, count, (size_t)sent);
+        slices += done;
+        count -= done;
+    }
+    return true;
+}
+
+/**
+ * @brief Performs process-wide socket initialisation.
+ * * WSAStartup on Windows; on POSIX systems SIGPIPE is ignored so that a
+ * write to a reset peer surfaces as an error instead of killing the process.
+ */
+inline bool net_startup()
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+#endif
+}
+
+/**
+ * @brief Releases the resources acquired by net_startup().
+ */
+inline void net_cleanup()
+{
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/**
+ * @brief Sets SO_RCVTIMEO on a blocking socket.
+ * @param s The socket to configure.
+ * @param ms Timeout in milliseconds.
+ */
+inline void set_recv_timeout(SOCKET s, unsigned ms)
+{
+#ifdef _WIN32
+    DWORD timeout = ms;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+#else
+    timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+/**
+ * @brief Whether the last failed recv() ran into the socket's SO_RCVTIMEO.
+ */
+inline bool recv_timed_out()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/**
+ * @brief Describes why the last socket call failed, for error messages.
+ */
+inline std::string socket_error_text()
+{
+#ifdef _WIN32
+    return "Winsock error " + std::to_string(WSAGetLastError());
+#else
+    return std::strerror(errno);
+#endif
+}
+
+/**
+ * @brief Switches a socket to non-blocking mode.
+ * @return true on success.
+ */
+inline bool set_nonblocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+/**
+ * @brief Turns off Nagle's algorithm on a TCP socket.
+ * * Relayed data is already written in whole pieces, so holding back a
+ * short final segment until the peer's delayed ACK only adds latency to
+ * every keep-alive response. Sockets returned to UpstreamPool keep the
+ * option.
+ */
+inline void set_nodelay(SOCKET s)
+{
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+}
+
+/**
+ * @brief Switches a socket back to blocking mode.
+ * @return true on success.
+ */
+inline bool set_blocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long mode = 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags & ~O_NONBLOCK) == 0;
+#endif
+}
+
+/**
+ * @brief Starts a non-blocking connect(); the socket is left non-blocking.
+ * @return 1 if already connected, 0 if in progress, -1 on error.
+ */
+inline int start_connect(SOCKET s, const sockaddr *addr, int len)
+{
+    if (!set_nonblocking(s))
+        return -1;
+#ifdef _WIN32
+    if (connect(s, addr, len) == 0)
+        return 1;
+    return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+    if (connect(s, addr, (socklen_t)len) == 0)
+        return 1;
+    return errno == EINPROGRESS || errno == EINTR ? 0 : -1;
+#endif
+}
+
+/// Most sockets wait_connected() watches at once.
+inline constexpr size_t kMaxConnectWait = 8;
+
+/**
+ * @brief Waits for at least one of several start_connect() calls to finish.
+ * * INVALID_SOCKET entries are skipped.
+ * @param done Receives, per socket, 1 once connected, -1 if the attempt
+ * failed, and 0 while it is still in progress.
+ * @return How many finished, 0 on timeout, -1 on error.
+ */
+inline int wait_connected(const SOCKET *socks, size_t count, unsigned ms, int *done)
+{
+    if (count > kMaxConnectWait)
+        count = kMaxConnectWait;
+    for (size_t i = 0; i < count; ++i)
+        done[i] = 0;
+#ifdef _WIN32
+    // A failed connect is reported through the exception set.
+    fd_set wr, ex;
+    FD_ZERO(&wr);
+    FD_ZERO(&ex);
+    for (size_t i = 0; i < count; ++i)
+        if (socks[i] != INVALID_SOCKET)
+        {
+            FD_SET(socks[i], &wr);
+            FD_SET(socks[i], &ex);
+        }
+    timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    int r = select(0, nullptr, &wr, &ex, &tv);
+    if (r <= 0)
+        return r < 0 ? -1 : 0;
+    int finished = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (socks[i] == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(socks[i], &ex))
+            done[i] = -1;
+        else if (FD_ISSET(socks[i], &wr))
+            done[i] = 1;
+        finished += done[i] != 0;
+    }
+    return finished;
+#else
+    pollfd p[kMaxConnectWait]{};
+    for (size_t i = 0; i < count; ++i)
+    {
+        p[i].fd = socks[i] == INVALID_SOCKET ? -1 : socks[i];
+        p[i].events = POLLOUT;
+    }
+    int r;
+    do
+        r = poll(p, (nfds_t)count, (int)ms);
+    while (r < 0 && errno == EINTR);
+    if (r <= 0)
+        return r;
+    int finished = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!p[i].revents)
+            continue;
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        bool ok = getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0 &&
+                  !(p[i].revents & (POLLERR | POLLHUP));
+        done[i] = ok ? 1 : -1;
+        ++finished;
+    }
+    return finished;
+#endif
+}
+
+/**
+ * @brief Checks that an idle connection is still usable.
+ * * A healthy idle socket has nothing to read. Readability means the peer
+ * closed or reset the connection, or sent bytes nobody asked for; either
+ * way the connection must not be reused.
+ * @return true if the socket is quiet.
+ */
+inline bool socket_is_quiet(SOCKET s)
+{
+#ifdef _WIN32
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(s, &rd);
+    timeval tv{0, 0};
+    return select(0, &rd, nullptr, nullptr, &tv) == 0;
+#else
+    pollfd p{};
+    p.fd = s;
+    p.events = POLLIN;
+    return poll(&p, 1, 0) == 0;
+#endif
+}
+
+/**
+ * @brief Waits until at least one of two sockets has something to read.
+ * @return A bit mask (1: first, 2: second), 0 on timeout, -1 on error.
+ */
+inline int wait_readable(SOCKET first, SOCKET second, unsigned ms)
+{
+#ifdef _WIN32
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(first, &rd);
+    FD_SET(second, &rd);
+    timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    int r = select(0, &rd, nullptr, nullptr, &tv);
+    if (r <= 0)
+        return r < 0 ? -1 : 0;
+    return (FD_ISSET(first, &rd) ? 1 : 0) | (FD_ISSET(second, &rd) ? 2 : 0);
+#else
+    pollfd p[2]{};
+    p[0].fd = first;
+    p[1].fd = second;
+    p[0].events = p[1].events = POLLIN;
+    int r;
+    do
+        r = poll(p, 2, (int)ms);
+    while (r < 0 && errno == EINTR);
+    if (r <= 0)
+        return r;
+    return (p[0].revents ? 1 : 0) | (p[1].revents ? 2 : 0);
+#endif
+}
+
+#endif // NET_COMPAT_H
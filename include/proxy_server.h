@@ -1,38 +1,84 @@
 #ifndef PROXY_SERVER_H
 #define PROXY_SERVER_H
 
-#include <winsock2.h>
+#include "net_compat.h"
 #include <string>
 #include <vector>
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <memory>
+
+struct ProxyContext;
+class EventLoop;
+class DnsResolver;
+class FileWatcher;
+class ThreadPool;
+class ResponseCache;
+
+/**
+ * @struct ProxyOptions
+ * @brief Start-up knobs selecting how connections are serviced.
+ */
+struct ProxyOptions
+{
+    enum class Engine
+    {
+        Threads, ///< Blocking I/O on a fixed worker pool (portable).
+        Epoll,   ///< Edge-triggered epoll reactor (Linux only).
+        Uring    ///< io_uring completion loop (Linux only, falls back to Epoll).
+    };
+
+#ifdef __linux__
+    Engine engine = Engine::Epoll;
+#else
+    Engine engine = Engine::Threads;
+#endif
+    size_t event_loops = 0; ///< Loop threads for Epoll/Uring; 0 = one per hardware thread.
+    bool reuse_port = false; ///< Epoll/Uring: give every loop its own SO_REUSEPORT listener.
+    bool pin_cpus = false;   ///< Pin loop or worker i to CPU i (modulo the CPU count).
+    unsigned log_flush_ms = 100; ///< How often the access log writer drains its buffers.
+    size_t cache_bytes = 64 << 20; ///< Threads: size of the shared response cache; 0 disables it.
+};
 
 class ProxyServer
 {
 public:
-    ProxyServer(int port);
+    ProxyServer(int port, const ProxyOptions &options = ProxyOptions());
     ~ProxyServer();
 
-    void start();
+    /**
+     * @brief Opens the listener(s) and serves until stop() is called.
+     * @return false, after logging why, if the port could not be bound or
+     *         the listener could not be registered with the engine.
+     */
+    bool start();
     void stop();
 
 private:
     void handle_client(SOCKET clientSocket);
-    void worker_thread();
+    void run_threads();
+    bool run_event_loops();
 
     int m_port;
+    ProxyOptions m_options;
     SOCKET m_listenSocket;
     std::atomic<bool> m_isRunning;
-    std::atomic<size_t> m_maxBytesPerSec;
+    std::unique_ptr<ProxyContext> m_context;
+    std::unique_ptr<FileWatcher> m_blocklistWatcher; ///< Reloads the blocklist when the file changes.
+
+
+    std::unique_ptr<ThreadPool> m_workers; ///< Runs handle_client() for the thread engine.
+    std::mutex m_stateMutex;
+    std::condition_variable m_stopped; ///< Signalled by stop(); the event-loop engines wait on it.
 
-    
-    std::vector<std::thread> m_workers;
-    std::queue<SOCKET> m_jobQueue;
-    std::mutex m_queueMutex;
-    std::condition_variable m_condition;
+    // Declared before m_resolver so that lookups in flight are drained while
+    // the loops they post their results to are still alive.
+    std::vector<std::unique_ptr<EventLoop>> m_loops;
+    std::vector<SOCKET> m_shardListeners; ///< One per loop when reuse_port is set.
+    std::unique_ptr<DnsResolver> m_resolver;
+    std::unique_ptr<ResponseCache> m_cache; ///< Thread engine only; null when disabled.
 };
 
-#endif
\ No newline at end of file
+#endif
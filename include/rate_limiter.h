@@ -0,0 +1,116 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+/**
+ * @file rate_limiter.h
+ * @brief Hierarchical bandwidth shaping for relayed traffic.
+ * * Every relay direction draws from up to four token buckets: its own,
+ * one shared by all connections from the same client address, one shared
+ * by all connections to the same destination host, and one for the whole
+ * proxy. Relayed bytes are charged after the fact, and a direction that
+ * has run ahead of any of its buckets is told how long to wait before
+ * reading again. The event loops park such a direction on a timer, so a
+ * throttled flow costs no thread.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+/**
+ * @class RateLimiter
+ * @brief Thread-safe set of token buckets, attached to per-direction handles.
+ * * Buckets are kept as a theoretical arrival time (GCRA): charging n bytes
+ * moves it n / rate seconds into the future, and a bucket lets traffic
+ * through while it is less than kBurst ahead of the clock. Charging is a
+ * single compare-and-swap per limited level, so shared buckets take no
+ * lock on the data path. New global and per-connection limits apply to
+ * flows already running; per-client and per-host buckets are looked up
+ * when a flow is attached, so those limits apply to flows attached after
+ * they were set.
+ */
+class RateLimiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// How far ahead of its rate a bucket may run; larger means burstier but fewer wake-ups.
+    static constexpr Clock::duration kBurst = std::chrono::milliseconds(100);
+
+    /**
+     * @brief Bytes per second allowed at each level (0 = unlimited).
+     */
+    struct Limits
+    {
+        size_t global = 0;         ///< All relayed traffic together.
+        size_t per_client = 0;     ///< All connections from one client IP address.
+        size_t per_host = 0;       ///< All connections to one destination host.
+        size_t per_connection = 0; ///< Each direction of each connection.
+    };
+
+    struct Bucket
+    {
+        std::atomic<int64_t> tat{0}; ///< Theoretical arrival time, in steady-clock nanoseconds.
+    };
+
+    /**
+     * @class Handle
+     * @brief The buckets one relay direction draws from.
+     * * Used by one thread at a time. A default-constructed handle draws
+     * only from the global bucket.
+     */
+    class Handle
+    {
+    public:
+        Handle() = default;
+
+    private:
+        friend class RateLimiter;
+        std::shared_ptr<Bucket> m_client;
+        std::shared_ptr<Bucket> m_host;
+        int64_t m_own = 0; ///< This direction's own bucket.
+    };
+
+    RateLimiter();
+    ~RateLimiter();
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    /**
+     * @brief Creates the handle for one direction of a connection.
+     * * The shared buckets are only looked up for levels that are limited,
+     * so attaching costs nothing while shaping is off.
+     * @param client Client address without the port.
+     * @param host Destination host as the request named it.
+     */
+    Handle attach(std::string_view client, std::string_view host);
+
+    /**
+     * @brief Records n relayed bytes against every limited bucket of h.
+     */
+    void charge(Handle &h, size_t n, Clock::time_point now);
+
+    /**
+     * @brief How long h must wait before its next read; zero if it may read now.
+     * * Counts a deferral whenever the result is not zero.
+     */
+    Clock::duration delay(const Handle &h, Clock::time_point now);
+
+    /**
+     * @brief True if any level is limited. Unshaped traffic may skip charging.
+     */
+    bool active() const;
+
+    void set_limits(const Limits &limits);
+    Limits limits() const;
+    uint64_t get_deferrals() const; ///< Reads postponed because a bucket was ahead.
+
+private:
+    struct Impl;
+    Impl *pimpl = nullptr;
+};
+
+#endif // RATE_LIMITER_H
@@ -0,0 +1,82 @@
+#ifndef REQUEST_HANDLER_H
+#define REQUEST_HANDLER_H
+
+/**
+ * @file request_handler.h
+ * @brief Engine-independent request routing.
+ * * Both the blocking thread engine and the event-driven engines use these
+ * helpers so that filtering, metrics and logging behave identically no
+ * matter how the bytes are moved.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "net_compat.h"
+
+class FilterManager;
+class Logger;
+class Metrics;
+class RateLimiter;
+class UpstreamPool;
+struct HttpRequest;
+
+/**
+ * @struct ProxyContext
+ * @brief The shared services a connection handler needs.
+ */
+struct ProxyContext
+{
+    FilterManager &filter;
+    Logger &logger;
+    Metrics &metrics;
+    RateLimiter &limiter;    ///< Bandwidth shaping set through the admin port.
+    UpstreamPool &upstreams; ///< Idle keep-alive connections to origin servers.
+};
+
+/**
+ * @brief What the engine should do with a parsed request.
+ */
+enum class RouteAction
+{
+    BadRequest, ///< No host could be derived; close the client.
+    Blocked,    ///< Send kForbiddenResponse and close.
+    Tunnel,     ///< CONNECT: open a raw TCP tunnel.
+    Forward     ///< Plain HTTP: forward the request upstream.
+};
+
+inline constexpr char kForbiddenResponse[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 9\r\nConnection: close\r\n\r\nForbidden";
+inline constexpr char kConnectEstablished[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+/**
+ * @brief Records metrics, applies the blocklist and picks the action for a request.
+ * * BadRequest and Blocked outcomes are logged here; the other outcomes are
+ * logged by the engine once the upstream side is known.
+ */
+RouteAction route_request(ProxyContext &ctx, const HttpRequest &req, const std::string &client_desc);
+
+/**
+ * @brief Queues a request record for the log file (and its stdout echo).
+ */
+void log_request(ProxyContext &ctx,
+                 std::string_view client_desc,
+                 std::string_view dest,
+                 std::string_view reqline,
+                 std::string_view action,
+                 int status,
+                 size_t bytes);
+
+/**
+ * @brief Formats the peer address of a connected socket as "ip:port".
+ * @return "unknown" if the address cannot be determined.
+ */
+std::string describe_peer(SOCKET s);
+
+/**
+ * @brief The address part of a describe_peer() result ("ip:port" -> "ip").
+ */
+std::string_view peer_address(std::string_view client_desc);
+
+#endif // REQUEST_HANDLER_H
@@ -0,0 +1,198 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+/**
+ * @file response_cache.h
+ * @brief Header for the ResponseCache class.
+ * * A shared HTTP cache (RFC 9111) in front of the origins, so that plain
+ * GETs many clients make for the same object are answered without going
+ * upstream. Freshness comes from Cache-Control, Expires and Date, or a
+ * heuristic on Last-Modified; stale responses that carry an ETag or
+ * Last-Modified are revalidated with a conditional request and kept if
+ * the origin answers 304.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct HttpRequest;
+struct HttpResponse;
+
+/**
+ * @class ResponseCache
+ * @brief Sharded, size-bounded, collapsing response store.
+ * * - Entries are keyed by destination and request target, plus the values
+ *   of the request headers named by the response's Vary.
+ * - Each shard evicts with S3-FIFO: new objects enter a small FIFO and
+ *   are only promoted to the main FIFO if they are read again before they
+ *   reach its end, so one-off downloads do not push out popular objects.
+ *   Hits take the shard lock shared and only bump an atomic counter.
+ * - Concurrent misses for one URL are collapsed: the first becomes the
+ *   filler and the others wait for its response instead of fetching the
+ *   same object in parallel. A URL whose fill ends without storing
+ *   anything is passed through uncollapsed for a while, so requests for
+ *   uncacheable URLs do not queue behind each other.
+ */
+class ResponseCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @struct Object
+     * @brief A stored response. Immutable once published.
+     */
+    struct Object
+    {
+        std::string head; ///< Response head as the origin sent it, blank line included.
+        std::string body; ///< Body bytes as relayed, chunk framing included.
+        int status = 0;
+        std::string etag;
+        std::string last_modified;
+        std::vector<std::string> vary;      ///< Lower-cased names of the request headers it varies on.
+        Clock::time_point response_time;    ///< When it arrived or was last revalidated.
+        std::chrono::seconds initial_age{0}; ///< Age at response_time (RFC 9111 section 4.2.3).
+        std::chrono::seconds lifetime{0};    ///< Freshness lifetime; 0 means revalidate on every use.
+
+        size_t size() const { return head.size() + body.size(); }
+        std::chrono::seconds age(Clock::time_point now) const;
+    };
+    using ObjectPtr = std::shared_ptr<const Object>;
+
+    /**
+     * @class Fill
+     * @brief The right to fetch one URL from the origin for every request waiting on it.
+     * * Ends with store(), refresh() or pass(); dropping it unused counts as pass().
+     */
+    class Fill
+    {
+    public:
+        Fill() = default;
+        Fill(Fill &&other) noexcept;
+        Fill &operator=(Fill &&other) noexcept;
+        ~Fill();
+
+        Fill(const Fill &) = delete;
+        Fill &operator=(const Fill &) = delete;
+
+        explicit operator bool() const { return m_cache != nullptr; }
+
+    private:
+        friend class ResponseCache;
+        ResponseCache *m_cache = nullptr;
+        size_t m_shard = 0;
+        std::string m_key;
+    };
+
+    /**
+     * @brief What the cache has for a request.
+     * * fresh: serve object as it is. Otherwise object, if set, is a stale
+     * copy worth revalidating, and fill is set if this request should fetch
+     * the response; with neither set the request simply goes upstream.
+     */
+    struct Lookup
+    {
+        ObjectPtr object;
+        bool fresh = false;
+        Fill fill;
+    };
+
+    struct Stats
+    {
+        uint64_t hits = 0;        ///< Answered from the cache without asking the origin.
+        uint64_t misses = 0;      ///< Had to go upstream, revalidations included.
+        uint64_t revalidated = 0; ///< Misses the origin answered with 304.
+        uint64_t collapsed = 0;   ///< Hits that waited for another request's fill.
+        uint64_t stored = 0;
+        uint64_t evicted = 0;
+        uint64_t bytes_saved = 0; ///< Response bytes the origin did not have to send.
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    /**
+     * @param capacity Bytes of responses kept, split evenly across the shards.
+     */
+    explicit ResponseCache(size_t capacity);
+    ~ResponseCache();
+
+    ResponseCache(const ResponseCache &) = delete;
+    ResponseCache &operator=(const ResponseCache &) = delete;
+
+    /**
+     * @brief Whether the cache may take part in req at all.
+     * * GET without a body, byte ranges, If-Match/If-Unmodified-Since or
+     * "Cache-Control: no-store".
+     */
+    static bool cacheable_request(const HttpRequest &req);
+
+    /**
+     * @brief Whether resp to req may be stored (RFC 9111 section 3).
+     * * Responses that set cookies are never stored either.
+     */
+    static bool storable(const HttpRequest &req, const HttpResponse &resp);
+
+    size_t max_object_size() const; ///< Larger responses are relayed but not stored.
+
+    /**
+     * @brief Looks req up. May wait while another request fills the same URL.
+     * @param req A request that passed cacheable_request().
+     */
+    Lookup lookup(const HttpRequest &req);
+
+    /**
+     * @brief Publishes a complete response fetched under fill, if it is storable.
+     * @param request_time When the request went upstream.
+     */
+    void store(Fill &fill, const HttpRequest &req, const HttpResponse &resp, std::string head, std::string body,
+               Clock::time_point request_time);
+
+    /**
+     * @brief Applies a 304 that revalidated stale (RFC 9111 section 4.3.4).
+     * @return The updated object, to be served in place of the 304.
+     */
+    ObjectPtr refresh(Fill &fill, const HttpRequest &req, const ObjectPtr &stale, const HttpResponse &resp,
+                      const std::string &head, Clock::time_point request_time);
+
+    /**
+     * @brief Ends fill without storing anything.
+     */
+    void pass(Fill &fill);
+
+    /**
+     * @brief Drops every stored variant of req's URL, after an unsafe method succeeded on it.
+     */
+    void invalidate(const HttpRequest &req);
+
+    /**
+     * @brief Conditional headers that revalidate stale for req.
+     * @return Empty if the client's own request is conditional or stale has no validator.
+     */
+    static std::string revalidation_headers(const HttpRequest &req, const Object &stale);
+
+    /**
+     * @brief The head to send a client in front of obj's body, with an Age header added.
+     */
+    static std::string response_head(const Object &obj, Clock::time_point now, bool keep_alive);
+
+    /**
+     * @brief A 304 for a client whose validators match obj.
+     * @return Empty if req is not conditional or its validators do not match.
+     */
+    static std::string not_modified_head(const Object &obj, const HttpRequest &req, Clock::time_point now,
+                                         bool keep_alive);
+
+    Stats get_stats() const;
+
+private:
+    struct Impl;
+    Impl *pimpl = nullptr;
+
+    void release(Fill &fill, bool stored);
+};
+
+#endif // RESPONSE_CACHE_H
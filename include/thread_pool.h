@@ -4,22 +4,133 @@
 /**
  * @file thread_pool.h
  * @brief Header for the ThreadPool class.
- * * Implements a thread-safe worker pool to manage concurrent client
- * connections without the overhead of creating new threads for every request.
+ * * Implements a work-stealing worker pool to manage concurrent client
+ * connections and background jobs without the overhead of creating new
+ * threads for every request.
  */
 
-#include <vector>
-#include <queue>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @class Task
+ * @brief A move-only void() callable that keeps small closures inline.
+ * * Closures up to kInline bytes are stored in the task itself, so queueing
+ * one does not allocate; larger ones are moved to the heap.
+ */
+class Task
+{
+public:
+    static constexpr size_t kInline = 64;
+
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F &&f)
+    {
+        using Fn = std::decay_t<F>;
+        if constexpr (fits_inline<Fn>())
+        {
+            new (m_storage) Fn(std::forward<F>(f));
+            m_ops = &kInlineOps<Fn>;
+        }
+        else
+        {
+            *reinterpret_cast<Fn **>(m_storage) = new Fn(std::forward<F>(f));
+            m_ops = &kHeapOps<Fn>;
+        }
+    }
+
+    Task(Task &&other) noexcept { take(other); }
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+    void operator()() { m_ops->invoke(m_storage); }
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void *);
+        void (*move)(void *dst, void *src); ///< Move-constructs into dst and destroys src.
+        void (*destroy)(void *);
+    };
+
+    template <typename Fn>
+    static constexpr bool fits_inline()
+    {
+        return sizeof(Fn) <= kInline && alignof(Fn) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template <typename Fn>
+    static constexpr Ops kInlineOps = {
+        [](void *p)
+        { (*static_cast<Fn *>(p))(); },
+        [](void *dst, void *src)
+        {
+            new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+            static_cast<Fn *>(src)->~Fn();
+        },
+        [](void *p)
+        { static_cast<Fn *>(p)->~Fn(); }};
+
+    template <typename Fn>
+    static constexpr Ops kHeapOps = {
+        [](void *p)
+        { (**static_cast<Fn **>(p))(); },
+        [](void *dst, void *src)
+        { *static_cast<Fn **>(dst) = *static_cast<Fn **>(src); },
+        [](void *p)
+        { delete *static_cast<Fn **>(p); }};
+
+    void take(Task &other)
+    {
+        m_ops = other.m_ops;
+        if (m_ops)
+            m_ops->move(m_storage, other.m_storage);
+        other.m_ops = nullptr;
+    }
+
+    void reset()
+    {
+        if (m_ops)
+            m_ops->destroy(m_storage);
+        m_ops = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char m_storage[kInline];
+    const Ops *m_ops = nullptr;
+};
 
 /**
  * @class ThreadPool
  * @brief A fixed-size pool of worker threads.
- * * This class maintains a set of worker threads and a task queue. It prevents
- * system exhaustion by reusing a limited number of threads to process tasks.
+ * * This class maintains a set of worker threads that share their work by
+ * stealing. It prevents system exhaustion by reusing a limited number of
+ * threads to process tasks.
+ *
+ * Each worker owns a Chase-Lev deque: tasks it enqueues itself are pushed
+ * and popped at the bottom without a lock, and idle workers steal from
+ * the top of the others. Tasks from outside the pool go through a
+ * lock-free injection queue. Workers with nothing to do spin briefly and
+ * then sleep on a condition variable, which enqueue() only touches while
+ * somebody is asleep.
  */
 class ThreadPool
 {
@@ -27,28 +138,33 @@ public:
     /**
      * @brief Constructor that initializes the worker threads.
      * @param threads The number of worker threads to create in the pool.
+     * @param pin_cpus Pin worker i to CPU i (modulo the CPU count).
      */
-    ThreadPool(size_t threads);
+    explicit ThreadPool(size_t threads, bool pin_cpus = false);
 
     /**
-     * @brief Adds a new task to the internal work queue.
+     * @brief Adds a new task to the pool.
+     * * Called from one of the pool's own workers, the task goes on that
+     * worker's deque and is likely to run on the same core; from any other
+     * thread it goes on the injection queue.
      * @param task A function or lambda (usually the client handler) to be executed.
      */
-    void enqueue(std::function<void()> task);
+    void enqueue(Task task);
+
+    uint64_t get_steals() const; ///< Tasks taken from another worker's deque.
 
     /**
      * @brief Destructor that ensures all threads finish gracefully.
-     * * Signals all threads to stop and joins them before the object is destroyed.
+     * * Runs every task still queued, then joins the workers.
      */
     ~ThreadPool();
 
-private:
-    std::vector<std::thread> workers;        ///< Storage for the worker threads.
-    std::queue<std::function<void()>> tasks; ///< Queue of pending tasks/connections.
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
 
-    std::mutex queue_mutex;            ///< Mutex to protect access to the task queue.
-    std::condition_variable condition; ///< Notifies threads when new tasks are available.
-    bool stop;                         ///< Flag to signal the pool to shut down.
+private:
+    struct Impl;
+    Impl *pimpl = nullptr;
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -0,0 +1,136 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+ * @file timer_wheel.h
+ * @brief Hierarchical hashed timer wheel for the event loops.
+ * * Scheduling, cancelling and expiring a timer are O(1), independent of
+ * how many connections a loop holds, so per-connection deadlines no
+ * longer need a periodic scan of every connection.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class TimerWheel
+ * @brief Four levels of 64 slots at 1 ms resolution, owned by one thread.
+ * * Level 0 holds timers due within 64 ticks, one slot per tick. Each
+ * higher level is 64 times coarser; when the level below wraps around,
+ * one of its slots is cascaded down. Timers further out than the top
+ * level reaches (about 4.6 hours) are parked at its far end and cascaded
+ * again from there, as often as needed, so no timer fires early.
+ *
+ * Timers are intrusive nodes, so the wheel never allocates. A timer
+ * unlinks itself when cancelled or destroyed, without a reference to its
+ * wheel.
+ */
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr Clock::duration kTick = std::chrono::milliseconds(1);
+    static constexpr unsigned kLevelBits = 6;
+    static constexpr unsigned kLevels = 4;
+    static constexpr unsigned kSlots = 1u << kLevelBits;
+
+    /**
+     * @brief A node to embed in whatever the timer belongs to.
+     * * owner and kind are not used by the wheel; they tell the expiry
+     * callback what the timer is for.
+     */
+    struct Timer
+    {
+        Timer() = default;
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+        ~Timer() { cancel(); }
+
+        bool pending() const { return next != nullptr; }
+
+        /// Unlinks the timer if it is scheduled; harmless otherwise.
+        void cancel()
+        {
+            if (!next)
+                return;
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+
+        uint64_t owner = 0;
+        unsigned kind = 0;
+
+    private:
+        friend class TimerWheel;
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        uint64_t expires = 0; ///< Tick at which it fires.
+    };
+
+    explicit TimerWheel(Clock::time_point now = Clock::now());
+    ~TimerWheel();
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * @brief Schedules t to fire at the first tick not before when.
+     * * A pending t is moved. A time already past fires on the next advance().
+     */
+    void schedule(Timer &t, Clock::time_point when);
+
+    /**
+     * @brief Fires every timer due by now, each through expired(Timer &).
+     * * A timer is unlinked before its callback runs, so the callback may
+     * schedule it again, or schedule and cancel any other timer.
+     */
+    template <typename F>
+    void advance(Clock::time_point now, F &&expired)
+    {
+        uint64_t target = tick_at(now);
+        while (m_next <= target)
+        {
+            cascade();
+            Timer &head = m_slots[0][m_next & (kSlots - 1)];
+            ++m_next;
+            if (head.next == &head)
+                continue;
+            // Drain a detached copy: a timer scheduled from a callback 64
+            // ticks on lands in this very slot.
+            Timer due;
+            due.next = head.next;
+            due.prev = head.prev;
+            due.next->prev = due.prev->next = &due;
+            head.prev = head.next = &head;
+            while (due.next != &due)
+            {
+                Timer *t = due.next;
+                t->cancel();
+                expired(*t);
+            }
+        }
+    }
+
+    /**
+     * @brief The earliest time at which advance() may have work to do.
+     * * Exact for timers due within 64 ms; further out it is when the slot
+     * holding the next timer is cascaded, which is never later than the
+     * timer itself. Clock::time_point::max() if nothing is scheduled.
+     */
+    Clock::time_point next_expiry();
+
+private:
+    uint64_t tick_at(Clock::time_point t) const;
+    Clock::time_point time_of(uint64_t tick) const;
+    void link(Timer &t);
+    void cascade();
+
+    Clock::time_point m_origin;
+    uint64_t m_next = 0; ///< First tick not yet expired.
+    Timer m_slots[kLevels][kSlots]; ///< List heads; an empty list points at itself.
+    uint64_t m_occupied[kLevels] = {}; ///< Slots that may be non-empty (cleared lazily).
+};
+
+#endif // TIMER_WHEEL_H
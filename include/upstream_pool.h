@@ -0,0 +1,68 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+/**
+ * @file upstream_pool.h
+ * @brief Header for the UpstreamPool class.
+ * * Keeps idle HTTP/1.1 keep-alive connections to origin servers so that
+ * the next request for the same host:port skips DNS, the TCP handshake
+ * and the TIME_WAIT left behind by closing.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "net_compat.h"
+
+/**
+ * @class UpstreamPool
+ * @brief Thread-safe per-(host, port) cache of idle upstream sockets.
+ * * Connections are handed out most-recently-used first, which keeps the
+ * warmest ones busy and lets the rest age out. A connection is checked
+ * with socket_is_quiet() before it is handed out, so ones the origin has
+ * closed in the meantime are discarded rather than returned.
+ */
+class UpstreamPool
+{
+public:
+    /**
+     * @param max_idle_per_host Idle connections kept per host:port; extras are closed.
+     * @param idle_timeout Idle connections older than this are closed.
+     */
+    UpstreamPool(size_t max_idle_per_host = 8, std::chrono::seconds idle_timeout = std::chrono::seconds(30));
+
+    /**
+     * @brief Destructor. Closes every idle connection.
+     */
+    ~UpstreamPool();
+
+    /**
+     * @brief Takes an idle connection to the given destination out of the pool.
+     * @param key "host:port" exactly as the request addressed it.
+     * @return The socket, or INVALID_SOCKET if none is available.
+     */
+    SOCKET acquire(const std::string &key);
+
+    /**
+     * @brief Returns a connection whose last response has been fully read.
+     * * Ownership passes to the pool, which may close it straight away if
+     * the destination already has max_idle_per_host idle connections.
+     */
+    void release(const std::string &key, SOCKET s);
+
+    /**
+     * @brief Closes connections that have been idle longer than the timeout.
+     */
+    void prune();
+
+    uint64_t get_reused() const; ///< Requests served over a pooled connection.
+    size_t get_idle() const;     ///< Connections currently idle in the pool.
+
+private:
+    struct Impl;
+    Impl *pimpl = nullptr;
+};
+
+#endif // UPSTREAM_POOL_H
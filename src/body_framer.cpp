@@ -0,0 +1,231 @@
+#include "body_framer.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#include "http_request.h"
+#include "http_response.h"
+
+BodyFramer::BodyFramer(Mode mode, uint64_t length) : m_mode(mode), m_left(length)
+{
+    switch (mode)
+    {
+    case Mode::None:
+        m_state = State::Done;
+        break;
+    case Mode::Length:
+        m_state = length == 0 ? State::Done : State::Body;
+        break;
+    case Mode::Chunked:
+        m_state = State::ChunkSize;
+        m_left = 0;
+        break;
+    case Mode::UntilClose:
+        m_state = State::Body;
+        break;
+    }
+}
+
+uint64_t BodyFramer::remaining() const
+{
+    if (m_mode == Mode::UntilClose)
+        return UINT64_MAX;
+    if (m_mode == Mode::Length)
+        return m_left;
+    return 0;
+}
+
+void BodyFramer::skip(size_t n)
+{
+    if (m_mode != Mode::Length)
+        return;
+    m_left -= std::min<uint64_t>(n, m_left);
+    if (m_left == 0)
+        m_state = State::Done;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = (char)std::tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+size_t BodyFramer::consume(const char *data, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        switch (m_state)
+        {
+        case State::Done:
+        case State::Error:
+            return i;
+
+        case State::Body:
+            if (m_mode == Mode::UntilClose)
+                return n;
+            {
+                size_t take = (size_t)std::min<uint64_t>(m_left, n - i);
+                i += take;
+                m_left -= take;
+                if (m_left == 0)
+                    m_state = State::Done;
+            }
+            break;
+
+        case State::ChunkSize:
+        {
+            int v = hex_value(data[i]);
+            if (v >= 0)
+            {
+                if (m_left > (UINT64_MAX >> 4))
+                {
+                    m_state = State::Error;
+                    return i;
+                }
+                m_left = (m_left << 4) | (uint64_t)v;
+                m_sawDigit = true;
+                ++i;
+                break;
+            }
+            if (!m_sawDigit)
+            {
+                m_state = State::Error;
+                return i;
+            }
+            m_state = State::ChunkExt; // extension, whitespace or the CRLF itself
+            break;
+        }
+
+        case State::ChunkExt:
+            if (data[i++] == '\n')
+            {
+                m_sawDigit = false;
+                m_state = m_left == 0 ? State::TrailerStart : State::ChunkData;
+            }
+            break;
+
+        case State::ChunkData:
+        {
+            size_t take = (size_t)std::min<uint64_t>(m_left, n - i);
+            i += take;
+            m_left -= take;
+            if (m_left == 0)
+                m_state = State::ChunkDataEnd;
+            break;
+        }
+
+        case State::ChunkDataEnd:
+            if (data[i++] == '\n')
+                m_state = State::ChunkSize;
+            break;
+
+        case State::TrailerStart:
+            if (data[i] == '\r')
+                m_state = State::TrailerEnd;
+            else if (data[i] == '\n')
+                m_state = State::Done;
+            else
+                m_state = State::TrailerLine;
+            ++i;
+            break;
+
+        case State::TrailerLine:
+            if (data[i++] == '\n')
+                m_state = State::TrailerStart;
+            break;
+
+        case State::TrailerEnd:
+            if (data[i++] == '\n')
+                m_state = State::Done;
+            else
+                m_state = State::Error;
+            break;
+        }
+    }
+    return i;
+}
+
+// Case-insensitive comparison against a lower-case literal.
+static bool names_equal(std::string_view name, std::string_view lower)
+{
+    if (name.size() != lower.size())
+        return false;
+    for (size_t i = 0; i < name.size(); ++i)
+        if (std::tolower((unsigned char)name[i]) != lower[i])
+            return false;
+    return true;
+}
+
+static bool is_chunked(std::string_view te)
+{
+    while (!te.empty() && std::isspace((unsigned char)te.back()))
+        te.remove_suffix(1);
+    return te.size() >= 7 && names_equal(te.substr(te.size() - 7), "chunked");
+}
+
+static bool parse_length(std::string_view s, uint64_t &out)
+{
+    if (s.empty() || s.size() > 19)
+        return false;
+    out = 0;
+    for (char c : s)
+    {
+        if (c < '0' || c > '9')
+            return false;
+        out = out * 10 + (uint64_t)(c - '0');
+    }
+    return true;
+}
+
+BodyFramer request_framer(const HttpRequest &req)
+{
+    if (req.has_header("transfer-encoding"))
+    {
+        // A request body that is neither chunked nor length-delimited
+        // cannot be framed at all (RFC 9112 section 6.3, rule 4).
+        return is_chunked(req.header("transfer-encoding")) ? BodyFramer(BodyFramer::Mode::Chunked, 0) : BodyFramer::malformed();
+    }
+
+    // Every Content-Length line must agree, or the body length is ambiguous.
+    bool seen = false;
+    uint64_t len = 0;
+    for (uint32_t i = 0; i < req.field_count; ++i)
+    {
+        if (!names_equal(req.header_name(i), "content-length"))
+            continue;
+        uint64_t v = 0;
+        if (!parse_length(req.header_value(i), v) || (seen && v != len))
+            return BodyFramer::malformed();
+        seen = true;
+        len = v;
+    }
+    return seen ? BodyFramer(BodyFramer::Mode::Length, len) : BodyFramer();
+}
+
+BodyFramer response_framer(const HttpResponse &resp, std::string_view request_method)
+{
+    if (request_method == "HEAD" || resp.status < 200 || resp.status == 204 || resp.status == 304)
+        return BodyFramer();
+
+    auto te = resp.headers.find("transfer-encoding");
+    if (te != resp.headers.end())
+        return BodyFramer(is_chunked(te->second) ? BodyFramer::Mode::Chunked : BodyFramer::Mode::UntilClose, 0);
+
+    auto cl = resp.headers.find("content-length");
+    uint64_t len = 0;
+    if (cl != resp.headers.end() && parse_length(cl->second, len))
+        return BodyFramer(BodyFramer::Mode::Length, len);
+    return BodyFramer(BodyFramer::Mode::UntilClose, 0);
+}
+
+BodyFramer BodyFramer::malformed()
+{
+    BodyFramer f;
+    f.m_state = State::Error;
+    return f;
+}
@@ -0,0 +1,146 @@
+#include "buffer_pool.h"
+#include <mutex>
+
+namespace
+{
+constexpr size_t kThreadCache = 32; ///< Free blocks a thread keeps for itself.
+constexpr size_t kDepotMax = 1024;  ///< Free blocks shared by all threads; extras go back to the heap.
+
+std::atomic<uint64_t> g_buffers_allocated{0};
+std::atomic<uint64_t> g_buffers_reused{0};
+std::atomic<uint64_t> g_buffers_in_use{0};
+std::atomic<uint64_t> g_objects_allocated{0};
+std::atomic<uint64_t> g_objects_reused{0};
+
+using Block = IoBuffer::Block;
+
+/// Intrusive stack of free blocks.
+struct FreeList
+{
+    Block *head = nullptr;
+    size_t count = 0;
+
+    void push(Block *b)
+    {
+        b->next = head;
+        head = b;
+        ++count;
+    }
+
+    Block *pop()
+    {
+        Block *b = head;
+        if (b)
+        {
+            head = b->next;
+            --count;
+        }
+        return b;
+    }
+};
+
+struct Depot
+{
+    std::mutex m;
+    FreeList blocks;
+
+    ~Depot()
+    {
+        while (Block *b = blocks.pop())
+            delete b;
+    }
+};
+
+Depot &depot()
+{
+    static Depot d;
+    return d;
+}
+
+/// Hands its blocks to the depot when the thread exits.
+struct ThreadCache
+{
+    FreeList blocks;
+
+    ~ThreadCache()
+    {
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lg(d.m);
+        while (Block *b = blocks.pop())
+        {
+            if (d.blocks.count < kDepotMax)
+                d.blocks.push(b);
+            else
+                delete b;
+        }
+    }
+};
+
+thread_local ThreadCache t_cache;
+}
+
+IoBuffer IoBuffer::acquire()
+{
+    g_buffers_in_use.fetch_add(1, std::memory_order_relaxed);
+    Block *b = t_cache.blocks.pop();
+    if (!b)
+    {
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lg(d.m);
+        // Take a few at once so the next acquisitions stay thread-local.
+        while (t_cache.blocks.count < kThreadCache / 2)
+        {
+            Block *spare = d.blocks.pop();
+            if (!spare)
+                break;
+            t_cache.blocks.push(spare);
+        }
+        b = t_cache.blocks.pop();
+    }
+    if (b)
+    {
+        g_buffers_reused.fetch_add(1, std::memory_order_relaxed);
+        b->refs.store(1, std::memory_order_relaxed);
+        return IoBuffer(b);
+    }
+    g_buffers_allocated.fetch_add(1, std::memory_order_relaxed);
+    return IoBuffer(new Block());
+}
+
+void IoBuffer::reset()
+{
+    Block *b = m_block;
+    if (!b)
+        return;
+    m_block = nullptr;
+    if (b->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    g_buffers_in_use.fetch_sub(1, std::memory_order_relaxed);
+    if (t_cache.blocks.count < kThreadCache)
+    {
+        t_cache.blocks.push(b);
+        return;
+    }
+    Depot &d = depot();
+    std::lock_guard<std::mutex> lg(d.m);
+    if (d.blocks.count < kDepotMax)
+        d.blocks.push(b);
+    else
+        delete b;
+}
+
+void note_slab_acquire(bool reused)
+{
+    (reused ? g_objects_reused : g_objects_allocated).fetch_add(1, std::memory_order_relaxed);
+}
+
+PoolStats pool_stats()
+{
+    PoolStats s;
+    s.buffers_allocated = g_buffers_allocated.load(std::memory_order_relaxed);
+    s.buffers_reused = g_buffers_reused.load(std::memory_order_relaxed);
+    s.buffers_in_use = g_buffers_in_use.load(std::memory_order_relaxed);
+    s.objects_allocated = g_objects_allocated.load(std::memory_order_relaxed);
+    s.objects_reused = g_objects_reused.load(std::memory_order_relaxed);
+    return s;
+}
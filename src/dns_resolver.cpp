@@ -0,0 +1,228 @@
+#include "dns_resolver.h"
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "thread_pool.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+constexpr size_t kShards = 16;
+constexpr size_t kMaxEntriesPerShard = 4096;
+
+struct Entry
+{
+    DnsResolver::Addresses addrs;
+    int rc = 0;
+    bool valid = false;    ///< addrs/rc hold an answer.
+    bool inflight = false; ///< A getaddrinfo() for this key is running.
+    Clock::time_point expires;
+    Clock::time_point refresh_at;
+    int family = AF_UNSPEC; ///< Of the address that last connected.
+    std::vector<DnsResolver::Callback> waiters;
+};
+
+struct Shard
+{
+    std::mutex m;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+bool is_negative(int rc)
+{
+#ifdef EAI_NODATA
+    if (rc == EAI_NODATA)
+        return true;
+#endif
+    return rc == EAI_NONAME;
+}
+}
+
+struct DnsResolver::Impl
+{
+    std::chrono::seconds ttl;
+    std::chrono::seconds negative_ttl;
+    Shard shards[kShards];
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> negative_hits{0};
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> refreshes{0};
+
+    // Declared last: destroyed first, so lookups still running finish
+    // while the shards they write to are alive.
+    std::unique_ptr<ThreadPool> pool;
+
+    Shard &shard_for(const std::string &key)
+    {
+        return shards[std::hash<std::string>()(key) % kShards];
+    }
+
+    void lookup(const std::string &key, const std::string &host, const std::string &port)
+    {
+        pool->enqueue([this, key, host, port]()
+                      {
+            addrinfo hints{}, *res = nullptr;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+            Addresses addrs(rc == 0 ? res : nullptr, [](addrinfo *p) { if (p) freeaddrinfo(p); });
+            complete(key, addrs, rc); });
+    }
+
+    void complete(const std::string &key, const Addresses &addrs, int rc)
+    {
+        std::vector<Callback> waiters;
+        Shard &s = shard_for(key);
+        {
+            std::lock_guard<std::mutex> lock(s.m);
+            Entry &e = s.entries[key];
+            e.inflight = false;
+            waiters.swap(e.waiters);
+
+            auto now = Clock::now();
+            if (rc == 0 || is_negative(rc))
+            {
+                auto life = rc == 0 ? ttl : negative_ttl;
+                e.addrs = addrs;
+                e.rc = rc;
+                e.valid = true;
+                e.expires = now + life;
+                e.refresh_at = now + life * 4 / 5;
+            }
+            else if (!e.valid || e.expires <= now)
+            {
+                // Transient failure with nothing usable cached: forget the key
+                // so the next request tries again.
+                s.entries.erase(key);
+            }
+            // else: a failed refresh keeps serving the previous answer until it expires.
+
+            if (s.entries.size() > kMaxEntriesPerShard)
+                evict(s, now);
+        }
+        for (auto &cb : waiters)
+            cb(addrs, rc);
+    }
+
+    // Caller holds s.m.
+    void evict(Shard &s, Clock::time_point now)
+    {
+        for (auto it = s.entries.begin(); it != s.entries.end();)
+        {
+            if (!it->second.inflight && it->second.expires <= now)
+                it = s.entries.erase(it);
+            else
+                ++it;
+        }
+        for (auto it = s.entries.begin(); it != s.entries.end() && s.entries.size() > kMaxEntriesPerShard;)
+        {
+            if (!it->second.inflight)
+                it = s.entries.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+DnsResolver::DnsResolver(size_t threads, std::chrono::seconds ttl, std::chrono::seconds negative_ttl) : pimpl(new Impl())
+{
+    pimpl->ttl = ttl;
+    pimpl->negative_ttl = negative_ttl;
+    pimpl->pool.reset(new ThreadPool(threads));
+}
+
+DnsResolver::~DnsResolver()
+{
+    delete pimpl;
+}
+
+bool DnsResolver::resolve(const std::string &host, const std::string &port, Addresses &addrs, int &rc, Callback cb)
+{
+    std::string key = host + ":" + port;
+    Shard &s = pimpl->shard_for(key);
+    auto now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(s.m);
+        Entry &e = s.entries[key];
+        if (e.valid && now < e.expires)
+        {
+            addrs = e.addrs;
+            rc = e.rc;
+            pimpl->hits.fetch_add(1, std::memory_order_relaxed);
+            if (rc != 0)
+                pimpl->negative_hits.fetch_add(1, std::memory_order_relaxed);
+            if (now >= e.refresh_at && !e.inflight)
+            {
+                e.inflight = true;
+                pimpl->refreshes.fetch_add(1, std::memory_order_relaxed);
+                pimpl->lookup(key, host, port);
+            }
+            return true;
+        }
+
+        e.waiters.push_back(std::move(cb));
+        if (e.inflight)
+        {
+            pimpl->coalesced.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        e.inflight = true;
+    }
+    pimpl->misses.fetch_add(1, std::memory_order_relaxed);
+    pimpl->lookup(key, host, port);
+    return false;
+}
+
+int DnsResolver::resolve_sync(const std::string &host, const std::string &port, Addresses &addrs)
+{
+    int rc = 0;
+    auto done = std::make_shared<std::promise<std::pair<Addresses, int>>>();
+    auto answer = done->get_future();
+    if (resolve(host, port, addrs, rc, [done](Addresses a, int r)
+                { done->set_value(std::make_pair(a, r)); }))
+        return rc;
+    auto result = answer.get();
+    addrs = result.first;
+    return result.second;
+}
+
+int DnsResolver::preferred_family(const std::string &host, const std::string &port) const
+{
+    std::string key = host + ":" + port;
+    Shard &s = pimpl->shard_for(key);
+    std::lock_guard<std::mutex> lock(s.m);
+    auto it = s.entries.find(key);
+    return it == s.entries.end() ? AF_UNSPEC : it->second.family;
+}
+
+void DnsResolver::record_family(const std::string &host, const std::string &port, int family)
+{
+    std::string key = host + ":" + port;
+    Shard &s = pimpl->shard_for(key);
+    std::lock_guard<std::mutex> lock(s.m);
+    auto it = s.entries.find(key);
+    if (it != s.entries.end())
+        it->second.family = family;
+}
+
+DnsResolver::Stats DnsResolver::get_stats() const
+{
+    Stats st;
+    st.hits = pimpl->hits.load(std::memory_order_relaxed);
+    st.misses = pimpl->misses.load(std::memory_order_relaxed);
+    st.negative_hits = pimpl->negative_hits.load(std::memory_order_relaxed);
+    st.coalesced = pimpl->coalesced.load(std::memory_order_relaxed);
+    st.refreshes = pimpl->refreshes.load(std::memory_order_relaxed);
+    for (auto &s : pimpl->shards)
+    {
+        std::lock_guard<std::mutex> lock(s.m);
+        st.entries += s.entries.size();
+    }
+    return st;
+}
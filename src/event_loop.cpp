@@ -0,0 +1,1201 @@
+#ifdef __linux__
+
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include "body_framer.h"
+#include "buffer_pool.h"
+#include "dns_resolver.h"
+#include "happy_eyeballs.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "net_compat.h"
+#include "rate_limiter.h"
+#include "request_handler.h"
+#include "timer_wheel.h"
+#include "upstream_pool.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+constexpr size_t kRelayChunk = IoBuffer::kSize;
+constexpr size_t kSpliceChunk = 65536;
+constexpr int kMaxEvents = 256;
+constexpr int kAcceptBurst = 64;
+
+// epoll_event.data.u64 packs a connection id (or fd) with the role of the descriptor.
+enum Role : uint64_t
+{
+    RoleWake = 0,
+    RoleListener = 1,
+    RoleClient = 2,
+    RoleUpstream = 3
+};
+
+inline uint64_t tag(uint64_t id, Role r) { return (id << 2) | r; }
+
+// What a TimerWheel::Timer of this loop is for.
+enum TimerKind : unsigned
+{
+    TimerDeadline, ///< Connection::timeout: header, connect or idle deadline.
+    TimerLifetime, ///< Connection::lifetime
+    TimerWake,     ///< Connection::wake: resume directions parked by shaping.
+    TimerAttempt,  ///< Connection::stagger: start the next connection attempt.
+    TimerPrune     ///< Closes stale pooled upstreams (loop 0 only).
+};
+
+enum class ConnState
+{
+    ReadingHead,
+    Resolving,
+    Connecting,
+    Relaying
+};
+
+/**
+ * One relay direction. Bytes sit in data[off, len) until the destination
+ * accepts them; a new read is only issued once they are drained. Reads go
+ * into a pooled buffer taken on the first read, so idle connections hold
+ * none. Once a direction turns out to be a bulk transfer it switches to
+ * splice(2) through a private pipe and the payload never enters user space.
+ */
+struct Direction
+{
+    IoBuffer buf;
+    std::string spill; ///< Bytes built rather than read: a rewritten response head, or an unsent request.
+    const char *data = nullptr; ///< Points into buf, spill, or a constant response.
+    size_t off = 0;
+    size_t len = 0;
+    bool reads = true; ///< false: only flush what was queued, never read the source.
+    bool eof = false;  ///< Source returned 0.
+    bool shut = false; ///< EOF has been propagated with shutdown(dst, SHUT_WR).
+    size_t total = 0;
+    RateLimiter::Handle shaper; ///< Buckets this direction is paced by.
+    bool zero_copy = false; ///< Relaying with splice() through pipe_rd/pipe_wr.
+    int pipe_rd = -1;
+    int pipe_wr = -1;
+    size_t piped = 0; ///< Bytes sitting in the pipe, not yet spliced to dst.
+};
+
+/**
+ * Where the current plain-HTTP response stands. The head is held back
+ * until complete so its connection headers can be rewritten; the body is
+ * relayed as it arrives, up to the end found by the framer.
+ */
+struct ResponseState
+{
+    /// Starts over for the next response, keeping the capacity of head.
+    void clear()
+    {
+        std::string keep;
+        keep.swap(head);
+        *this = ResponseState();
+        head.swap(keep);
+        head.clear();
+    }
+
+    std::string head;
+    bool head_done = false;
+    bool done = false;     ///< The whole response has been read from upstream.
+    bool reusable = false; ///< Upstream may go back to the pool afterwards.
+    int status = 0;
+    BodyFramer body;
+    size_t raw = 0; ///< Bytes received from upstream so far.
+};
+
+struct Connection
+{
+    Connection()
+    {
+        timeout.kind = TimerDeadline;
+        lifetime.kind = TimerLifetime;
+        wake.kind = TimerWake;
+        stagger.kind = TimerAttempt;
+        std::fill(std::begin(racing), std::end(racing), -1);
+    }
+
+    uint64_t id = 0;
+    int client = -1;
+    int upstream = -1;
+    ConnState state = ConnState::ReadingHead;
+    std::string head;     ///< Request head as it arrives; moved into req once complete.
+    RequestParser parser; ///< Resumes over head on every read.
+    DnsResolver::Addresses addrs; ///< Kept while plan points into it.
+    ConnectPlan plan;
+    size_t attempts = 0;                    ///< Entries of plan started so far.
+    int racing[ConnectPlan::kMaxAddresses]; ///< Connects in progress, by plan entry; -1 if none.
+    TimerWheel::Timer stagger;              ///< Starts the next attempt unless one finishes first.
+    std::string pending;  ///< Client bytes past the request head (body, or the next pipelined request).
+    size_t body_prefix = 0; ///< Leading bytes of pending that belong to the request body.
+    BodyFramer req_body;      ///< Where the request body ends; the up direction stops there.
+    bool body_streamed = false; ///< Body bytes were read after the head, so no retry is possible.
+    HttpRequest req;
+    std::string client_desc;
+    std::string dest;
+    bool tunnel = false;
+    bool keep_alive = false; ///< Client connection carries on after this exchange.
+    bool reused = false;     ///< Upstream came from the pool.
+    Direction up;   ///< client -> upstream
+    Direction down; ///< upstream -> client
+    ResponseState resp;
+    Clock::time_point deadline; ///< Of the current phase; relay progress pushes it back.
+    TimerWheel::Timer timeout;  ///< Catches up with deadline lazily when it fires.
+    TimerWheel::Timer lifetime; ///< Accept time plus kMaxLifetime.
+    TimerWheel::Timer wake;     ///< Set while a direction is parked by shaping.
+    Clock::time_point started;  ///< First byte of the current request.
+    Clock::time_point phase_at; ///< Start of the latency phase in progress.
+
+    /// Back to a just-accepted state for Slab reuse; strings keep their capacity.
+    void reset()
+    {
+        client = upstream = -1;
+        state = ConnState::ReadingHead;
+        head.clear();
+        parser.reset();
+        pending.clear();
+        body_prefix = 0;
+        req_body = BodyFramer();
+        body_streamed = false;
+        req.clear();
+        client_desc.clear();
+        dest.clear();
+        tunnel = keep_alive = reused = false;
+        up = Direction();
+        down = Direction();
+        resp.clear();
+        addrs.reset();
+        attempts = 0;
+        std::fill(std::begin(racing), std::end(racing), -1);
+        timeout.cancel();
+        lifetime.cancel();
+        wake.cancel();
+        stagger.cancel();
+    }
+};
+
+using AddrList = DnsResolver::Addresses;
+
+void close_pipe(Direction &d)
+{
+    if (d.pipe_rd >= 0)
+        close(d.pipe_rd);
+    if (d.pipe_wr >= 0)
+        close(d.pipe_wr);
+    d.pipe_rd = d.pipe_wr = -1;
+}
+
+/// Abandons every connection attempt still in progress.
+void close_attempts(Connection &c)
+{
+    for (int &fd : c.racing)
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+}
+
+bool racing_any(const Connection &c)
+{
+    for (int fd : c.racing)
+        if (fd >= 0)
+            return true;
+    return false;
+}
+
+/**
+ * Edge-triggered epoll backend. Every socket is registered once for
+ * EPOLLIN | EPOLLOUT | EPOLLET and each handler runs its syscall until EAGAIN.
+ */
+class EpollLoop final : public EventLoop
+{
+public:
+    ProxyContext &ctx;
+    DnsResolver &resolver;
+    int index;
+    int cpu = -1;
+    int epfd = -1;
+    int wakefd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    Slab<Connection> conns;
+
+    std::mutex post_mtx;
+    std::vector<std::function<void()>> posted;
+
+    TimerWheel timers;
+    TimerWheel::Timer prune;
+    using Wakeup = std::pair<Clock::time_point, uint64_t>;
+    std::vector<Wakeup> due; ///< Connections woken by expire_timers(), by last activity.
+
+    EpollLoop(ProxyContext &c, DnsResolver &r, int i) : ctx(c), resolver(r), index(i)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = tag(0, RoleWake);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    }
+
+    ~EpollLoop() override
+    {
+        stop();
+        conns.for_each([](Connection &c)
+                       {
+            if (c.client >= 0)
+                close(c.client);
+            if (c.upstream >= 0)
+                close(c.upstream);
+            close_attempts(c);
+            close_pipe(c.up);
+            close_pipe(c.down); });
+        if (wakefd >= 0)
+            close(wakefd);
+        if (epfd >= 0)
+            close(epfd);
+    }
+
+    bool add_listener(int fd) override;
+    void pin_to_cpu(int cpu) override;
+    void start() override;
+    void stop() override;
+    void post(std::function<void()> task) override;
+
+    void run();
+    void drain_posted();
+    void on_accept(int lfd);
+    void on_client_event(Connection &c);
+    void on_upstream_event(Connection &c);
+    void read_head(Connection &c);
+    void begin_resolve(Connection &c);
+    void on_resolved(uint64_t id, AddrList addrs, int rc);
+    bool attach_upstream(Connection &c, int fd);
+    bool start_attempt(Connection &c);
+    void on_attempt_event(Connection &c);
+    void on_connected(Connection &c);
+    void send_request(Connection &c);
+    bool frame_response(Connection &c, size_t n);
+    void finish_exchange(Connection &c);
+    void retry_fresh(Connection &c);
+    void log_exchange(Connection &c);
+    bool pump(Connection &c, Direction &d, int src, int dst, Clock::time_point now);
+    void start_zero_copy(Direction &d);
+    void drive(Connection &c);
+    void close_conn(Connection &c);
+    void fail_upstream(Connection &c);
+    void arm_deadline(Connection &c, Clock::time_point when);
+    void expire_timers(Clock::time_point now);
+    void on_timer(TimerWheel::Timer &t, Clock::time_point now);
+    void expire(Connection &c, Metrics::Timeout kind);
+};
+
+void EpollLoop::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lg(post_mtx);
+        posted.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    ssize_t w = write(wakefd, &one, sizeof(one));
+    (void)w;
+}
+
+void EpollLoop::drain_posted()
+{
+    uint64_t cnt;
+    while (read(wakefd, &cnt, sizeof(cnt)) > 0)
+        ;
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lg(post_mtx);
+        tasks.swap(posted);
+    }
+    for (auto &t : tasks)
+        t();
+}
+
+void EpollLoop::run()
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    epoll_event events[kMaxEvents];
+    if (index == 0)
+    {
+        prune.kind = TimerPrune;
+        timers.schedule(prune, Clock::now() + kPruneInterval);
+    }
+    while (running.load(std::memory_order_relaxed))
+    {
+        auto now = Clock::now();
+        auto next = timers.next_expiry();
+        int timeout = -1;
+        if (next != Clock::time_point::max())
+            timeout = next > now ? (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1 : 0;
+
+        int n = epoll_wait(epfd, events, kMaxEvents, timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < n; ++i)
+        {
+            uint64_t data = events[i].data.u64;
+            uint64_t id = data >> 2;
+            switch (data & 3)
+            {
+            case RoleWake:
+                drain_posted();
+                break;
+            case RoleListener:
+                on_accept((int)id);
+                break;
+            case RoleClient:
+            case RoleUpstream:
+            {
+                Connection *c = conns.find(id);
+                if (!c)
+                    break;
+                if ((data & 3) == RoleClient)
+                    on_client_event(*c);
+                else
+                    on_upstream_event(*c);
+                break;
+            }
+            }
+        }
+
+        expire_timers(Clock::now());
+    }
+}
+
+void EpollLoop::on_accept(int lfd)
+{
+    for (int i = 0; i < kAcceptBurst; ++i)
+    {
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN, or out of descriptors: retry on the next readiness event
+        }
+
+        set_nodelay(fd);
+        Connection *c = conns.acquire();
+        c->client = fd;
+        c->client_desc = describe_peer(fd);
+        c->timeout.owner = c->lifetime.owner = c->wake.owner = c->stagger.owner = c->id;
+        auto now = Clock::now();
+        arm_deadline(*c, now + kHeaderTimeout);
+        timers.schedule(c->lifetime, now + kMaxLifetime);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = tag(c->id, RoleClient);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            close(fd);
+            conns.release(c);
+            continue;
+        }
+        ctx.metrics.connection_opened();
+    }
+}
+
+void EpollLoop::on_client_event(Connection &c)
+{
+    switch (c.state)
+    {
+    case ConnState::ReadingHead:
+        read_head(c);
+        break;
+    case ConnState::Relaying:
+        drive(c);
+        break;
+    default:
+        // Nothing to do until the upstream side is ready; the relay drains
+        // whatever the client sent in the meantime.
+        break;
+    }
+}
+
+void EpollLoop::on_upstream_event(Connection &c)
+{
+    if (c.state == ConnState::Connecting)
+    {
+        on_attempt_event(c);
+        return;
+    }
+    if (c.state == ConnState::Relaying)
+        drive(c);
+}
+
+void EpollLoop::read_head(Connection &c)
+{
+    // Parse after every read and stop at the end of the head: bytes behind
+    // it belong to the body or the next request and are left to the relay,
+    // which drains the socket once the upstream side is ready. Only the
+    // head counts against kMaxHeaderBytes.
+    char buf[kRelayChunk];
+    RequestParser::Result r = c.parser.parse(c.head, c.req);
+    while (r == RequestParser::Result::Incomplete)
+    {
+        if (c.head.size() > kMaxHeaderBytes)
+        {
+            close_conn(c);
+            return;
+        }
+        ssize_t n = recv(c.client, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            if (c.head.empty())
+                c.started = Clock::now();
+            c.head.append(buf, (size_t)n);
+            r = c.parser.parse(c.head, c.req);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        close_conn(c);
+        return;
+    }
+    if (c.parser.head_length() > kMaxHeaderBytes)
+    {
+        close_conn(c);
+        return;
+    }
+
+    c.parser.finish(c.head, c.req, c.pending);
+    c.phase_at = Clock::now();
+    ctx.metrics.record_latency(Metrics::Phase::HeaderRead, c.phase_at - c.started);
+
+    switch (route_request(ctx, c.req, c.client_desc))
+    {
+    case RouteAction::BadRequest:
+        close_conn(c);
+        return;
+    case RouteAction::Blocked:
+    {
+        ssize_t w = send(c.client, kForbiddenResponse, sizeof(kForbiddenResponse) - 1, MSG_NOSIGNAL);
+        (void)w;
+        shutdown(c.client, SHUT_WR);
+        close_conn(c);
+        return;
+    }
+    case RouteAction::Tunnel:
+        c.tunnel = true;
+        break;
+    case RouteAction::Forward:
+        c.tunnel = false;
+        break;
+    }
+    c.dest.assign(c.req.host()).append(":").append(c.req.port());
+
+    if (!c.tunnel)
+    {
+        // Body bytes that came with the head go out with it; the rest is
+        // relayed by the up direction, which stops at the end of the body.
+        c.req_body = request_framer(c.req);
+        c.keep_alive = request_keep_alive(c.req) && !c.req_body.error();
+        c.body_prefix = c.req_body.consume(c.pending.data(), c.pending.size());
+
+        int fd = ctx.upstreams.acquire(c.dest);
+        if (fd >= 0 && attach_upstream(c, fd))
+        {
+            c.reused = true;
+            on_connected(c);
+            return;
+        }
+    }
+    begin_resolve(c);
+}
+
+void EpollLoop::begin_resolve(Connection &c)
+{
+    c.state = ConnState::Resolving;
+    c.phase_at = Clock::now();
+    arm_deadline(c, c.phase_at + kConnectTimeout);
+
+    // Cache hits are answered inline; misses complete on a resolver thread
+    // and are posted back to this loop.
+    EpollLoop *self = this;
+    uint64_t id = c.id;
+    AddrList addrs;
+    int rc = 0;
+    if (resolver.resolve(std::string(c.req.host()), std::string(c.req.port()), addrs, rc, [self, id](AddrList a, int r)
+                         { self->post([self, id, a, r]() { self->on_resolved(id, a, r); }); }))
+        on_resolved(id, addrs, rc);
+}
+
+void EpollLoop::on_resolved(uint64_t id, AddrList addrs, int rc)
+{
+    Connection *found = conns.find(id);
+    if (!found)
+        return;
+    Connection &c = *found;
+    auto now = Clock::now();
+    ctx.metrics.record_latency(Metrics::Phase::Dns, now - c.phase_at);
+    c.phase_at = now;
+    if (rc != 0 || !addrs)
+    {
+        fail_upstream(c);
+        return;
+    }
+
+    c.addrs = std::move(addrs);
+    plan_connect(c.addrs.get(), resolver.preferred_family(std::string(c.req.host()), std::string(c.req.port())),
+                 c.plan);
+    c.attempts = 0;
+    c.state = ConnState::Connecting;
+    if (!start_attempt(c))
+        fail_upstream(c);
+}
+
+bool EpollLoop::start_attempt(Connection &c)
+{
+    while (c.attempts < c.plan.count)
+    {
+        size_t i = c.attempts++;
+        const addrinfo *ai = c.plan.addrs[i];
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        set_nodelay(fd);
+        // Registered like a connected upstream, so the winner needs no
+        // further epoll_ctl(); its first EPOLLOUT edge reports the outcome.
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = tag(c.id, RoleUpstream);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0 ||
+            (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS))
+        {
+            close(fd);
+            continue;
+        }
+        c.racing[i] = fd;
+        if (c.attempts < c.plan.count)
+            timers.schedule(c.stagger, Clock::now() + kAttemptDelay);
+        return true;
+    }
+    return false;
+}
+
+void EpollLoop::on_attempt_event(Connection &c)
+{
+    // Events of every attempt arrive under the same tag; a zero-timeout
+    // poll tells which of them finished.
+    int done[ConnectPlan::kMaxAddresses];
+    if (wait_connected(c.racing, c.attempts, 0, done) <= 0)
+        return;
+    bool failed = false;
+    for (size_t i = 0; i < c.attempts; ++i)
+    {
+        if (done[i] > 0)
+        {
+            c.upstream = c.racing[i];
+            c.racing[i] = -1;
+            close_attempts(c);
+            c.stagger.cancel();
+            resolver.record_family(std::string(c.req.host()), std::string(c.req.port()), c.plan.addrs[i]->ai_family);
+            on_connected(c);
+            return;
+        }
+        if (done[i] < 0)
+        {
+            close(c.racing[i]);
+            c.racing[i] = -1;
+            failed = true;
+        }
+    }
+    // A failed attempt hands over to the next address at once.
+    if (failed && !start_attempt(c) && !racing_any(c))
+        fail_upstream(c);
+}
+
+bool EpollLoop::attach_upstream(Connection &c, int fd)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = tag(c.id, RoleUpstream);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    c.upstream = fd;
+    return true;
+}
+
+void EpollLoop::on_connected(Connection &c)
+{
+    auto now = Clock::now();
+    if (c.state == ConnState::Connecting)
+        ctx.metrics.record_latency(Metrics::Phase::Connect, now - c.phase_at);
+    c.state = ConnState::Relaying;
+    c.phase_at = now; // time to first byte counts from here
+    arm_deadline(c, now + kIdleTimeout);
+    if (ctx.limiter.active())
+    {
+        std::string_view client = peer_address(c.client_desc);
+        c.up.shaper = ctx.limiter.attach(client, c.req.host());
+        c.down.shaper = ctx.limiter.attach(client, c.req.host());
+    }
+
+    if (c.tunnel)
+    {
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "FORWARD", 200, 0);
+        c.down.data = kConnectEstablished;
+        c.down.len = sizeof(kConnectEstablished) - 1;
+    }
+    else
+    {
+        send_request(c);
+        c.up.reads = !c.req_body.done() && !c.req_body.error();
+    }
+    drive(c);
+}
+
+void EpollLoop::send_request(Connection &c)
+{
+    std::string_view pieces[kMaxForwardPieces + 1];
+    size_t n = forward_request_pieces(c.req, true, pieces);
+    if (c.body_prefix > 0)
+        pieces[n++] = std::string_view(c.pending.data(), c.body_prefix);
+    IoSlice iov[kMaxForwardPieces + 1];
+    for (size_t i = 0; i < n; ++i)
+        iov[i] = make_slice(pieces[i].data(), pieces[i].size());
+
+    // The upstream socket has just connected or come out of the pool, so
+    // its send buffer is empty and the request normally leaves in this one
+    // call. Whatever does not fit is copied for pump() to finish; an error
+    // is left for pump() to report.
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t sent;
+    do
+        sent = sendmsg(c.upstream, &msg, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    if (sent > 0)
+    {
+        c.up.total += (size_t)sent;
+        if (ctx.limiter.active())
+            ctx.limiter.charge(c.up.shaper, (size_t)sent, Clock::now());
+        ctx.metrics.record_relay((uint64_t)sent, false, false);
+    }
+
+    c.up.spill.clear();
+    for (size_t i = consume_slices(iov, n, sent > 0 ? (size_t)sent : 0); i < n; ++i)
+        c.up.spill.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+    c.up.data = c.up.spill.data();
+    c.up.off = 0;
+    c.up.len = c.up.spill.size();
+}
+
+bool EpollLoop::pump(Connection &c, Direction &d, int src, int dst, Clock::time_point now)
+{
+    bool shaped_read = false;
+    for (;;)
+    {
+        if (d.off < d.len)
+        {
+            ssize_t n = send(dst, d.data + d.off, d.len - d.off, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                d.off += (size_t)n;
+                d.total += (size_t)n;
+                if (ctx.limiter.active())
+                    ctx.limiter.charge(d.shaper, (size_t)n, now);
+                c.deadline = now + kIdleTimeout;
+                ctx.metrics.record_relay((uint64_t)n, false, &d == &c.down);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true; // resumed by EPOLLOUT on dst
+            return false;
+        }
+        d.off = d.len = 0;
+
+        if (d.piped > 0)
+        {
+            ssize_t n = splice(d.pipe_rd, nullptr, dst, nullptr, d.piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                d.piped -= (size_t)n;
+                d.total += (size_t)n;
+                if (ctx.limiter.active())
+                    ctx.limiter.charge(d.shaper, (size_t)n, now);
+                c.deadline = now + kIdleTimeout;
+                ctx.metrics.record_relay((uint64_t)n, true, &d == &c.down);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false;
+        }
+
+        if (d.eof)
+        {
+            if (!d.shut)
+            {
+                shutdown(dst, SHUT_WR);
+                d.shut = true;
+            }
+            return true;
+        }
+        if (!d.reads)
+            return true;
+
+        if (ctx.limiter.active())
+        {
+            // Instead of sleeping like the thread engine, the direction is
+            // parked until every bucket it draws from has refilled. It reads
+            // one chunk per turn, so that flows sharing a bucket alternate
+            // rather than the first one woken taking all of it.
+            auto wait = ctx.limiter.delay(d.shaper, now);
+            if (wait > Clock::duration::zero() || shaped_read)
+            {
+                // One wake-up drives both directions, so one queued is enough.
+                if (!c.wake.pending())
+                    timers.schedule(c.wake, now + wait);
+                return true;
+            }
+            shaped_read = true;
+        }
+
+        if (d.zero_copy)
+        {
+            // The pipe is empty at this point, so EAGAIN can only mean that
+            // the source socket has nothing more to read.
+            bool downstream = &d == &c.down;
+            BodyFramer &body = downstream ? c.resp.body : c.req_body;
+            size_t want = kSpliceChunk;
+            if (!c.tunnel && body.remaining() < want)
+                want = (size_t)body.remaining();
+            ssize_t n = splice(src, nullptr, d.pipe_wr, nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                d.piped = (size_t)n;
+                if (!c.tunnel)
+                {
+                    if (downstream)
+                        c.resp.raw += (size_t)n;
+                    else
+                        c.body_streamed = true;
+                    body.skip((size_t)n);
+                    if (body.done())
+                    {
+                        if (downstream)
+                            c.resp.done = true;
+                        d.reads = false;
+                    }
+                }
+                continue;
+            }
+            if (n == 0)
+            {
+                d.eof = true;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+
+        if (!d.buf)
+            d.buf = IoBuffer::acquire();
+        d.data = d.buf.data();
+        bool framed = &d == &c.down && !c.tunnel;
+        ssize_t n = recv(src, d.buf.data(), kRelayChunk, 0);
+        if (n > 0)
+        {
+            bool opaque = true;
+            if (framed)
+            {
+                if (!frame_response(c, (size_t)n))
+                    return false;
+                opaque = c.resp.head_done && !c.resp.done && c.resp.body.opaque();
+            }
+            else if (!c.tunnel)
+            {
+                // Request body: bytes past its end start the next request.
+                c.body_streamed = true;
+                d.len = c.req_body.consume(d.buf.data(), (size_t)n);
+                c.pending.append(d.buf.data() + d.len, (size_t)n - d.len);
+                if (c.req_body.error())
+                    return false;
+                if (c.req_body.done())
+                    d.reads = false;
+                opaque = c.req_body.opaque() && !c.req_body.done();
+            }
+            else
+                d.len = (size_t)n;
+            // A full buffer means more is queued behind it. Short responses
+            // never pay for a pipe; bulk transfers move to splice(). Throttled
+            // connections keep copying so that every byte is paced, and
+            // chunked bodies must be seen to find their end.
+            if ((size_t)n == kRelayChunk && !ctx.limiter.active() && !d.zero_copy && opaque)
+                start_zero_copy(d);
+            continue;
+        }
+        if (n == 0)
+        {
+            if (framed && c.reused && c.resp.raw == 0)
+                return false; // pooled connection went stale; drive() retries
+            d.eof = true;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return true; // resumed by EPOLLIN on src
+        return false;
+    }
+}
+
+void EpollLoop::start_zero_copy(Direction &d)
+{
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+        return; // out of descriptors: stay on the copying path
+    d.pipe_rd = fds[0];
+    d.pipe_wr = fds[1];
+    d.zero_copy = true;
+}
+
+void EpollLoop::drive(Connection &c)
+{
+    auto now = Clock::now();
+    if (!pump(c, c.up, c.client, c.upstream, now) ||
+        !pump(c, c.down, c.upstream, c.client, now))
+    {
+        if (!c.tunnel && c.reused && c.resp.raw == 0 && !c.body_streamed)
+        {
+            retry_fresh(c);
+            return;
+        }
+        if (!c.tunnel)
+            log_exchange(c);
+        close_conn(c);
+        return;
+    }
+
+    if (!c.tunnel && c.resp.done && c.down.off == c.down.len && c.down.piped == 0)
+    {
+        finish_exchange(c);
+        return;
+    }
+
+    if (c.tunnel ? (c.up.shut && c.down.shut) : c.down.shut)
+    {
+        if (!c.tunnel)
+            log_exchange(c);
+        close_conn(c);
+    }
+}
+
+bool EpollLoop::frame_response(Connection &c, size_t n)
+{
+    Direction &d = c.down;
+    ResponseState &r = c.resp;
+    if (r.raw == 0)
+        ctx.metrics.record_latency(Metrics::Phase::FirstByte, Clock::now() - c.phase_at);
+    r.raw += n;
+    if (r.head_done)
+    {
+        size_t used = r.body.consume(d.buf.data(), n);
+        if (used < n)
+            r.reusable = false; // bytes past the end of the response
+        d.len = used;
+    }
+    else
+    {
+        r.head.append(d.buf.data(), n);
+        std::string &out = d.spill;
+        out.clear();
+        for (;;)
+        {
+            size_t end = r.head.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                if (r.head.size() > kMaxHeaderBytes)
+                    return false;
+                break;
+            }
+            std::string head = r.head.substr(0, end + 4);
+            std::string rest = r.head.substr(end + 4);
+            HttpResponse resp;
+            if (!parse_response_head(head, resp))
+                return false;
+            if (resp.status < 200 && resp.status != 101)
+            {
+                // Interim response: pass it on and wait for the final one.
+                out += head;
+                r.head = std::move(rest);
+                continue;
+            }
+
+            r.body = resp.status == 101 ? BodyFramer(BodyFramer::Mode::UntilClose, 0) : response_framer(resp, c.req.method());
+            bool framed = r.body.mode() != BodyFramer::Mode::UntilClose;
+            r.status = resp.status;
+            r.reusable = framed && response_keep_alive(resp);
+            c.keep_alive = c.keep_alive && framed;
+            if (!c.req_body.done())
+            {
+                // Answered before the whole body was sent: the origin has
+                // rejected it, and the rest of it is not relayed.
+                r.reusable = c.keep_alive = false;
+                c.up.reads = false;
+            }
+            out += rewrite_response_head(head, c.keep_alive);
+            size_t used = r.body.consume(rest.data(), rest.size());
+            if (used < rest.size())
+                r.reusable = false;
+            out.append(rest, 0, used);
+            r.head_done = true;
+            r.head.clear();
+            break;
+        }
+        d.data = out.data();
+        d.len = out.size();
+    }
+
+    if (r.body.error())
+        return false;
+    if (r.head_done && r.body.done())
+    {
+        r.done = true;
+        d.reads = false;
+    }
+    return true;
+}
+
+void EpollLoop::finish_exchange(Connection &c)
+{
+    log_exchange(c);
+    if (c.resp.reusable)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.upstream, nullptr);
+        ctx.upstreams.release(c.dest, c.upstream);
+    }
+    else
+        close(c.upstream);
+    c.upstream = -1;
+
+    if (!c.keep_alive)
+    {
+        shutdown(c.client, SHUT_WR);
+        close_conn(c);
+        return;
+    }
+
+    // Back to waiting for the next request on the same client connection;
+    // whatever the client pipelined behind this request is parsed first.
+    close_pipe(c.up);
+    close_pipe(c.down);
+    c.up = Direction();
+    c.down = Direction();
+    c.wake.cancel();
+    c.resp.clear();
+    c.req.clear();
+    c.pending.erase(0, c.body_prefix);
+    c.head.swap(c.pending);
+    c.pending.clear();
+    c.body_prefix = 0;
+    c.req_body = BodyFramer();
+    c.body_streamed = false;
+    if (!c.head.empty())
+        c.started = Clock::now(); // pipelined: already waiting in the buffer
+    c.parser.reset();
+    c.tunnel = c.reused = false;
+    c.state = ConnState::ReadingHead;
+    arm_deadline(c, Clock::now() + kHeaderTimeout);
+    read_head(c);
+}
+
+void EpollLoop::retry_fresh(Connection &c)
+{
+    close(c.upstream);
+    c.upstream = -1;
+    close_pipe(c.up);
+    close_pipe(c.down);
+    c.up = Direction();
+    c.down = Direction();
+    c.wake.cancel();
+    c.resp = ResponseState();
+    c.reused = false;
+    begin_resolve(c);
+}
+
+void EpollLoop::log_exchange(Connection &c)
+{
+    if (c.resp.status != 0)
+    {
+        ctx.metrics.record_latency(Metrics::Phase::Total, Clock::now() - c.started);
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "FORWARD", c.resp.status, c.down.total);
+    }
+    else
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "ERROR", 502, 0);
+}
+
+void EpollLoop::fail_upstream(Connection &c)
+{
+    log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "ERROR", 502, 0);
+    close_conn(c);
+}
+
+void EpollLoop::close_conn(Connection &c)
+{
+    if (c.upstream >= 0)
+        close(c.upstream);
+    close_attempts(c);
+    if (c.client >= 0)
+        close(c.client);
+    close_pipe(c.up);
+    close_pipe(c.down);
+    conns.release(&c);
+    ctx.metrics.connection_closed();
+}
+
+void EpollLoop::arm_deadline(Connection &c, Clock::time_point when)
+{
+    c.deadline = when;
+    timers.schedule(c.timeout, when);
+}
+
+void EpollLoop::expire_timers(Clock::time_point now)
+{
+    due.clear();
+    timers.advance(now, [this, now](TimerWheel::Timer &t)
+                   { on_timer(t, now); });
+
+    // Directions parked on a shared bucket come due at the same moment and
+    // the first one driven takes what has refilled. Going least recently
+    // active first makes them take turns.
+    std::sort(due.begin(), due.end());
+    for (const Wakeup &w : due)
+        if (Connection *c = conns.find(w.second))
+            drive(*c);
+}
+
+void EpollLoop::on_timer(TimerWheel::Timer &t, Clock::time_point now)
+{
+    if (t.kind == TimerPrune)
+    {
+        ctx.upstreams.prune(); // the pool is shared, one loop is enough
+        timers.schedule(t, now + kPruneInterval);
+        return;
+    }
+    // Releasing a connection cancels its timers, so the owner is alive.
+    Connection &c = *conns.find(t.owner);
+    switch (t.kind)
+    {
+    case TimerWake:
+        due.emplace_back(c.deadline, c.id);
+        break;
+    case TimerAttempt:
+        if (!start_attempt(c) && !racing_any(c))
+            fail_upstream(c);
+        break;
+    case TimerLifetime:
+        expire(c, Metrics::Timeout::Lifetime);
+        break;
+    case TimerDeadline:
+        // Relay progress only moves the deadline; the timer follows here.
+        if (c.deadline > now)
+            timers.schedule(t, c.deadline);
+        else if (c.state == ConnState::ReadingHead)
+            expire(c, Metrics::Timeout::Header);
+        else if (c.state == ConnState::Relaying)
+            expire(c, Metrics::Timeout::Idle);
+        else
+            expire(c, Metrics::Timeout::Connect);
+        break;
+    }
+}
+
+void EpollLoop::expire(Connection &c, Metrics::Timeout kind)
+{
+    ctx.metrics.record_timeout(kind);
+    if (c.state == ConnState::Resolving || c.state == ConnState::Connecting)
+        fail_upstream(c);
+    else
+    {
+        if (c.state == ConnState::Relaying && !c.tunnel)
+            log_exchange(c);
+        close_conn(c);
+    }
+}
+
+bool EpollLoop::add_listener(int fd)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.u64 = tag((uint64_t)fd, RoleListener);
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void EpollLoop::pin_to_cpu(int c)
+{
+    cpu = c;
+}
+
+void EpollLoop::start()
+{
+    bool expected = false;
+    if (!running.compare_exchange_strong(expected, true))
+        return;
+    thread = std::thread([this]()
+                         { run(); });
+}
+
+void EpollLoop::stop()
+{
+    bool expected = true;
+    if (running.compare_exchange_strong(expected, false))
+    {
+        uint64_t one = 1;
+        ssize_t w = write(wakefd, &one, sizeof(one));
+        (void)w;
+        if (thread.joinable())
+            thread.join();
+    }
+}
+} // namespace
+
+std::unique_ptr<EventLoop> EventLoop::create_epoll(ProxyContext &ctx, DnsResolver &resolver, int index)
+{
+    return std::unique_ptr<EventLoop>(new EpollLoop(ctx, resolver, index));
+}
+
+#endif // __linux__
@@ -0,0 +1,129 @@
+#include "file_watcher.h"
+#include <chrono>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+/// Quiet period after the last event before the callback runs.
+constexpr auto kSettle = std::chrono::milliseconds(200);
+/// How often the loop wakes up to check for shutdown.
+constexpr int kTickMs = 250;
+
+#ifdef __linux__
+void split_path(const std::string &path, std::string &dir, std::string &name)
+{
+    size_t slash = path.find_last_of("/\\");
+    if (slash == std::string::npos)
+    {
+        dir = ".";
+        name = path;
+    }
+    else
+    {
+        dir = slash == 0 ? "/" : path.substr(0, slash);
+        name = path.substr(slash + 1);
+    }
+}
+#endif
+
+long long mtime_of(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    return static_cast<long long>(st.st_mtime) ^ (static_cast<long long>(st.st_size) << 32);
+}
+}
+
+FileWatcher::FileWatcher(const std::string &path, std::function<void()> on_change)
+    : m_path(path), m_onChange(std::move(on_change)), m_running(true)
+{
+    m_thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+    m_running = false;
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void FileWatcher::run()
+{
+    bool pending = false;
+    Clock::time_point fire_at;
+
+#ifdef __linux__
+    std::string dir, name;
+    split_path(m_path, dir, name);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0)
+    {
+        alignas(inotify_event) char buf[4096];
+        while (m_running)
+        {
+            pollfd p{};
+            p.fd = fd;
+            p.events = POLLIN;
+            if (poll(&p, 1, kTickMs) > 0)
+            {
+                ssize_t n;
+                while ((n = read(fd, buf, sizeof(buf))) > 0)
+                {
+                    for (char *at = buf; at < buf + n;)
+                    {
+                        const inotify_event *ev = reinterpret_cast<const inotify_event *>(at);
+                        if (ev->len > 0 && name == ev->name)
+                        {
+                            pending = true;
+                            fire_at = Clock::now() + kSettle;
+                        }
+                        at += sizeof(inotify_event) + ev->len;
+                    }
+                }
+            }
+            if (pending && Clock::now() >= fire_at)
+            {
+                pending = false;
+                m_onChange();
+            }
+        }
+        close(fd);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    // Portable fallback: poll the modification time and size.
+    long long last = mtime_of(m_path);
+    int ticks = 0;
+    while (m_running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kTickMs));
+        if (++ticks * kTickMs < 1000 && !pending)
+            continue;
+        ticks = 0;
+        long long now = mtime_of(m_path);
+        if (now != last)
+        {
+            last = now;
+            pending = true;
+            fire_at = Clock::now() + kSettle;
+        }
+        else if (pending && Clock::now() >= fire_at)
+        {
+            pending = false;
+            m_onChange();
+        }
+    }
+}
@@ -1,110 +1,1043 @@
 #include "filter_manager.h"
-#include <fstream>
 #include <string>
 #include <vector>
 #include <mutex>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <thread>
 
-struct FilterManager::Impl
+#include "net_compat.h"
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FILTER_MANAGER_SSE2 1
+#endif
+
+namespace
 {
-    std::vector<std::string> exact;  
-    std::vector<std::string> suffix; 
-    std::mutex m;
-};
+constexpr uint8_t kExact = 1;    ///< "example.com"
+constexpr uint8_t kWildcard = 2; ///< "*.example.com": the domain and everything below it.
 
-static inline std::string trim(const std::string &s)
+/// ASCII lower-casing; std::tolower is a locale-aware call per character.
+inline unsigned char fold(char c)
 {
-    size_t a = 0;
-    while (a < s.size() && std::isspace(static_cast<unsigned char>(s[a])))
-        ++a;
-    size_t b = s.size();
-    while (b > a && std::isspace(static_cast<unsigned char>(s[b - 1])))
-        --b;
-    return s.substr(a, b - a);
+    unsigned char u = static_cast<unsigned char>(c);
+    return (u >= 'A' && u <= 'Z') ? static_cast<unsigned char>(u | 0x20) : u;
 }
 
-static inline std::string lower(const std::string &s)
+/// fold() over n bytes, 16 at a time where SSE2 is available.
+void lower_copy(const char *src, size_t n, char *dst)
 {
-    std::string r = s;
-    std::transform(r.begin(), r.end(), r.begin(), [](unsigned char c)
-                   { return std::tolower(c); });
-    return r;
+    size_t i = 0;
+#ifdef FILTER_MANAGER_SSE2
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        // Signed compares: bytes >= 0x80 are negative, so only 'A'..'Z' pass both.
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(v, _mm_and_si128(upper, case_bit)));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = static_cast<char>(fold(src[i]));
 }
 
-FilterManager::FilterManager() : pimpl(new Impl()) {}
-FilterManager::~FilterManager() { delete pimpl; }
+inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
 
-bool FilterManager::load(const std::string &path)
+/**
+ * Blocked Bloom filter over rule-domain hashes. Each key sets kHashes
+ * bits inside one 64-byte block, so a lookup touches a single cache line,
+ * and at 16 bits per key the whole filter is an eighth the size of the
+ * slot array and stays in cache. Hosts that match no rule, the common
+ * case, are turned away here before reaching the table.
+ */
+class BlockedBloom
 {
-    std::ifstream ifs(path);
-    if (!ifs.is_open())
+public:
+    struct alignas(64) Block
+    {
+        uint64_t words[8];
+    };
+
+    /// Sizes the filter for keys keys and clears it.
+    void reset(size_t keys)
+    {
+        size_t blocks = std::max<size_t>(1, (keys * kBitsPerKey + 511) / 512);
+        store.assign(blocks, Block{});
+        m_blocks = store.data();
+        m_count = blocks;
+    }
+
+    void add(uint64_t h)
+    {
+        Block &b = store[block_of(h)];
+        uint64_t m = h * kMix;
+        for (unsigned i = 0; i < kHashes; ++i)
+        {
+            unsigned bit = static_cast<unsigned>(m >> (64 - 9 * (i + 1))) & 511;
+            b.words[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+
+    /// False means h is certainly not a key; true means it may be. An empty filter answers true.
+    bool maybe(uint64_t h) const
+    {
+        if (m_count == 0)
+            return true;
+        const Block &b = m_blocks[block_of(h)];
+        uint64_t m = h * kMix;
+        for (unsigned i = 0; i < kHashes; ++i)
+        {
+            unsigned bit = static_cast<unsigned>(m >> (64 - 9 * (i + 1))) & 511;
+            if (!(b.words[bit >> 6] & (uint64_t(1) << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    /// Uses blocks laid out elsewhere without copying them.
+    void map(const Block *blocks, size_t count)
+    {
+        m_blocks = blocks;
+        m_count = count;
+    }
+
+    /// The chance that maybe() is true for a non-key: the mean over blocks of (bits set / 512)^kHashes.
+    double expected_fp_rate() const
+    {
+        if (m_count == 0)
+            return 1.0;
+        double sum = 0;
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            unsigned set = 0;
+            for (uint64_t w : m_blocks[i].words)
+                set += static_cast<unsigned>(__builtin_popcountll(w));
+            sum += std::pow(set / 512.0, kHashes);
+        }
+        return sum / m_count;
+    }
+
+    const Block *data() const { return m_blocks; }
+    size_t size() const { return m_count; }
+
+private:
+    static constexpr size_t kBitsPerKey = 16;
+    static constexpr unsigned kHashes = 7; ///< 7 x 9-bit positions from one 64-bit product.
+    static constexpr uint64_t kMix = 0x9e3779b97f4a7c15ull;
+
+    std::vector<Block> store; ///< Storage when built by load(); empty for a mapped snapshot.
+    const Block *m_blocks = nullptr;
+    size_t m_count = 0;
+
+    size_t block_of(uint64_t h) const
+    {
+        // The table indexes by the low bits; the filter uses the high half.
+        return static_cast<size_t>(((h >> 32) * m_count) >> 32);
+    }
+};
+
+static_assert(sizeof(BlockedBloom::Block) == 64, "snapshot filter layout");
+
+/// What the filter saved during one lookup.
+struct ProbeCounts
+{
+    uint32_t rejected = 0;        ///< Suffixes the filter ruled out.
+    uint32_t false_positives = 0; ///< Suffixes it let through that the table did not hold.
+};
+
+/**
+ * Open-addressing table of rule domains. Keys are hashed right to left
+ * (FNV-1a over the reversed name), so one backwards pass over a host
+ * yields the hash of every label suffix: "a.b.c", "b.c" and "c" are
+ * checked in O(length of host) whatever the number of rules.
+ */
+class DomainTable
+{
+public:
+    /// Fixed layout: snapshots store the slot array exactly as it is in memory.
+    struct Slot
+    {
+        uint64_t hash = 0;
+        uint32_t off = 0;
+        uint32_t len = 0; ///< 0 marks an empty slot.
+        uint8_t flags = 0;
+        uint8_t pad[7] = {}; ///< Spelled out so snapshot files are reproducible byte for byte.
+    };
+
+    /// Sizes the table for up to count keys of bytes characters in total.
+    void reserve(size_t count, size_t bytes)
+    {
+        size_t cap = 16;
+        while (cap < count * 2)
+            cap <<= 1;
+        slots.assign(cap, Slot{});
+        arena.reserve(bytes);
+        m_slots = slots.data();
+        m_count = cap;
+        m_keys = arena.data();
+        m_key_bytes = 0;
+    }
+
+    /**
+     * Adds a lower-cased key whose hash_of() is h.
+     * @return false if the key was already present; its flags are merged.
+     */
+    bool insert(uint64_t h, const char *key, size_t len, uint8_t flags)
+    {
+        size_t mask = m_count - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask)
+        {
+            Slot &s = slots[i];
+            if (s.len == 0)
+            {
+                s.hash = h;
+                s.off = static_cast<uint32_t>(arena.size());
+                s.len = static_cast<uint32_t>(len);
+                s.flags = flags;
+                arena.append(key, len);
+                m_keys = arena.data();
+                m_key_bytes = arena.size();
+                return true;
+            }
+            if (s.hash == h && equal(s, key, len))
+            {
+                s.flags |= flags;
+                return false;
+            }
+        }
+    }
+
+    /// Re-hashes into a smaller table once duplicates are known, keeping the load factor at or below 1/2.
+    void shrink(size_t distinct)
+    {
+        size_t cap = 16;
+        while (cap < distinct * 2)
+            cap <<= 1;
+        if (cap >= m_count)
+            return;
+        std::vector<Slot> old(cap, Slot{});
+        old.swap(slots);
+        m_slots = slots.data();
+        m_count = cap;
+        for (const Slot &s : old)
+        {
+            if (s.len == 0)
+                continue;
+            size_t i = s.hash & (cap - 1);
+            while (slots[i].len != 0)
+                i = (i + 1) & (cap - 1);
+            slots[i] = s;
+        }
+    }
+
+    /// Builds the Bloom filter over every key; call once all keys are in.
+    void build_filter()
+    {
+        size_t keys = 0;
+        for (size_t i = 0; i < m_count; ++i)
+            keys += m_slots[i].len != 0;
+        m_filter.reset(keys);
+        for (size_t i = 0; i < m_count; ++i)
+            if (m_slots[i].len != 0)
+                m_filter.add(m_slots[i].hash);
+    }
+
+    /// Uses a table and filter laid out elsewhere, count a power of two, without copying them.
+    void map(const Slot *table, size_t count, const char *keys, size_t key_bytes, const BlockedBloom::Block *blocks,
+             size_t block_count)
+    {
+        m_slots = table;
+        m_count = count;
+        m_keys = keys;
+        m_key_bytes = key_bytes;
+        m_filter.map(blocks, block_count);
+    }
+
+    /// Whether a mapped table is safe to probe: every key lies inside the arena, and an empty slot ends every probe.
+    bool intact() const
+    {
+        bool empty = m_count == 0;
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            const Slot &s = m_slots[i];
+            if (s.len == 0)
+                empty = true;
+            else if (static_cast<uint64_t>(s.off) + s.len > m_key_bytes)
+                return false;
+        }
+        return empty;
+    }
+
+    static uint64_t hash_of(const char *key, size_t len)
+    {
+        uint64_t h = kOffset;
+        for (size_t i = len; i-- > 0;)
+            h = (h ^ fold(key[i])) * kPrime;
+        return h;
+    }
+
+    const Slot *slot_data() const { return m_slots; }
+    size_t slot_count() const { return m_count; }
+    const char *key_data() const { return m_keys; }
+    size_t key_bytes() const { return m_key_bytes; }
+    const BlockedBloom &filter() const { return m_filter; }
+    size_t memory() const { return m_count * sizeof(Slot) + m_key_bytes + m_filter.size() * sizeof(BlockedBloom::Block); }
+
+    bool matches(const char *host, size_t len, ProbeCounts &counts) const
+    {
+        if (m_count == 0)
+            return false;
+        uint64_t h = kOffset;
+        for (size_t i = len; i-- > 0;)
+        {
+            h = (h ^ fold(host[i])) * kPrime;
+            if (i != 0 && host[i - 1] != '.')
+                continue;
+            if (!m_filter.maybe(h))
+            {
+                ++counts.rejected;
+                continue;
+            }
+            uint8_t flags = find(h, host + i, len - i);
+            if (flags == 0)
+                ++counts.false_positives;
+            if ((flags & kWildcard) || (i == 0 && (flags & kExact)))
+                return true;
+        }
         return false;
-    std::vector<std::string> exact_local;
-    std::vector<std::string> suffix_local;
-    std::string line;
-    while (std::getline(ifs, line))
+    }
+
+private:
+    static constexpr uint64_t kOffset = 14695981039346656037ull;
+    static constexpr uint64_t kPrime = 1099511628211ull;
+
+    std::vector<Slot> slots; ///< Storage when built by load(); empty for a mapped snapshot.
+    std::string arena;       ///< Lower-cased keys, back to back.
+    const Slot *m_slots = nullptr;
+    size_t m_count = 0;
+    const char *m_keys = nullptr;
+    size_t m_key_bytes = 0;
+    BlockedBloom m_filter;
+
+    bool equal(const Slot &s, const char *p, size_t len) const
     {
-        line = trim(line);
-        if (line.empty())
-            continue;
-        if (line[0] == '#')
-            continue;
-        std::string s = lower(line);
-        if (s.rfind("*.", 0) == 0 && s.size() > 2)
+        if (s.len != len)
+            return false;
+        const char *k = m_keys + s.off;
+        for (size_t i = 0; i < len; ++i)
+            if (static_cast<unsigned char>(k[i]) != fold(p[i]))
+                return false;
+        return true;
+    }
+
+    uint8_t find(uint64_t h, const char *p, size_t len) const
+    {
+        size_t mask = m_count - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask)
         {
-           
-            suffix_local.push_back(s.substr(2));
+            const Slot &s = m_slots[i];
+            if (s.len == 0)
+                return 0;
+            if (s.hash == h && equal(s, p, len))
+                return s.flags;
         }
-        else
+    }
+};
+
+static_assert(sizeof(DomainTable::Slot) == 24, "snapshot slot layout");
+
+/// IPv4 addresses are held as IPv4-mapped IPv6 so both families share one range list.
+using IpAddr = std::array<uint8_t, 16>;
+
+struct IpRange
+{
+    IpAddr lo;
+    IpAddr hi;
+};
+
+static_assert(sizeof(IpRange) == 32, "snapshot range layout");
+
+bool parse_ip(const char *s, IpAddr &out, int &bits)
+{
+    in_addr v4;
+    in6_addr v6;
+    if (inet_pton(AF_INET, s, &v4) == 1)
+    {
+        out.fill(0);
+        out[10] = out[11] = 0xff;
+        std::memcpy(out.data() + 12, &v4, 4);
+        bits = 32;
+        return true;
+    }
+    if (inet_pton(AF_INET6, s, &v6) == 1)
+    {
+        std::memcpy(out.data(), &v6, 16);
+        bits = 128;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Parses "192.0.2.5", "10.0.0.0/8" or "2001:db8::/32" into an inclusive range.
+ */
+bool parse_cidr(std::string_view rule, IpRange &range)
+{
+    size_t slash = rule.find('/');
+    std::string_view addr = rule.substr(0, slash);
+    char buf[INET6_ADDRSTRLEN];
+    if (addr.size() >= sizeof(buf))
+        return false;
+    std::memcpy(buf, addr.data(), addr.size());
+    buf[addr.size()] = '\0';
+    int bits = 0;
+    if (!parse_ip(buf, range.lo, bits))
+        return false;
+    int prefix = bits;
+    if (slash != std::string_view::npos)
+    {
+        std::string_view len = rule.substr(slash + 1);
+        if (len.empty() || len.size() > 3)
+            return false;
+        prefix = 0;
+        for (char c : len)
         {
-            exact_local.push_back(s);
+            if (c < '0' || c > '9')
+                return false;
+            prefix = prefix * 10 + (c - '0');
         }
+        if (prefix > bits)
+            return false;
     }
-    
+    prefix += 128 - bits;
+    range.hi = range.lo;
+    for (int i = prefix; i < 128; ++i)
     {
-        std::lock_guard<std::mutex> lg(pimpl->m);
-        pimpl->exact.swap(exact_local);
-        pimpl->suffix.swap(suffix_local);
+        uint8_t bit = static_cast<uint8_t>(0x80 >> (i % 8));
+        range.lo[i / 8] &= static_cast<uint8_t>(~bit);
+        range.hi[i / 8] |= bit;
     }
     return true;
 }
 
-bool FilterManager::is_blocked(const std::string &hostOrIp) const
+bool looks_like_ip(const char *p, size_t len)
 {
-    if (hostOrIp.empty())
-        return false;
-    std::string h = lower(trim(hostOrIp));
-    std::lock_guard<std::mutex> lg(pimpl->m);
-   
-    for (const auto &e : pimpl->exact)
+    for (size_t i = 0; i < len; ++i)
+        if (!std::isxdigit(static_cast<unsigned char>(p[i])) && p[i] != '.' && p[i] != ':')
+            return false;
+    return len > 0;
+}
+
+/**
+ * A read-only view of a whole file, mapped rather than copied so that a
+ * multi-million-line feed is parsed straight out of the page cache.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
     {
-        if (e == h)
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_map)
+            CloseHandle(m_map);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+    }
+
+    enum class Access
+    {
+        Sequential, ///< Read once from start to end.
+        Random      ///< Probed at random for as long as it is mapped.
+    };
+
+    bool open(const std::string &path, Access access)
+    {
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+            return false;
+        m_size = static_cast<size_t>(size.QuadPart);
+        if (m_size == 0)
             return true;
+        m_map = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_map)
+            return false;
+        m_data = static_cast<const char *>(MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0));
+        (void)access;
+        return m_data != nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(fd);
+            return false;
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        if (m_size == 0)
+        {
+            ::close(fd);
+            return true;
+        }
+        void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // the mapping keeps the file
+        if (p == MAP_FAILED)
+            return false;
+        madvise(p, m_size, access == Access::Sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+        m_data = static_cast<const char *>(p);
+        return true;
+#endif
     }
-    
-    for (const auto &suf : pimpl->suffix)
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_map = nullptr;
+#endif
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/// Rules parsed from one slice of the file, with keys already lower-cased and hashed.
+struct Chunk
+{
+    struct Domain
     {
-        if (h.size() >= suf.size() + 1)
+        uint64_t hash;
+        uint32_t off; ///< Into keys.
+        uint32_t len;
+        uint8_t flags;
+    };
+
+    std::string keys;
+    std::vector<Domain> domains;
+    std::vector<IpRange> ranges;
+    size_t rejected = 0; ///< Lines with a '/' that are not an address range.
+};
+
+/**
+ * Parses the lines in [p, end), which starts at a line boundary. Each
+ * kept line costs one lower-casing copy into the chunk's key buffer;
+ * nothing is allocated per line.
+ */
+void parse_chunk(const char *p, const char *end, Chunk &out)
+{
+    out.keys.resize(static_cast<size_t>(end - p));
+    size_t used = 0;
+    while (p < end)
+    {
+        const char *nl = static_cast<const char *>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char *a = p;
+        const char *b = nl ? nl : end;
+        p = nl ? nl + 1 : end;
+        while (a < b && is_space(*a))
+            ++a;
+        while (b > a && is_space(b[-1]))
+            --b;
+        if (a == b || *a == '#')
+            continue;
+
+        char *key = &out.keys[used];
+        size_t len = static_cast<size_t>(b - a);
+        lower_copy(a, len, key);
+        uint8_t flags = kExact;
+        if (len > 2 && key[0] == '*' && key[1] == '.')
+        {
+            key += 2;
+            len -= 2;
+            flags = kWildcard;
+        }
+        else
         {
-            
-            if (h.size() == suf.size())
-                continue; 
-            if (h.compare(h.size() - suf.size(), suf.size(), suf) == 0)
+            IpRange range;
+            size_t slash = std::string_view(key, len).find('/');
+            if (looks_like_ip(key, slash == std::string_view::npos ? len : slash) &&
+                parse_cidr(std::string_view(key, len), range))
             {
-                
-                size_t pos = h.size() - suf.size();
-                if (pos == 0)
-                    return true;
-                if (h[pos - 1] == '.')
-                    return true;
+                out.ranges.push_back(range);
+                continue;
+            }
+            if (slash != std::string_view::npos)
+            {
+                ++out.rejected; // no host name holds a '/', so it could never match
+                continue;
             }
         }
-        else if (h == suf)
+        out.domains.push_back({DomainTable::hash_of(key, len), static_cast<uint32_t>(key - out.keys.data()),
+                               static_cast<uint32_t>(len), flags});
+        used += static_cast<size_t>(b - a);
+    }
+    out.keys.resize(used);
+}
+
+/**
+ * An immutable compiled ruleset. load() builds a new one and swaps it in;
+ * readers keep whichever snapshot they started with.
+ */
+struct Ruleset
+{
+    DomainTable domains;
+    const IpRange *ranges = nullptr; ///< Sorted by lo, non-overlapping.
+    size_t range_count = 0;
+    std::vector<IpRange> range_store;     ///< Backs ranges when built by load().
+    std::unique_ptr<MappedFile> snapshot; ///< Backs domains and ranges when mapped from a snapshot.
+    size_t rule_count = 0;
+    FilterManager::LoadStats load;
+    double filter_fp_rate = 0; ///< Expected, from the filter's fill.
+    mutable std::atomic<uint64_t> filter_rejected{0};
+    mutable std::atomic<uint64_t> filter_false_positives{0};
+
+    bool ip_blocked(const IpAddr &a) const
+    {
+        const IpRange *end = ranges + range_count;
+        const IpRange *it = std::upper_bound(ranges, end, a, [](const IpAddr &v, const IpRange &r)
+                                             { return v < r.lo; });
+        return it != ranges && a <= std::prev(it)->hi;
+    }
+};
+
+/**
+ * Snapshot file layout, all integers in the writer's byte order:
+ * this header, then the slot array, the key arena, the range list and
+ * the Bloom filter blocks,
+ * each at the 64-byte aligned offset the header gives. Offsets are from
+ * the start of the file, so the mapping can live at any address.
+ */
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; ///< kByteOrderMark as the writer stored it.
+    uint64_t file_bytes;
+    uint64_t source_bytes; ///< Size and modification time (in nanoseconds)
+    int64_t source_mtime;  ///< of the text file the snapshot was compiled from.
+    uint64_t rule_count;
+    uint64_t duplicates;
+    uint64_t rejected;
+    uint64_t slots_offset;
+    uint64_t slot_count;
+    uint64_t keys_offset;
+    uint64_t key_bytes;
+    uint64_t ranges_offset;
+    uint64_t range_count;
+    uint64_t filter_offset;
+    uint64_t filter_blocks;
+    double filter_fp_rate;
+};
+
+const char kSnapshotMagic[8] = {'P', 'X', 'B', 'L', 'O', 'C', 'K', '\0'};
+constexpr uint32_t kSnapshotVersion = 4; ///< 2 added the Bloom filter, 3 the mtime nanoseconds, 4 rejected.
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint64_t kSectionAlign = 64;
+
+uint64_t align_up(uint64_t n) { return (n + kSectionAlign - 1) & ~(kSectionAlign - 1); }
+
+/// Whether count elements of size bytes at offset lie inside a file of total bytes.
+bool section_fits(uint64_t offset, uint64_t count, size_t size, uint64_t total)
+{
+    return offset % kSectionAlign == 0 && offset <= total && count <= (total - offset) / size;
+}
+
+/// Whether ranges are sorted and disjoint, as the binary search in Ruleset::ip_blocked() needs.
+bool ranges_ordered(const IpRange *ranges, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        if (ranges[i].hi < ranges[i].lo || (i > 0 && ranges[i].lo <= ranges[i - 1].hi))
+            return false;
+    return true;
+}
+
+/// Size and modification time of path. The time is in nanoseconds, so an
+/// edit that keeps the size is noticed even within the same second.
+bool source_signature(const std::string &path, uint64_t &bytes, int64_t &mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    bytes = static_cast<uint64_t>(st.st_size);
+#ifdef _WIN32
+    mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+/// Source of snapshot versions. Shared by every FilterManager so that a
+/// version never repeats, even for an instance reusing a freed address.
+std::atomic<uint64_t> g_next_version{1};
+}
+
+struct FilterManager::Impl
+{
+    std::shared_ptr<const Ruleset> rules = std::make_shared<Ruleset>();
+    std::atomic<uint64_t> version{g_next_version.fetch_add(1)}; ///< Changes whenever rules does.
+    std::mutex m;      ///< Guards rules; taken by readers only after a reload.
+    std::mutex load_m; ///< Serialises concurrent load() calls.
+};
+
+namespace
+{
+/**
+ * Each thread keeps its own reference to the snapshot it last used. While
+ * the version is unchanged a lookup reads one atomic and takes no lock;
+ * after a reload each thread takes the mutex once to pick up the new
+ * snapshot. The old ruleset is freed when the last thread lets go of it.
+ */
+struct SnapshotCache
+{
+    const void *owner = nullptr;
+    uint64_t version = 0;
+    std::shared_ptr<const Ruleset> rules;
+    ProbeCounts pending; ///< Filter outcomes not yet added to rules' counters.
+
+    void flush()
+    {
+        if (rules)
         {
-            return true;
+            rules->filter_rejected.fetch_add(pending.rejected, std::memory_order_relaxed);
+            rules->filter_false_positives.fetch_add(pending.false_positives, std::memory_order_relaxed);
         }
+        pending = ProbeCounts();
     }
-    return false;
+};
+
+/// Rejections are published per thread in batches, keeping shared counters off the lookup path.
+constexpr uint32_t kProbeBatch = 64;
+
+thread_local SnapshotCache t_snapshot;
+}
+
+FilterManager::FilterManager() : pimpl(new Impl()) {}
+FilterManager::~FilterManager() { delete pimpl; }
+
+bool FilterManager::load(const std::string &path)
+{
+    std::lock_guard<std::mutex> serial(pimpl->load_m);
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    if (!file.open(path, MappedFile::Access::Sequential))
+        return false;
+
+    // One slice per core, none smaller than 1 MiB, each ending on a newline.
+    const size_t kMinSlice = 1 << 20;
+    size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    size_t n = std::max<size_t>(1, std::min(hw, file.size() / kMinSlice));
+    std::vector<Chunk> chunks(n);
+    std::vector<const char *> bounds(n + 1);
+    const char *data = file.data();
+    const char *end = data + file.size();
+    bounds[0] = data;
+    bounds[n] = end;
+    for (size_t i = 1; i < n; ++i)
+    {
+        const char *cut = std::max(bounds[i - 1], data + file.size() / n * i);
+        const char *nl = static_cast<const char *>(std::memchr(cut, '\n', static_cast<size_t>(end - cut)));
+        bounds[i] = nl ? nl + 1 : end;
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n; ++i)
+        workers.emplace_back([&, i]
+                             { parse_chunk(bounds[i], bounds[i + 1], chunks[i]); });
+    parse_chunk(bounds[0], bounds[1], chunks[0]);
+    for (std::thread &t : workers)
+        t.join();
+
+    std::shared_ptr<Ruleset> rs = std::make_shared<Ruleset>();
+    size_t parsed = 0, key_bytes = 0, range_count = 0, rejected = 0;
+    for (const Chunk &c : chunks)
+    {
+        parsed += c.domains.size() + c.ranges.size();
+        key_bytes += c.keys.size();
+        range_count += c.ranges.size();
+        rejected += c.rejected;
+    }
+
+    std::vector<IpRange> ranges_local;
+    ranges_local.reserve(range_count);
+    for (const Chunk &c : chunks)
+        ranges_local.insert(ranges_local.end(), c.ranges.begin(), c.ranges.end());
+    std::sort(ranges_local.begin(), ranges_local.end(), [](const IpRange &a, const IpRange &b)
+              { return a.lo < b.lo; });
+    size_t distinct_ranges = 0;
+    for (size_t i = 0; i < ranges_local.size(); ++i)
+    {
+        const IpRange &r = ranges_local[i];
+        if (i == 0 || r.lo != ranges_local[i - 1].lo || r.hi != ranges_local[i - 1].hi)
+            ++distinct_ranges;
+        std::vector<IpRange> &merged = rs->range_store;
+        if (!merged.empty() && r.lo <= merged.back().hi)
+            merged.back().hi = std::max(merged.back().hi, r.hi);
+        else
+            merged.push_back(r);
+    }
+    rs->range_store.shrink_to_fit();
+    rs->ranges = rs->range_store.data();
+    rs->range_count = rs->range_store.size();
+
+    // Hashes were computed by the parsing threads; duplicates merge into one slot.
+    size_t distinct_domains = 0;
+    rs->domains.reserve(parsed - range_count, key_bytes);
+    for (const Chunk &c : chunks)
+        for (const Chunk::Domain &d : c.domains)
+            distinct_domains += rs->domains.insert(d.hash, c.keys.data() + d.off, d.len, d.flags);
+    rs->domains.shrink(distinct_domains);
+    rs->domains.build_filter();
+    rs->filter_fp_rate = rs->domains.filter().expected_fp_rate();
+    rs->rule_count = distinct_domains + distinct_ranges;
+
+    rs->load.rules = rs->rule_count;
+    rs->load.duplicates = parsed - rs->rule_count;
+    rs->load.rejected = rejected;
+    rs->load.file_bytes = file.size();
+    rs->load.memory_bytes = rs->domains.memory() + rs->range_count * sizeof(IpRange);
+    rs->load.threads = n;
+    rs->load.load_us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+    {
+        std::lock_guard<std::mutex> lg(pimpl->m);
+        pimpl->rules = std::move(rs);
+        pimpl->version.store(g_next_version.fetch_add(1), std::memory_order_release);
+    }
+    return true;
+}
+
+bool FilterManager::load_snapshot(const std::string &path, const std::string &source_path)
+{
+    std::lock_guard<std::mutex> serial(pimpl->load_m);
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(path, MappedFile::Access::Random) || file->size() < sizeof(SnapshotHeader))
+        return false;
+
+    SnapshotHeader h;
+    std::memcpy(&h, file->data(), sizeof(h));
+    uint64_t total = file->size();
+    if (std::memcmp(h.magic, kSnapshotMagic, sizeof(h.magic)) != 0 || h.version != kSnapshotVersion ||
+        h.byte_order != kByteOrderMark || h.file_bytes != total ||
+        (h.slot_count & (h.slot_count - 1)) != 0 ||
+        !section_fits(h.slots_offset, h.slot_count, sizeof(DomainTable::Slot), total) ||
+        !section_fits(h.keys_offset, h.key_bytes, 1, total) ||
+        !section_fits(h.ranges_offset, h.range_count, sizeof(IpRange), total) ||
+        !section_fits(h.filter_offset, h.filter_blocks, sizeof(BlockedBloom::Block), total))
+        return false;
+
+    // A text file edited since the snapshot was compiled wins.
+    uint64_t source_bytes;
+    int64_t source_mtime;
+    if (source_signature(source_path, source_bytes, source_mtime) &&
+        (source_bytes != h.source_bytes || source_mtime != h.source_mtime))
+        return false;
+
+    std::shared_ptr<Ruleset> rs = std::make_shared<Ruleset>();
+    const char *base = file->data();
+    rs->domains.map(reinterpret_cast<const DomainTable::Slot *>(base + h.slots_offset), h.slot_count,
+                    base + h.keys_offset, h.key_bytes,
+                    reinterpret_cast<const BlockedBloom::Block *>(base + h.filter_offset), h.filter_blocks);
+    rs->filter_fp_rate = h.filter_fp_rate;
+    rs->ranges = reinterpret_cast<const IpRange *>(base + h.ranges_offset);
+    rs->range_count = h.range_count;
+
+    // A damaged table could send lookups outside the mapping or round the
+    // table forever, so it is checked before anything can probe it.
+    if (!rs->domains.intact() || !ranges_ordered(rs->ranges, rs->range_count))
+        return false;
+    rs->snapshot = std::move(file);
+    rs->rule_count = h.rule_count;
+
+    rs->load.rules = h.rule_count;
+    rs->load.duplicates = h.duplicates;
+    rs->load.rejected = h.rejected;
+    rs->load.file_bytes = total;
+    rs->load.memory_bytes = rs->domains.memory() + rs->range_count * sizeof(IpRange);
+    rs->load.snapshot = true;
+    rs->load.load_us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+    {
+        std::lock_guard<std::mutex> lg(pimpl->m);
+        pimpl->rules = std::move(rs);
+        pimpl->version.store(g_next_version.fetch_add(1), std::memory_order_release);
+    }
+    return true;
+}
+
+bool FilterManager::save_snapshot(const std::string &path, const std::string &source_path) const
+{
+    std::shared_ptr<const Ruleset> rs;
+    {
+        std::lock_guard<std::mutex> lg(pimpl->m);
+        rs = pimpl->rules;
+    }
+
+    SnapshotHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, kSnapshotMagic, sizeof(h.magic));
+    h.version = kSnapshotVersion;
+    h.byte_order = kByteOrderMark;
+    uint64_t source_bytes = 0;
+    int64_t source_mtime = 0;
+    if (source_signature(source_path, source_bytes, source_mtime))
+    {
+        h.source_bytes = source_bytes;
+        h.source_mtime = source_mtime;
+    }
+    h.rule_count = rs->rule_count;
+    h.duplicates = rs->load.duplicates;
+    h.rejected = rs->load.rejected;
+    h.slot_count = rs->domains.slot_count();
+    h.key_bytes = rs->domains.key_bytes();
+    h.range_count = rs->range_count;
+    h.slots_offset = align_up(sizeof(h));
+    h.keys_offset = align_up(h.slots_offset + h.slot_count * sizeof(DomainTable::Slot));
+    h.ranges_offset = align_up(h.keys_offset + h.key_bytes);
+    h.filter_blocks = rs->domains.filter().size();
+    h.filter_fp_rate = rs->filter_fp_rate;
+    h.filter_offset = align_up(h.ranges_offset + h.range_count * sizeof(IpRange));
+    h.file_bytes = h.filter_offset + h.filter_blocks * sizeof(BlockedBloom::Block);
+
+    // Written beside the target and renamed over it, so a proxy that has
+    // the old snapshot mapped keeps reading intact pages.
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        static const char zeros[kSectionAlign] = {};
+        uint64_t written = 0;
+        auto put = [&](uint64_t offset, const void *data, uint64_t n)
+        {
+            out.write(zeros, static_cast<std::streamsize>(offset - written));
+            if (n)
+                out.write(static_cast<const char *>(data), static_cast<std::streamsize>(n));
+            written = offset + n;
+        };
+        put(0, &h, sizeof(h));
+        put(h.slots_offset, rs->domains.slot_data(), h.slot_count * sizeof(DomainTable::Slot));
+        put(h.keys_offset, rs->domains.key_data(), h.key_bytes);
+        put(h.ranges_offset, rs->ranges, h.range_count * sizeof(IpRange));
+        put(h.filter_offset, rs->domains.filter().data(), h.filter_blocks * sizeof(BlockedBloom::Block));
+        out.close();
+        if (!out)
+        {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename() does not replace on Windows
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FilterManager::is_blocked(std::string_view hostOrIp) const
+{
+    const char *p = hostOrIp.data();
+    size_t len = hostOrIp.size();
+    while (len > 0 && std::isspace(static_cast<unsigned char>(*p)))
+        ++p, --len;
+    while (len > 0 && std::isspace(static_cast<unsigned char>(p[len - 1])))
+        --len;
+    if (len >= 2 && p[0] == '[' && p[len - 1] == ']')
+        ++p, len -= 2;
+    if (len > 0 && p[len - 1] == '.')
+        --len;
+    if (len == 0)
+        return false;
+
+    SnapshotCache &cache = t_snapshot;
+    if (cache.owner != pimpl || cache.version != pimpl->version.load(std::memory_order_acquire))
+    {
+        cache.flush();
+        std::lock_guard<std::mutex> lg(pimpl->m);
+        cache.owner = pimpl;
+        cache.version = pimpl->version.load(std::memory_order_relaxed);
+        cache.rules = pimpl->rules;
+    }
+    const Ruleset *rs = cache.rules.get();
+
+    char buf[INET6_ADDRSTRLEN];
+    if (rs->range_count != 0 && len < sizeof(buf) && looks_like_ip(p, len))
+    {
+        std::memcpy(buf, p, len);
+        buf[len] = '\0';
+        IpAddr a;
+        int bits;
+        if (parse_ip(buf, a, bits))
+            return rs->ip_blocked(a);
+    }
+    bool blocked = rs->domains.matches(p, len, cache.pending);
+    if (cache.pending.rejected >= kProbeBatch || cache.pending.false_positives != 0) // false positives are rare
+        cache.flush();
+    return blocked;
+}
+
+size_t FilterManager::get_rule_count() const
+{
+    std::lock_guard<std::mutex> lg(pimpl->m);
+    return pimpl->rules->rule_count;
+}
+
+FilterManager::LoadStats FilterManager::get_load_stats() const
+{
+    std::lock_guard<std::mutex> lg(pimpl->m);
+    return pimpl->rules->load;
+}
+
+FilterManager::FilterStats FilterManager::get_filter_stats() const
+{
+    std::shared_ptr<const Ruleset> rs;
+    {
+        std::lock_guard<std::mutex> lg(pimpl->m);
+        rs = pimpl->rules;
+    }
+    FilterStats st;
+    st.bytes = rs->domains.filter().size() * sizeof(BlockedBloom::Block);
+    st.expected_fp_rate = rs->filter_fp_rate;
+    st.rejected = rs->filter_rejected.load(std::memory_order_relaxed);
+    st.false_positives = rs->filter_false_positives.load(std::memory_order_relaxed);
+    return st;
 }
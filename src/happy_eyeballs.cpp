@@ -0,0 +1,115 @@
+#include "happy_eyeballs.h"
+
+using Clock = std::chrono::steady_clock;
+
+void plan_connect(const addrinfo *list, int preferred, ConnectPlan &plan)
+{
+    const addrinfo *first[ConnectPlan::kMaxAddresses];
+    const addrinfo *second[ConnectPlan::kMaxAddresses];
+    size_t nfirst = 0, nsecond = 0;
+    int lead = preferred == AF_INET ? AF_INET : AF_INET6;
+    for (const addrinfo *ai = list; ai; ai = ai->ai_next)
+    {
+        if (ai->ai_family == lead)
+        {
+            if (nfirst < ConnectPlan::kMaxAddresses)
+                first[nfirst++] = ai;
+        }
+        else if (nsecond < ConnectPlan::kMaxAddresses)
+            second[nsecond++] = ai;
+    }
+
+    plan.count = 0;
+    size_t i = 0, j = 0;
+    while (plan.count < ConnectPlan::kMaxAddresses && (i < nfirst || j < nsecond))
+    {
+        if (i < nfirst)
+            plan.addrs[plan.count++] = first[i++];
+        if (j < nsecond && plan.count < ConnectPlan::kMaxAddresses)
+            plan.addrs[plan.count++] = second[j++];
+    }
+}
+
+SOCKET race_connect(const ConnectPlan &plan, unsigned timeout_ms, int &family, bool &timed_out)
+{
+    SOCKET socks[ConnectPlan::kMaxAddresses];
+    for (SOCKET &s : socks)
+        s = INVALID_SOCKET;
+    size_t started = 0;
+    size_t pending = 0;
+    SOCKET winner = INVALID_SOCKET;
+    timed_out = false;
+
+    auto now = Clock::now();
+    auto deadline = now + std::chrono::milliseconds(timeout_ms);
+    auto next_start = now;
+    while (winner == INVALID_SOCKET)
+    {
+        now = Clock::now();
+        // The next attempt starts once its predecessor has had its head
+        // start, or at once if nothing is pending any more.
+        if (started < plan.count && (pending == 0 || now >= next_start))
+        {
+            size_t i = started++;
+            const addrinfo *ai = plan.addrs[i];
+            SOCKET s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s == INVALID_SOCKET)
+                continue;
+            int rc = start_connect(s, ai->ai_addr, (int)ai->ai_addrlen);
+            if (rc < 0)
+            {
+                closesocket(s);
+                continue;
+            }
+            socks[i] = s;
+            if (rc > 0)
+                winner = s;
+            ++pending;
+            next_start = now + kAttemptDelay;
+            continue;
+        }
+        if (pending == 0)
+            break; // every address failed
+        if (now >= deadline)
+        {
+            timed_out = true;
+            break;
+        }
+
+        auto until = deadline;
+        if (started < plan.count && next_start < until)
+            until = next_start;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - now) + std::chrono::milliseconds(1);
+        int done[ConnectPlan::kMaxAddresses];
+        if (wait_connected(socks, started, (unsigned)wait.count(), done) < 0)
+            break;
+        for (size_t i = 0; i < started && winner == INVALID_SOCKET; ++i)
+        {
+            if (done[i] > 0)
+                winner = socks[i];
+            else if (done[i] < 0)
+            {
+                closesocket(socks[i]);
+                socks[i] = INVALID_SOCKET;
+                --pending;
+                next_start = now; // a failure hands over straight away
+            }
+        }
+    }
+
+    for (size_t i = 0; i < started; ++i)
+    {
+        if (socks[i] == INVALID_SOCKET)
+            continue;
+        if (socks[i] == winner)
+            family = plan.addrs[i]->ai_family;
+        else
+            closesocket(socks[i]);
+    }
+    if (winner != INVALID_SOCKET && !set_blocking(winner))
+    {
+        closesocket(winner);
+        winner = INVALID_SOCKET;
+    }
+    return winner;
+}
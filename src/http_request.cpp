@@ -0,0 +1,394 @@
+#include "http_request.h"
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HTTP_REQUEST_SSE2 1
+#endif
+
+static inline std::string trim(const std::string &s)
+{
+    size_t start = 0;
+    while (start < s.size() && std::isspace((unsigned char)s[start]))
+        ++start;
+    size_t end = s.size();
+    while (end > start && std::isspace((unsigned char)s[end - 1]))
+        --end;
+    return s.substr(start, end - start);
+}
+
+static inline std::string to_lower(const std::string &s)
+{
+    std::string r = s;
+    std::transform(r.begin(), r.end(), r.begin(), [](unsigned char c)
+                   { return (char)std::tolower(c); });
+    return r;
+}
+
+static inline char fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+}
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); ++i)
+        if (fold(a[i]) != fold(b[i]))
+            return false;
+    return true;
+}
+
+static inline bool is_ows(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static std::string_view trim_ows(std::string_view s)
+{
+    while (!s.empty() && is_ows(s.front()))
+        s.remove_prefix(1);
+    while (!s.empty() && is_ows(s.back()))
+        s.remove_suffix(1);
+    return s;
+}
+
+// RFC 9110 tchar: the characters allowed in methods and header names.
+static bool is_tchar(unsigned char c)
+{
+    static const bool table[256] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+        0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0};
+    return table[c];
+}
+
+/**
+ * Returns the first byte in [p, end) below 0x20 or equal to 0x7f, or end.
+ * Printable bytes make up almost all of a head, so the vector loop
+ * usually runs straight to the CR that ends the line.
+ */
+static const char *find_control(const char *p, const char *end)
+{
+#ifdef HTTP_REQUEST_SSE2
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // Unsigned v >= 0x20 exactly when max(v, 0x20) == v.
+        int printable = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), v));
+        int mask = (~printable & 0xffff) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, del));
+        if (mask != 0)
+            return p + __builtin_ctz((unsigned)mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c < 0x20 || c == 0x7f)
+            return p;
+    }
+    return end;
+}
+
+// Splits "host", "host:port" or "[v6]:port" into spans relative to base.
+static bool split_authority(std::string_view s, uint32_t base, HttpRequest::Span &host, HttpRequest::Span &port)
+{
+    size_t colon;
+    if (!s.empty() && s.front() == '[')
+    {
+        size_t close = s.find(']');
+        if (close == std::string_view::npos)
+            return false;
+        host = {base + 1, (uint32_t)(close - 1)};
+        colon = close + 1 < s.size() && s[close + 1] == ':' ? close + 1 : std::string_view::npos;
+    }
+    else
+    {
+        colon = s.find(':');
+        host = {base, (uint32_t)std::min(colon, s.size())};
+    }
+    if (colon != std::string_view::npos)
+        port = {base + (uint32_t)colon + 1, (uint32_t)(s.size() - colon - 1)};
+    return host.len > 0;
+}
+
+std::string_view HttpRequest::port() const
+{
+    if (port_span.len > 0)
+        return view(port_span);
+    return method() == "CONNECT" ? "443" : "80";
+}
+
+std::string_view HttpRequest::header(std::string_view name) const
+{
+    for (uint32_t i = 0; i < field_count; ++i)
+        if (iequals(view(fields[i].name), name))
+            return view(fields[i].value);
+    return std::string_view();
+}
+
+bool HttpRequest::has_header(std::string_view name) const
+{
+    for (uint32_t i = 0; i < field_count; ++i)
+        if (iequals(view(fields[i].name), name))
+            return true;
+    return false;
+}
+
+void HttpRequest::clear()
+{
+    head.clear();
+    line = method_span = target_span = version_span = host_span = port_span = Span();
+    field_count = 0;
+}
+
+RequestParser::Result RequestParser::parse(const char *buffer, size_t size, HttpRequest &req)
+{
+    while (m_state == State::RequestLine || m_state == State::Headers)
+    {
+        size_t eol, next;
+        for (;;)
+        {
+            const char *q = find_control(buffer + m_scan, buffer + size);
+            if (q == buffer + size)
+            {
+                m_scan = size;
+                return Result::Incomplete;
+            }
+            if (*q == '\t')
+            {
+                m_scan = (size_t)(q - buffer) + 1;
+                continue;
+            }
+            if (*q == '\n')
+            {
+                eol = (size_t)(q - buffer);
+                next = eol + 1; // bare LF, tolerated as RFC 9112 allows
+                break;
+            }
+            if (*q == '\r')
+            {
+                if (q + 1 == buffer + size)
+                {
+                    m_scan = (size_t)(q - buffer);
+                    return Result::Incomplete;
+                }
+                if (q[1] == '\n')
+                {
+                    eol = (size_t)(q - buffer);
+                    next = eol + 2;
+                    break;
+                }
+            }
+            m_state = State::Error;
+            return Result::Invalid;
+        }
+
+        Result r = parse_line(buffer, m_pos, eol, req);
+        m_pos = m_scan = next;
+        if (r != Result::Incomplete)
+            return r;
+    }
+    return m_state == State::Done ? Result::Complete : Result::Invalid;
+}
+
+RequestParser::Result RequestParser::parse_line(const char *buffer, size_t begin, size_t end, HttpRequest &req)
+{
+    std::string_view line(buffer + begin, end - begin);
+    uint32_t base = (uint32_t)begin;
+
+    if (m_state == State::RequestLine)
+    {
+        if (line.empty())
+            return Result::Incomplete; // stray CRLF before the request line
+        req.line = {base, (uint32_t)line.size()};
+
+        size_t sp1 = line.find(' ');
+        size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+        if (sp2 == std::string_view::npos || sp1 == 0 || sp2 == sp1 + 1)
+        {
+            m_state = State::Error;
+            return Result::Invalid;
+        }
+        for (size_t i = 0; i < sp1; ++i)
+        {
+            if (!is_tchar((unsigned char)line[i]))
+            {
+                m_state = State::Error;
+                return Result::Invalid;
+            }
+        }
+        std::string_view version = line.substr(sp2 + 1);
+        if (version.size() != 8 || version.compare(0, 7, "HTTP/1.") != 0 || version[7] < '0' || version[7] > '9')
+        {
+            m_state = State::Error;
+            return Result::Invalid;
+        }
+        req.method_span = {base, (uint32_t)sp1};
+        req.target_span = {base + (uint32_t)sp1 + 1, (uint32_t)(sp2 - sp1 - 1)};
+        req.version_span = {base + (uint32_t)sp2 + 1, 8};
+        m_state = State::Headers;
+        return Result::Incomplete;
+    }
+
+    if (line.empty())
+    {
+        m_state = derive_target(buffer, req) ? State::Done : State::Error;
+        return m_state == State::Done ? Result::Complete : Result::Invalid;
+    }
+
+    // Folded continuation lines are obsolete (RFC 9112 section 5.2), and
+    // whitespace between the name and the colon is forbidden.
+    size_t colon = line.find(':');
+    if (colon == 0 || colon == std::string_view::npos || req.field_count == HttpRequest::kMaxHeaders)
+    {
+        m_state = State::Error;
+        return Result::Invalid;
+    }
+    for (size_t i = 0; i < colon; ++i)
+    {
+        if (!is_tchar((unsigned char)line[i]))
+        {
+            m_state = State::Error;
+            return Result::Invalid;
+        }
+    }
+    std::string_view raw_value = line.substr(colon + 1);
+    std::string_view value = trim_ows(raw_value);
+    HttpRequest::Field &f = req.fields[req.field_count++];
+    f.name = {base, (uint32_t)colon};
+    f.value = {base + (uint32_t)(colon + 1 + (value.data() - raw_value.data())), (uint32_t)value.size()};
+    return Result::Incomplete;
+}
+
+bool RequestParser::derive_target(const char *buffer, HttpRequest &req)
+{
+    std::string_view method(buffer + req.method_span.off, req.method_span.len);
+    if (method == "CONNECT")
+    {
+        split_authority(std::string_view(buffer + req.target_span.off, req.target_span.len), req.target_span.off,
+                        req.host_span, req.port_span);
+        return true;
+    }
+    for (uint32_t i = 0; i < req.field_count; ++i)
+    {
+        const HttpRequest::Field &f = req.fields[i];
+        if (iequals(std::string_view(buffer + f.name.off, f.name.len), "host"))
+        {
+            split_authority(std::string_view(buffer + f.value.off, f.value.len), f.value.off, req.host_span, req.port_span);
+            break;
+        }
+    }
+    // A missing host is not a syntax error: the router answers it with 400.
+    return true;
+}
+
+void RequestParser::finish(std::string &buffer, HttpRequest &req, std::string &rest)
+{
+    size_t n = m_state == State::Done ? m_pos : buffer.size();
+    if (n < buffer.size())
+        rest.assign(buffer, n, std::string::npos);
+    else
+        rest.clear();
+    buffer.resize(n);
+    req.head.swap(buffer);
+    buffer.clear();
+}
+
+void parse_request_head(const std::string &data, HttpRequest &req)
+{
+    req = HttpRequest();
+    req.head = data;
+    RequestParser parser;
+    if (parser.parse(req.head, req) == RequestParser::Result::Complete)
+        req.head.resize(parser.head_length());
+}
+
+void parse_header_fields(std::istream &in, std::map<std::string, std::string> &headers)
+{
+    std::string line;
+    while (std::getline(in, line) && line != "\r" && !line.empty())
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t pos = line.find(':');
+        if (pos != std::string::npos)
+            headers[to_lower(trim(line.substr(0, pos)))] = trim(line.substr(pos + 1));
+    }
+}
+
+bool header_has_token(std::string_view value, std::string_view token)
+{
+    while (true)
+    {
+        size_t end = value.find(',');
+        if (iequals(trim_ows(value.substr(0, end)), token))
+            return true;
+        if (end == std::string_view::npos)
+            return false;
+        value.remove_prefix(end + 1);
+    }
+}
+
+bool request_keep_alive(const HttpRequest &req)
+{
+    std::string_view conn = req.has_header("proxy-connection") ? req.header("proxy-connection") : req.header("connection");
+    if (req.version() == "HTTP/1.1")
+        return !header_has_token(conn, "close");
+    return header_has_token(conn, "keep-alive");
+}
+
+static bool is_hop_by_hop(std::string_view name, std::string_view connection)
+{
+    static const std::string_view fixed[] = {"connection", "proxy-connection", "keep-alive", "te", "proxy-authorization"};
+    for (std::string_view h : fixed)
+        if (iequals(name, h))
+            return true;
+    return !connection.empty() && header_has_token(connection, name);
+}
+
+size_t forward_request_pieces(const HttpRequest &req, bool keep_alive, std::string_view *pieces)
+{
+    const std::string &head = req.head;
+    std::string_view connection = req.header("connection");
+    // The body is framed by Transfer-Encoding, so a Content-Length sent
+    // along with it could only mislead the origin (RFC 9112 section 6.3).
+    bool chunked = req.has_header("transfer-encoding");
+    size_t n = 0;
+    size_t run = req.line.off; // start of the lines being kept
+    for (uint32_t i = 0; i < req.field_count; ++i)
+    {
+        std::string_view name = req.header_name(i);
+        if (!is_hop_by_hop(name, connection) && !(chunked && iequals(name, "content-length")))
+            continue;
+        size_t line = req.fields[i].name.off;
+        size_t next = i + 1 < req.field_count ? req.fields[i + 1].name.off : head.find('\n', line) + 1;
+        if (line > run)
+            pieces[n++] = std::string_view(head.data() + run, line - run);
+        run = next;
+    }
+    // The blank line ending the head is "\r\n" or a bare "\n".
+    size_t blank = head.size() >= 2 && head[head.size() - 2] == '\r' ? head.size() - 2 : head.size() - 1;
+    if (blank > run)
+        pieces[n++] = std::string_view(head.data() + run, blank - run);
+    pieces[n++] = keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return n;
+}
+
+std::string build_forward_request(const HttpRequest &req, bool keep_alive)
+{
+    std::string_view pieces[kMaxForwardPieces];
+    size_t n = forward_request_pieces(req, keep_alive, pieces);
+    std::string out;
+    out.reserve(req.head.size() + 32);
+    for (size_t i = 0; i < n; ++i)
+        out.append(pieces[i]);
+    return out;
+}
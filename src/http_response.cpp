@@ -0,0 +1,69 @@
+#include "http_response.h"
+#include <sstream>
+#include <cctype>
+#include <cstdlib>
+
+#include "http_request.h"
+
+bool parse_response_head(const std::string &data, HttpResponse &resp)
+{
+    std::istringstream rs(data);
+    std::getline(rs, resp.status_line);
+    if (!resp.status_line.empty() && resp.status_line.back() == '\r')
+        resp.status_line.pop_back();
+
+    std::istringstream sl(resp.status_line);
+    std::string code;
+    sl >> resp.version >> code;
+    if (resp.version.compare(0, 7, "HTTP/1.") != 0 || code.size() != 3)
+        return false;
+    char *end = nullptr;
+    resp.status = (int)std::strtol(code.c_str(), &end, 10);
+    if (*end != '\0' || resp.status < 100)
+        return false;
+
+    parse_header_fields(rs, resp.headers);
+    return true;
+}
+
+bool response_keep_alive(const HttpResponse &resp)
+{
+    auto it = resp.headers.find("connection");
+    std::string conn = it != resp.headers.end() ? it->second : "";
+    if (resp.version == "HTTP/1.1")
+        return !header_has_token(conn, "close");
+    return header_has_token(conn, "keep-alive");
+}
+
+static bool is_connection_header(const std::string &line)
+{
+    size_t colon = line.find(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string name = line.substr(0, colon);
+    for (char &ch : name)
+        ch = (char)std::tolower((unsigned char)ch);
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection";
+}
+
+std::string rewrite_response_head(const std::string &head, bool keep_alive)
+{
+    std::string out;
+    out.reserve(head.size() + 32);
+    size_t pos = 0;
+    while (pos < head.size())
+    {
+        size_t eol = head.find("\r\n", pos);
+        if (eol == std::string::npos || eol == pos)
+            break; // blank line: end of head
+        std::string line = head.substr(pos, eol - pos);
+        if (pos == 0 || !is_connection_header(line))
+        {
+            out += line;
+            out += "\r\n";
+        }
+        pos = eol + 2;
+    }
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return out;
+}
@@ -1,59 +1,323 @@
 #include "logger.h"
-#include <fstream>
-#include <mutex>
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
-#include <iomanip>
-#include <sstream>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+constexpr size_t kMaxField = 2048; ///< Longer fields are cut short and marked with "...".
+
+/**
+ * Single-producer, single-consumer byte ring. The owning thread appends
+ * whole records; the writer thread takes everything up to head.
+ * head and tail only ever grow; they are reduced modulo the capacity.
+ */
+struct Ring
+{
+    explicit Ring(size_t capacity) : data(capacity), mask(capacity - 1) {}
+
+    std::vector<char> data;
+    size_t mask;
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<bool> retired{false}; ///< The owning thread has exited.
+
+    bool push(const char *p, size_t n)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (data.size() - (h - t) < n)
+            return false;
+        size_t off = h & mask;
+        size_t first = std::min(n, data.size() - off);
+        std::memcpy(&data[off], p, first);
+        std::memcpy(&data[0], p + first, n - first);
+        head.store(h + n, std::memory_order_release);
+        return true;
+    }
+
+    void drain(std::string &out)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        if (h == t)
+            return;
+        size_t n = h - t;
+        size_t off = t & mask;
+        size_t first = std::min(n, data.size() - off);
+        out.append(&data[off], first);
+        out.append(&data[0], n - first);
+        tail.store(h, std::memory_order_release);
+    }
+};
+
+std::atomic<uint64_t> g_next_logger_id{1};
+
+/// The calling thread's ring. Marks it retired on thread exit so the
+/// writer can drop it once it is empty.
+struct ThreadRing
+{
+    uint64_t owner = 0;
+    std::shared_ptr<Ring> ring;
+
+    ~ThreadRing()
+    {
+        if (ring)
+            ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+thread_local ThreadRing t_ring;
+
+/// strftime() runs at most once per second per thread.
+struct TimestampCache
+{
+    std::time_t sec = -1;
+    char text[32];
+    size_t len = 0;
+};
+
+thread_local TimestampCache t_stamp;
+
+const TimestampCache &timestamp_now()
+{
+    std::time_t now = std::time(nullptr);
+    if (now != t_stamp.sec)
+    {
+        std::tm gmt;
+#ifdef _WIN32
+        gmtime_s(&gmt, &now);
+#else
+        gmtime_r(&now, &gmt);
+#endif
+        t_stamp.len = std::strftime(t_stamp.text, sizeof(t_stamp.text), "%Y-%m-%dT%H:%M:%SZ", &gmt);
+        t_stamp.sec = now;
+    }
+    return t_stamp;
+}
+
+void append_escaped(std::string &out, std::string_view s)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = std::min(s.size(), kMaxField);
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            out += "\\x";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        else
+            out += static_cast<char>(c);
+    }
+    if (n < s.size())
+        out += "...";
+}
+
+template <typename T>
+void append_number(std::string &out, T v)
+{
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof(buf), v);
+    out.append(buf, r.ptr - buf);
+}
+}
 
 struct Logger::Impl
 {
-    std::ofstream ofs;
-    std::mutex m;
+    uint64_t id = g_next_logger_id.fetch_add(1);
+    Options opt;
+    std::string path;
+    std::FILE *file = nullptr;
+    size_t file_bytes = 0;
+
+    std::mutex rings_m; ///< Guards rings; taken once per thread, on its first record.
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::atomic<uint64_t> dropped{0};
+
+    std::mutex wake_m;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread writer;
+    std::string batch; ///< Writer thread only.
+
+    Ring &ring_for_this_thread()
+    {
+        if (t_ring.owner != id)
+        {
+            size_t cap = 4096;
+            while (cap < opt.ring_bytes)
+                cap <<= 1;
+            auto ring = std::make_shared<Ring>(cap);
+            {
+                std::lock_guard<std::mutex> lg(rings_m);
+                rings.push_back(ring);
+            }
+            if (t_ring.ring)
+                t_ring.ring->retired.store(true, std::memory_order_release);
+            t_ring.owner = id;
+            t_ring.ring = std::move(ring);
+        }
+        return *t_ring.ring;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(wake_m);
+        while (!stopping)
+        {
+            wake.wait_for(lock, std::chrono::milliseconds(opt.flush_ms));
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    }
+
+    void flush()
+    {
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> lg(rings_m);
+            for (auto it = rings.begin(); it != rings.end();)
+            {
+                // Read retired before draining so a thread's last records
+                // are never left behind in a ring that is then dropped.
+                bool gone = (*it)->retired.load(std::memory_order_acquire);
+                (*it)->drain(batch);
+                it = gone ? rings.erase(it) : it + 1;
+            }
+        }
+        if (batch.empty())
+            return;
+
+        if (file)
+        {
+            std::fwrite(batch.data(), 1, batch.size(), file);
+            file_bytes += batch.size();
+            if (opt.max_file_bytes && file_bytes >= opt.max_file_bytes)
+                rotate();
+        }
+        if (opt.echo_stdout)
+        {
+            std::fwrite(batch.data(), 1, batch.size(), stdout);
+            std::fflush(stdout);
+        }
+    }
+
+    bool open_file()
+    {
+        file = std::fopen(path.c_str(), "ab");
+        if (!file)
+            return false;
+        // Unbuffered: every batch becomes a single write(2).
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        std::fseek(file, 0, SEEK_END);
+        long size = std::ftell(file);
+        file_bytes = size > 0 ? static_cast<size_t>(size) : 0;
+        return true;
+    }
+
+    // proxy.log -> proxy.log.1 -> ... -> proxy.log.N (oldest discarded).
+    void rotate()
+    {
+        std::fclose(file);
+        file = nullptr;
+        for (unsigned i = opt.keep_files; i > 0; --i)
+        {
+            std::string to = path + "." + std::to_string(i);
+            std::string from = i == 1 ? path : path + "." + std::to_string(i - 1);
+            std::remove(to.c_str());
+            std::rename(from.c_str(), to.c_str());
+        }
+        if (opt.keep_files == 0)
+            std::remove(path.c_str());
+        open_file();
+    }
 };
 
 Logger::~Logger()
 {
     if (pimpl)
     {
-        if (pimpl->ofs.is_open())
-            pimpl->ofs.close();
+        {
+            std::lock_guard<std::mutex> lg(pimpl->wake_m);
+            pimpl->stopping = true;
+        }
+        pimpl->wake.notify_one();
+        if (pimpl->writer.joinable())
+            pimpl->writer.join();
+        pimpl->flush();
+        if (pimpl->file)
+            std::fclose(pimpl->file);
         delete pimpl;
     }
 }
 
-bool Logger::init(const std::string &path)
+bool Logger::init(const std::string &path, const Options &options)
 {
-    if (!pimpl)
-        pimpl = new Impl();
-    std::lock_guard<std::mutex> lg(pimpl->m);
-    pimpl->ofs.open(path, std::ios::app);
-    return pimpl->ofs.is_open();
+    if (pimpl)
+        return pimpl->file != nullptr;
+    pimpl = new Impl();
+    pimpl->opt = options;
+    pimpl->path = path;
+    bool ok = pimpl->open_file();
+    Impl *impl = pimpl;
+    impl->writer = std::thread([impl]()
+                               { impl->run(); });
+    return ok;
 }
 
-static std::string iso_timestamp_now()
+bool Logger::init(const std::string &path)
 {
-    using namespace std::chrono;
-    auto now = system_clock::now();
-    std::time_t t = system_clock::to_time_t(now);
-    std::tm *gmt = std::gmtime(&t); 
-    char buf[64];
-    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmt);
-    return std::string(buf);
+    return init(path, Options());
 }
 
-void Logger::log(const std::string &client, const std::string &hostport,
-                 const std::string &request_line, const std::string &action,
+void Logger::log(std::string_view client, std::string_view hostport,
+                 std::string_view request_line, std::string_view action,
                  int status, size_t bytes_transferred)
 {
     if (!pimpl)
         return;
-    std::lock_guard<std::mutex> lg(pimpl->m);
-    std::ostringstream oss;
-    oss << iso_timestamp_now() << " "
-        << client << " \"" << request_line << "\" "
-        << hostport << " " << action << " " << status << " " << bytes_transferred << "\n";
-    pimpl->ofs << oss.str();
-    pimpl->ofs.flush();
+
+    thread_local std::string rec;
+    rec.clear();
+    const TimestampCache &ts = timestamp_now();
+    rec.append(ts.text, ts.len);
+    rec += ' ';
+    append_escaped(rec, client);
+    rec += " \"";
+    append_escaped(rec, request_line);
+    rec += "\" ";
+    append_escaped(rec, hostport);
+    rec += ' ';
+    append_escaped(rec, action);
+    rec += ' ';
+    append_number(rec, status);
+    rec += ' ';
+    append_number(rec, bytes_transferred);
+    rec += '\n';
+
+    if (!pimpl->ring_for_this_thread().push(rec.data(), rec.size()))
+        pimpl->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Logger::get_dropped() const
+{
+    return pimpl ? pimpl->dropped.load(std::memory_order_relaxed) : 0;
 }
@@ -8,27 +8,71 @@
 
 #include "proxy_server.h"
 #include <iostream>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
 
 /**
  * @brief Main entry point of the application.
  * * Initializes the ProxyServer class and starts the listening loop.
+ * * Options:
+ *   --engine=threads|epoll|uring  I/O engine (epoll is the default on Linux).
+ *   --loops=N                Number of event loop threads for the epoll/uring engines.
+ *   --reuseport              One SO_REUSEPORT listener per event loop (no shared accept queue).
+ *   --pin-cpus               Pin each event loop thread to its own CPU.
+ *   --log-flush-ms=N         Access log flush interval in milliseconds (default 100).
+ *   --cache-mb=N             Response cache size for the threads engine (default 64, 0 disables it).
  */
-int main()
+int main(int argc, char **argv)
 {
-    
-    ProxyServer server(8888);
+    ProxyOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--engine=threads")
+            options.engine = ProxyOptions::Engine::Threads;
+#ifdef __linux__
+        else if (arg == "--engine=epoll")
+            options.engine = ProxyOptions::Engine::Epoll;
+        else if (arg == "--engine=uring")
+            options.engine = ProxyOptions::Engine::Uring;
+#endif
+        else if (arg == "--reuseport")
+            options.reuse_port = true;
+        else if (arg == "--pin-cpus")
+            options.pin_cpus = true;
+        else if (arg.rfind("--loops=", 0) == 0)
+            options.event_loops = std::strtoul(arg.c_str() + 8, nullptr, 10);
+        else if (arg.rfind("--log-flush-ms=", 0) == 0)
+            options.log_flush_ms = std::max(1ul, std::strtoul(arg.c_str() + 15, nullptr, 10));
+        else if (arg.rfind("--cache-mb=", 0) == 0)
+            options.cache_bytes = (size_t)std::strtoul(arg.c_str() + 11, nullptr, 10) << 20;
+        else
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    ProxyServer server(8888, options);
 
  
     std::cout << "=======================================" << std::endl;
     std::cout << "   CUSTOM NETWORK PROXY SERVER v1.0    " << std::endl;
     std::cout << "=======================================" << std::endl;
     std::cout << "[INFO] System Ready." << std::endl;
-    std::cout << "[INFO] Listening on port 8888..." << std::endl;
+    const char *engine = "threads";
+    if (options.engine == ProxyOptions::Engine::Epoll)
+        engine = "epoll";
+    else if (options.engine == ProxyOptions::Engine::Uring)
+        engine = "io_uring";
+    std::cout << "[INFO] I/O engine: " << engine << std::endl;
     std::cout << "[HINT] Press Ctrl+C to shut down the server." << std::endl;
     std::cout << "---------------------------------------" << std::endl;
 
 
-    server.start();
+    if (!server.start())
+        return 1;
 
     return 0;
 }
\ No newline at end of file
@@ -5,33 +5,230 @@
 #include <unordered_map>
 #include <mutex>
 #include <algorithm>
-#include <queue>
-#include <sstream>
+#include <memory>
 
 using namespace std::chrono;
 
+namespace {
+
+/// Distinct hosts tracked per thread. Heavier hosts are never evicted by
+/// lighter ones, so the top of the list stays exact while memory is bounded.
+constexpr size_t kSketchCapacity = 1024;
+
+/**
+ * Space-Saving heavy-hitters summary. Counters sit in a fixed array with
+ * a key -> slot index; a binary min-heap of slot numbers (each slot knows
+ * its heap position) finds the counter to evict. Increments and evictions
+ * are O(log capacity) and never rehash a key while sifting.
+ */
+class SpaceSaving {
+public:
+    struct Entry {
+        std::string key;
+        uint64_t count;
+        size_t heap_pos;
+    };
+
+    void add(const std::string &key) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            Entry &e = entries[it->second];
+            e.count += 1;
+            sift_down(e.heap_pos);
+            return;
+        }
+        if (entries.size() < kSketchCapacity) {
+            size_t slot = entries.size();
+            entries.push_back(Entry{key, 1, heap.size()});
+            heap.push_back(slot);
+            index.emplace(key, slot);
+            sift_up(heap.size() - 1);
+            return;
+        }
+        // Evict the smallest counter and let the new key inherit it: its
+        // count may be overestimated by at most the evicted count. The map
+        // node is reused, so a steady stream of new hosts does not allocate.
+        size_t slot = heap[0];
+        Entry &e = entries[slot];
+        auto node = index.extract(e.key);
+        node.key() = key;
+        index.insert(std::move(node));
+        e.key = key;
+        e.count += 1;
+        sift_down(0);
+    }
+
+    const std::vector<Entry> &counters() const { return entries; }
+
+private:
+    std::vector<Entry> entries;
+    std::vector<size_t> heap; ///< Slot numbers, smallest count first.
+    std::unordered_map<std::string, size_t> index;
+
+    bool less(size_t a, size_t b) const { return entries[heap[a]].count < entries[heap[b]].count; }
+
+    void swap_at(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        entries[heap[a]].heap_pos = a;
+        entries[heap[b]].heap_pos = b;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0 && less(i, (i - 1) / 2)) {
+            swap_at(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t i) {
+        for (;;) {
+            size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < heap.size() && less(l, m)) m = l;
+            if (r < heap.size() && less(r, m)) m = r;
+            if (m == i) return;
+            swap_at(i, m);
+            i = m;
+        }
+    }
+};
+
+/**
+ * Log-bucketed latency histogram (HDR style) over microseconds: values
+ * below 16 get a bucket each, then every power of two is split into 8
+ * sub-buckets, so a bucket is never wider than 1/8 of its lower bound.
+ * 280 buckets reach about 38 hours.
+ */
+constexpr int kSubBits = 3;
+constexpr size_t kLinear = 16;
+constexpr size_t kBuckets = kLinear + (36 - 4 + 1) * (1u << kSubBits);
+constexpr size_t kPhases = static_cast<size_t>(Metrics::Phase::Count);
+constexpr size_t kTimeouts = static_cast<size_t>(Metrics::Timeout::Count);
+
+size_t bucket_of(uint64_t us) {
+    if (us < kLinear) return static_cast<size_t>(us);
+    int exp = 63 - __builtin_clzll(us);
+    size_t b = kLinear + static_cast<size_t>(exp - 4) * (1u << kSubBits) +
+               ((us >> (exp - kSubBits)) & ((1u << kSubBits) - 1));
+    return std::min(b, kBuckets - 1);
+}
+
+/// Midpoint of the values that land in bucket b.
+uint64_t bucket_value(size_t b) {
+    if (b < kLinear) return b;
+    int exp = static_cast<int>((b - kLinear) >> kSubBits) + 4;
+    uint64_t sub = (b - kLinear) & ((1u << kSubBits) - 1);
+    uint64_t width = 1ull << (exp - kSubBits);
+    return ((1ull << exp) + sub * width) + width / 2;
+}
+
+struct Histogram {
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> sum_us{0};
+
+    Histogram() {
+        for (auto &b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    // Only the owning thread writes, so a plain load/store pair is enough
+    // and avoids a locked instruction per sample.
+    void add(uint64_t us) {
+        auto &b = buckets[bucket_of(us)];
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_us.store(sum_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Counters written by a single thread. Each shard is allocated on its own
+ * cache lines, so recording never bounces a line between cores; readers
+ * sum the shards when asked.
+ */
+struct alignas(64) Shard {
+    explicit Shard(size_t window) : slots(window) {
+        for (auto &s : slots) s.store(0, std::memory_order_relaxed);
+    }
+
+    std::vector<std::atomic<uint64_t>> slots; ///< Requests per second of the window.
+    std::atomic<uint64_t> zero_copy_bytes{0};
+    std::atomic<uint64_t> copied_bytes{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<int64_t> conns_opened{0};
+    std::atomic<int64_t> conns_closed{0};
+    std::atomic<uint64_t> timeouts[kTimeouts]{};
+    Histogram latency[kPhases];
+
+    std::mutex sketch_mtx; ///< Uncontended except while a reader merges.
+    SpaceSaving sketch;
+
+    std::atomic<bool> retired{false}; ///< Owner exited; the next new thread adopts it.
+};
+
+std::atomic<uint64_t> g_next_metrics_id{1};
+
+struct ThreadShard {
+    uint64_t owner = 0;
+    std::shared_ptr<Shard> shard;
+    std::string scratch; ///< Lower-cased domain, reused to avoid an allocation per request.
+
+    ~ThreadShard() {
+        if (shard) shard->retired.store(true, std::memory_order_release);
+    }
+};
+
+thread_local ThreadShard t_shard;
+
+}
+
 struct Metrics::Impl {
+    uint64_t id = g_next_metrics_id.fetch_add(1);
     size_t window_seconds;
     size_t slots_count;
-    std::vector<std::atomic<uint64_t>> slots; 
     std::atomic<size_t> current_slot;
     std::atomic<bool> running;
     std::thread adv_thread;
 
-    mutable std::mutex domain_mtx;
-    std::unordered_map<std::string, uint64_t> domain_counts;
+    mutable std::mutex shards_mtx; ///< Guards the shard list; taken once per thread and by readers.
+    std::vector<std::shared_ptr<Shard>> shards;
 
     size_t top_k_default;
 
     Impl(size_t ws, size_t topk)
         : window_seconds(ws),
           slots_count(ws),
-          slots(ws),
           current_slot(0),
           running(false),
           top_k_default(topk)
-    {
-        for (size_t i = 0; i < slots_count; ++i) slots[i] = 0;
+    {}
+
+    Shard &shard_for_this_thread() {
+        if (t_shard.owner == id) return *t_shard.shard;
+
+        std::shared_ptr<Shard> mine;
+        {
+            std::lock_guard<std::mutex> lg(shards_mtx);
+            for (auto &s : shards) {
+                bool expected = true;
+                if (s->retired.compare_exchange_strong(expected, false)) {
+                    mine = s;
+                    break;
+                }
+            }
+            if (!mine) {
+                mine = std::make_shared<Shard>(slots_count);
+                shards.push_back(mine);
+            }
+        }
+        if (t_shard.shard) t_shard.shard->retired.store(true, std::memory_order_release);
+        t_shard.owner = id;
+        t_shard.shard = std::move(mine);
+        return *t_shard.shard;
+    }
+
+    template <typename F>
+    void for_each_shard(F &&f) const {
+        std::lock_guard<std::mutex> lg(shards_mtx);
+        for (auto &s : shards) f(*s);
     }
 };
 
@@ -53,7 +250,7 @@ void Metrics::start() {
             std::this_thread::sleep_for(std::chrono::seconds(1));
             size_t next = (pimpl->current_slot.load() + 1) % pimpl->slots_count;
 
-            pimpl->slots[next].store(0, std::memory_order_relaxed);
+            pimpl->for_each_shard([next](Shard &s) { s.slots[next].store(0, std::memory_order_relaxed); });
             pimpl->current_slot.store(next, std::memory_order_relaxed);
         }
     });
@@ -66,42 +263,155 @@ void Metrics::stop() {
     }
 }
 
-void Metrics::record_request(const std::string &domain) {
+void Metrics::record_request(std::string_view domain) {
+    Shard &s = pimpl->shard_for_this_thread();
 
     size_t idx = pimpl->current_slot.load(std::memory_order_relaxed);
-    pimpl->slots[idx].fetch_add(1, std::memory_order_relaxed);
+    s.slots[idx].fetch_add(1, std::memory_order_relaxed);
 
-   
-    std::string d = domain.empty() ? "unknown" : domain;
-   
-    for (auto &c : d) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    std::string &d = t_shard.scratch;
+    d.assign(domain.empty() ? std::string_view("unknown") : domain);
+    for (auto &c : d)
+        if (c >= 'A' && c <= 'Z') c = static_cast<char>(c | 0x20);
     {
-        std::lock_guard<std::mutex> lg(pimpl->domain_mtx);
-        pimpl->domain_counts[d] += 1;
+        std::lock_guard<std::mutex> lg(s.sketch_mtx);
+        s.sketch.add(d);
     }
 }
 
-uint64_t Metrics::get_rpm() const {
+void Metrics::record_relay(uint64_t bytes, bool zero_copy, bool to_client) {
+    Shard &s = pimpl->shard_for_this_thread();
+    if (zero_copy)
+        s.zero_copy_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    else
+        s.copied_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if (to_client)
+        s.bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+    else
+        s.bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Metrics::record_latency(Phase phase, std::chrono::steady_clock::duration elapsed) {
+    auto us = duration_cast<microseconds>(elapsed).count();
+    pimpl->shard_for_this_thread().latency[static_cast<size_t>(phase)].add(us > 0 ? static_cast<uint64_t>(us) : 0);
+}
+
+void Metrics::connection_opened() {
+    pimpl->shard_for_this_thread().conns_opened.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::connection_closed() {
+    pimpl->shard_for_this_thread().conns_closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::record_timeout(Timeout kind) {
+    pimpl->shard_for_this_thread().timeouts[static_cast<size_t>(kind)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Metrics::get_bytes_in() const {
+    uint64_t sum = 0;
+    pimpl->for_each_shard([&sum](Shard &s) { sum += s.bytes_in.load(std::memory_order_relaxed); });
+    return sum;
+}
+
+uint64_t Metrics::get_bytes_out() const {
     uint64_t sum = 0;
-    size_t cur = pimpl->current_slot.load(std::memory_order_relaxed);
-    for (size_t i = 0; i < pimpl->slots_count; ++i) {
-        sum += pimpl->slots[i].load(std::memory_order_relaxed);
+    pimpl->for_each_shard([&sum](Shard &s) { sum += s.bytes_out.load(std::memory_order_relaxed); });
+    return sum;
+}
+
+int64_t Metrics::get_active_connections() const {
+    int64_t open = 0;
+    pimpl->for_each_shard([&open](Shard &s) {
+        open += s.conns_opened.load(std::memory_order_relaxed) - s.conns_closed.load(std::memory_order_relaxed);
+    });
+    return std::max<int64_t>(open, 0);
+}
+
+uint64_t Metrics::get_timeouts(Timeout kind) const {
+    uint64_t sum = 0;
+    pimpl->for_each_shard([&](Shard &s) { sum += s.timeouts[static_cast<size_t>(kind)].load(std::memory_order_relaxed); });
+    return sum;
+}
+
+Metrics::LatencySummary Metrics::get_latency(Phase phase) const {
+    std::vector<uint64_t> merged(kBuckets, 0);
+    LatencySummary out;
+    pimpl->for_each_shard([&](Shard &s) {
+        const Histogram &h = s.latency[static_cast<size_t>(phase)];
+        for (size_t b = 0; b < kBuckets; ++b) merged[b] += h.buckets[b].load(std::memory_order_relaxed);
+        out.sum_us += h.sum_us.load(std::memory_order_relaxed);
+    });
+    for (uint64_t n : merged) out.count += n;
+    if (out.count == 0) return out;
+
+    std::pair<double, uint64_t *> wanted[] = {{0.5, &out.p50}, {0.9, &out.p90}, {0.99, &out.p99}, {0.999, &out.p999}};
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (size_t b = 0; b < kBuckets && q < 4; ++b) {
+        seen += merged[b];
+        while (q < 4 && seen >= static_cast<uint64_t>(wanted[q].first * out.count + 0.5) && seen > 0) {
+            *wanted[q].second = bucket_value(b);
+            ++q;
+        }
     }
+    return out;
+}
+
+const char *Metrics::phase_name(Phase phase) {
+    switch (phase) {
+    case Phase::HeaderRead: return "header_read";
+    case Phase::Dns: return "dns";
+    case Phase::Connect: return "connect";
+    case Phase::FirstByte: return "first_byte";
+    case Phase::Total: return "total";
+    default: return "unknown";
+    }
+}
+
+const char *Metrics::timeout_name(Timeout kind) {
+    switch (kind) {
+    case Timeout::Header: return "header";
+    case Timeout::Connect: return "connect";
+    case Timeout::Idle: return "idle";
+    case Timeout::Lifetime: return "lifetime";
+    default: return "unknown";
+    }
+}
+
+uint64_t Metrics::get_zero_copy_bytes() const {
+    uint64_t sum = 0;
+    pimpl->for_each_shard([&sum](Shard &s) { sum += s.zero_copy_bytes.load(std::memory_order_relaxed); });
+    return sum;
+}
+
+uint64_t Metrics::get_copied_bytes() const {
+    uint64_t sum = 0;
+    pimpl->for_each_shard([&sum](Shard &s) { sum += s.copied_bytes.load(std::memory_order_relaxed); });
+    return sum;
+}
+
+uint64_t Metrics::get_rpm() const {
+    uint64_t sum = 0;
+    pimpl->for_each_shard([&sum](Shard &s) {
+        for (auto &slot : s.slots) sum += slot.load(std::memory_order_relaxed);
+    });
     return sum;
 }
 
 std::vector<std::pair<std::string, uint64_t>> Metrics::get_top_k(size_t k) const {
-    std::vector<std::pair<std::string, uint64_t>> out;
-    {
-        std::lock_guard<std::mutex> lg(pimpl->domain_mtx);
-        out.reserve(pimpl->domain_counts.size());
-        for (auto &p : pimpl->domain_counts) out.emplace_back(p.first, p.second);
-    }
-    if (out.empty()) return {};
-    
-    std::sort(out.begin(), out.end(), [](const auto &a, const auto &b){
+    std::unordered_map<std::string, uint64_t> merged;
+    pimpl->for_each_shard([&merged](Shard &s) {
+        std::lock_guard<std::mutex> lg(s.sketch_mtx);
+        for (auto &e : s.sketch.counters()) merged[e.key] += e.count;
+    });
+    if (merged.empty()) return {};
+
+    std::vector<std::pair<std::string, uint64_t>> out(merged.begin(), merged.end());
+    k = std::min(k, out.size());
+    std::partial_sort(out.begin(), out.begin() + k, out.end(), [](const auto &a, const auto &b){
         return a.second > b.second;
     });
-    if (out.size() > k) out.resize(k);
+    out.resize(k);
     return out;
 }
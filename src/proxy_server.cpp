@@ -2,6 +2,10 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
 #include <algorithm>
 #include <chrono>
 #include <map>
@@ -9,34 +13,37 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
 #include <atomic>
 
+#include "event_loop.h"
 #include "filter_manager.h"
+#include "body_framer.h"
+#include "buffer_pool.h"
+#include "dns_resolver.h"
+#include "file_watcher.h"
+#include "happy_eyeballs.h"
+#include "http_request.h"
+#include "http_response.h"
 #include "logger.h"
 #include "metrics.h"
+#include "rate_limiter.h"
+#include "request_handler.h"
+#include "response_cache.h"
+#include "thread_pool.h"
+#include "upstream_pool.h"
 
-#include <ws2tcpip.h>
+#ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
+#endif
 
-static inline std::string trim(const std::string &s)
-{
-    size_t start = 0;
-    while (start < s.size() && std::isspace((unsigned char)s[start]))
-        ++start;
-    size_t end = s.size();
-    while (end > start && std::isspace((unsigned char)s[end - 1]))
-        --end;
-    return s.substr(start, end - start);
-}
-
-static inline std::string to_lower(const std::string &s)
-{
-    std::string r = s;
-    std::transform(r.begin(), r.end(), r.begin(), [](unsigned char c)
-                   { return (char)std::tolower(c); });
-    return r;
-}
+// Deadlines of the thread engine. The event loops keep theirs in EventLoop.
+static const unsigned kHeaderTimeoutMs = 10000;  ///< Waiting for a complete request head.
+static const unsigned kConnectTimeoutMs = 10000; ///< TCP connect to the origin.
+static const unsigned kIdleTimeoutMs = 10000;    ///< SO_RCVTIMEO while relaying.
+static const unsigned kCloseDrainMs = 1000;      ///< Longest graceful_close() waits for the peer.
+static const std::chrono::hours kMaxLifetime{24}; ///< Checked between requests on a connection.
+static const size_t kMaxHeaderBytes = 65536;     ///< Largest request or response head.
+static const unsigned long long kMaxSpeed = 1000000000000ull; ///< 1 TB/s, the largest limit the admin port accepts.
 
 static bool send_all(SOCKET sock, const char *data, size_t length)
 {
@@ -62,50 +69,181 @@ static void graceful_close(SOCKET s)
 
     shutdown(s, SD_SEND);
 
+    // Read what the peer still sends so that closing does not reset the
+    // connection under our last bytes, but do not let a peer that keeps
+    // its side open hold the thread.
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(kCloseDrainMs);
     char drain[1024];
-    while (recv(s, drain, sizeof(drain), 0) > 0)
-        ;
+    for (;;)
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || wait_readable(s, s, (unsigned)left) <= 0 || recv(s, drain, sizeof(drain), 0) <= 0)
+            break;
+    }
 
     closesocket(s);
 }
 
-static void forward_loop(SOCKET src, SOCKET dst, size_t limit)
+static FilterManager filterManager;
+static Logger logger;
+static Metrics metrics;
+static UpstreamPool upstreamPool;
+static RateLimiter rateLimiter;
+
+// recv() on a relay socket; running into its SO_RCVTIMEO counts as an idle timeout.
+static int recv_relay(SOCKET s, char *buf, size_t len)
+{
+    int r = recv(s, buf, (int)len, 0);
+    if (r < 0 && recv_timed_out())
+        metrics.record_timeout(Metrics::Timeout::Idle);
+    return r;
+}
+
+static const char *const kBlocklistPath = "config/blocked_domains.txt";
+static const char *const kSnapshotPath = "config/blocked_domains.bin"; ///< Written by tools/blocklist_compile.
+
+static void warn_rejected_rules()
+{
+    size_t rejected = filterManager.get_load_stats().rejected;
+    if (rejected != 0)
+        std::cerr << "[WARN] Skipped " << rejected << " blocklist lines containing '/' that are not valid address ranges"
+                  << std::endl;
+}
+
+// Rebuilds the ruleset off the request path; lookups keep using the old
+// snapshot until the new one is published.
+static bool reload_blocklist()
+{
+    if (!filterManager.load(kBlocklistPath))
+    {
+        std::cerr << "[WARN] Could not reload " << kBlocklistPath << "; keeping the current rules" << std::endl;
+        return false;
+    }
+    std::cout << "[INFO] Blocklist loaded: " << filterManager.get_rule_count() << " rules" << std::endl;
+    warn_rejected_rules();
+    return true;
+}
+
+static const size_t kPhaseCount = static_cast<size_t>(Metrics::Phase::Count);
+static const size_t kTimeoutCount = static_cast<size_t>(Metrics::Timeout::Count);
+
+// Prometheus text exposition format, version 0.0.4.
+static std::string prometheus_metrics(const ResponseCache *cache)
+{
+    std::ostringstream out;
+    auto metric = [&out](const char *name, const char *type, const char *help, auto value)
+    {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n'
+            << name << ' ' << value << '\n';
+    };
+    metric("proxy_requests_per_minute", "gauge", "Requests seen in the last minute.", metrics.get_rpm());
+    RateLimiter::Limits lim = rateLimiter.limits();
+    out << "# HELP proxy_rate_limit_bytes_per_second Relay limit at each shaping level (0 = unlimited).\n"
+        << "# TYPE proxy_rate_limit_bytes_per_second gauge\n"
+        << "proxy_rate_limit_bytes_per_second{scope=\"connection\"} " << lim.per_connection << '\n'
+        << "proxy_rate_limit_bytes_per_second{scope=\"client\"} " << lim.per_client << '\n'
+        << "proxy_rate_limit_bytes_per_second{scope=\"host\"} " << lim.per_host << '\n'
+        << "proxy_rate_limit_bytes_per_second{scope=\"global\"} " << lim.global << '\n';
+    metric("proxy_rate_limit_deferrals_total", "counter", "Reads postponed by bandwidth shaping.", rateLimiter.get_deferrals());
+    metric("proxy_active_connections", "gauge", "Client connections currently open.", metrics.get_active_connections());
+    metric("proxy_bytes_in_total", "counter", "Bytes relayed from clients to origins.", metrics.get_bytes_in());
+    metric("proxy_bytes_out_total", "counter", "Bytes relayed from origins to clients.", metrics.get_bytes_out());
+    metric("proxy_bytes_zero_copy_total", "counter", "Bytes relayed with splice().", metrics.get_zero_copy_bytes());
+    metric("proxy_upstream_reused_total", "counter", "Requests sent on a pooled upstream connection.", upstreamPool.get_reused());
+    metric("proxy_log_dropped_total", "counter", "Access log records dropped.", logger.get_dropped());
+    FilterManager::LoadStats blocklist = filterManager.get_load_stats();
+    metric("proxy_blocklist_rules", "gauge", "Distinct rules in the loaded blocklist.", blocklist.rules);
+    metric("proxy_blocklist_rejected_lines", "gauge", "Blocklist lines skipped as invalid address ranges.", blocklist.rejected);
+    metric("proxy_blocklist_memory_bytes", "gauge", "Memory held by the compiled blocklist.", blocklist.memory_bytes);
+    metric("proxy_blocklist_load_seconds", "gauge", "Time the last blocklist load took.", blocklist.load_us / 1e6);
+    FilterManager::FilterStats bloom = filterManager.get_filter_stats();
+    out << "# HELP proxy_blocklist_filter_checks_total Host suffixes checked against the blocklist Bloom filter, by outcome.\n"
+        << "# TYPE proxy_blocklist_filter_checks_total counter\n"
+        << "proxy_blocklist_filter_checks_total{result=\"rejected\"} " << bloom.rejected << '\n'
+        << "proxy_blocklist_filter_checks_total{result=\"false_positive\"} " << bloom.false_positives << '\n';
+    metric("proxy_blocklist_filter_expected_fp_rate", "gauge", "False-positive rate predicted from the filter's fill.", bloom.expected_fp_rate);
+    PoolStats pool = pool_stats();
+    metric("proxy_buffers_allocated_total", "counter", "Relay buffers taken from the heap.", pool.buffers_allocated);
+    metric("proxy_buffers_reused_total", "counter", "Relay buffers served from a pool.", pool.buffers_reused);
+    metric("proxy_buffers_in_use", "gauge", "Relay buffers currently held.", pool.buffers_in_use);
+    metric("proxy_connection_objects_allocated_total", "counter", "Connection objects constructed by the event loops.", pool.objects_allocated);
+    metric("proxy_connection_objects_reused_total", "counter", "Connection objects recycled by the event loops.", pool.objects_reused);
+
+    if (cache)
+    {
+        ResponseCache::Stats c = cache->get_stats();
+        out << "# HELP proxy_cache_requests_total Cacheable requests by outcome.\n"
+            << "# TYPE proxy_cache_requests_total counter\n"
+            << "proxy_cache_requests_total{result=\"hit\"} " << c.hits << '\n'
+            << "proxy_cache_requests_total{result=\"miss\"} " << c.misses << '\n';
+        metric("proxy_cache_revalidated_total", "counter", "Cache misses the origin answered with 304.", c.revalidated);
+        metric("proxy_cache_bytes_saved_total", "counter", "Response bytes served from the cache.", c.bytes_saved);
+        metric("proxy_cache_bytes", "gauge", "Bytes held by the response cache.", c.bytes);
+        metric("proxy_cache_entries", "gauge", "Responses held by the response cache.", c.entries);
+    }
+
+    out << "# HELP proxy_timeouts_total Connections closed because a deadline expired.\n"
+        << "# TYPE proxy_timeouts_total counter\n";
+    for (size_t k = 0; k < kTimeoutCount; ++k)
+    {
+        Metrics::Timeout kind = static_cast<Metrics::Timeout>(k);
+        out << "proxy_timeouts_total{kind=\"" << Metrics::timeout_name(kind) << "\"} " << metrics.get_timeouts(kind) << '\n';
+    }
+
+    out << "# HELP proxy_phase_latency_seconds Time spent in each phase of a request.\n"
+        << "# TYPE proxy_phase_latency_seconds summary\n";
+    for (size_t p = 0; p < kPhaseCount; ++p)
+    {
+        Metrics::Phase phase = static_cast<Metrics::Phase>(p);
+        Metrics::LatencySummary l = metrics.get_latency(phase);
+        const char *name = Metrics::phase_name(phase);
+        std::pair<const char *, uint64_t> quantiles[] = {{"0.5", l.p50}, {"0.9", l.p90}, {"0.99", l.p99}, {"0.999", l.p999}};
+        for (const auto &q : quantiles)
+            out << "proxy_phase_latency_seconds{phase=\"" << name << "\",quantile=\"" << q.first << "\"} "
+                << q.second / 1e6 << '\n';
+        out << "proxy_phase_latency_seconds_sum{phase=\"" << name << "\"} " << l.sum_us / 1e6 << '\n'
+            << "proxy_phase_latency_seconds_count{phase=\"" << name << "\"} " << l.count << '\n';
+    }
+    return out.str();
+}
+
+/**
+ * Charges n relayed bytes to a direction and, if one of its buckets has
+ * run ahead, waits until it is back within its burst. Blocking is how
+ * this engine works anyway; the event loops defer the next read instead.
+ */
+static void pace(RateLimiter::Handle &shaper, size_t n)
+{
+    if (!rateLimiter.active())
+        return;
+    auto now = std::chrono::steady_clock::now();
+    rateLimiter.charge(shaper, n, now);
+    auto wait = rateLimiter.delay(shaper, now);
+    if (wait > std::chrono::steady_clock::duration::zero())
+        std::this_thread::sleep_for(wait);
+}
+
+static void forward_loop(SOCKET src, SOCKET dst, RateLimiter::Handle shaper, bool to_client)
 {
-    char buf[8192];
-    auto start_time = std::chrono::steady_clock::now();
-    size_t total_sent = 0;
+    IoBuffer io = IoBuffer::acquire();
+    char *buf = io.data();
     while (true)
     {
-        int r = recv(src, buf, sizeof(buf), 0);
+        int r = recv_relay(src, buf, io.size());
         if (r <= 0)
             break;
         if (!send_all(dst, buf, (size_t)r))
             break;
-
-        if (limit > 0)
-        {
-            total_sent += (size_t)r;
-            auto now = std::chrono::steady_clock::now();
-            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
-            double expected = (total_sent / (double)limit) * 1000.0;
-            if (elapsed < expected)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds((int)(expected - elapsed)));
-            }
-            if (elapsed > 5000)
-            {
-                start_time = std::chrono::steady_clock::now();
-                total_sent = 0;
-            }
-        }
+        metrics.record_relay((uint64_t)r, false, to_client);
+        pace(shaper, (size_t)r);
     }
     shutdown(dst, SD_SEND);
 }
 
-static void run_tunnel(SOCKET client, SOCKET server, size_t limit)
+static void run_tunnel(SOCKET client, SOCKET server, std::string_view client_ip, std::string_view host)
 {
-    std::thread t1(forward_loop, client, server, limit);
-    std::thread t2(forward_loop, server, client, limit);
+    std::thread t1(forward_loop, client, server, rateLimiter.attach(client_ip, host), false);
+    std::thread t2(forward_loop, server, client, rateLimiter.attach(client_ip, host), true);
     if (t1.joinable())
         t1.join();
     if (t2.joinable())
@@ -114,92 +252,358 @@ static void run_tunnel(SOCKET client, SOCKET server, size_t limit)
     graceful_close(client);
 }
 
-static FilterManager filterManager;
-static Logger logger;
-static Metrics metrics;
+static SOCKET connect_upstream(DnsResolver &resolver, const std::string &host, const std::string &port)
+{
+    auto started = std::chrono::steady_clock::now();
+    DnsResolver::Addresses addrs;
+    int rc = resolver.resolve_sync(host, port, addrs);
+    auto resolved = std::chrono::steady_clock::now();
+    metrics.record_latency(Metrics::Phase::Dns, resolved - started);
+    if (rc != 0 || !addrs)
+        return INVALID_SOCKET;
 
-static void log_request(const std::string &client_desc,
-                        const std::string &dest,
-                        const std::string &reqline,
-                        const std::string &action,
-                        int status,
-                        size_t bytes)
+    ConnectPlan plan;
+    plan_connect(addrs.get(), resolver.preferred_family(host, port), plan);
+    int family = AF_UNSPEC;
+    bool timed_out = false;
+    SOCKET serverSock = race_connect(plan, kConnectTimeoutMs, family, timed_out);
+    if (serverSock == INVALID_SOCKET)
+    {
+        if (timed_out)
+            metrics.record_timeout(Metrics::Timeout::Connect);
+        return INVALID_SOCKET;
+    }
+    set_recv_timeout(serverSock, kIdleTimeoutMs);
+    set_nodelay(serverSock);
+    resolver.record_family(host, port, family);
+    metrics.record_latency(Metrics::Phase::Connect, std::chrono::steady_clock::now() - resolved);
+    return serverSock;
+}
+
+/**
+ * Outcome of relaying one response on the thread engine.
+ */
+struct Exchange
 {
+    int status = 0;
+    size_t bytes = 0;             ///< Bytes sent to the client, head included.
+    bool got_response = false;    ///< The origin sent at least one byte.
+    std::chrono::steady_clock::time_point first_byte; ///< When that byte arrived.
+    bool upstream_reusable = false;
+    bool client_keep_alive = false;
+};
 
-    logger.log(client_desc, dest, reqline, action, status, bytes);
+/**
+ * What relay_response() keeps of a response for the response cache.
+ */
+struct CacheCapture
+{
+    ResponseCache::ObjectPtr stale; ///< Being revalidated: a 304 for it is not relayed.
+    size_t limit = 0;               ///< Capturing stops past this many bytes.
+    HttpResponse resp;
+    std::string head;
+    std::string body;
+    bool complete = false;     ///< head and body hold the whole response, and it is storable.
+    bool not_modified = false; ///< The origin confirmed stale; nothing was sent to the client.
+};
+
+/**
+ * The part of a request body that had not arrived with the head. It is
+ * streamed to the origin while the response is awaited, so a client that
+ * sent "Expect: 100-continue" gets the interim response before it has to
+ * send its body.
+ */
+struct Upload
+{
+    BodyFramer body;
+    RateLimiter::Handle shaper;
+    std::string after;    ///< Client bytes past the body: the next pipelined request.
+    bool started = false; ///< Body bytes have been read beyond what came with the head.
+};
 
-    std::ostringstream oss;
-    oss << "[REQ] " << client_desc << " -> " << dest << " \"" << reqline << "\" " << action << " " << status << " bytes=" << bytes;
-    std::cout << oss.str() << std::endl;
-    std::cout.flush();
+/**
+ * Moves one read of the request body from client to server, through the
+ * caller's buffer. A Content-Length body is never read past its end; with
+ * chunked framing anything behind the last chunk is kept in up.after.
+ */
+static bool pump_upload(SOCKET client, SOCKET server, Upload &up, const IoBuffer &io)
+{
+    char *buf = io.data();
+    size_t want = io.size();
+    if (up.body.opaque() && up.body.remaining() < want)
+        want = (size_t)up.body.remaining();
+    int r = recv_relay(client, buf, want);
+    if (r <= 0)
+        return false;
+    up.started = true;
+    size_t n = (size_t)r;
+    if (up.body.opaque())
+        up.body.skip(n);
+    else
+        n = up.body.consume(buf, n);
+    up.after.append(buf + n, (size_t)r - n);
+    if (!send_all(server, buf, n))
+        return false;
+    metrics.record_relay((uint64_t)n, false, false);
+    pace(up.shaper, n);
+    return true;
 }
 
-ProxyServer::ProxyServer(int port)
-    : m_port(port), m_listenSocket(INVALID_SOCKET), m_isRunning(false), m_maxBytesPerSec(0) {}
+/**
+ * Relays exactly one response from server to client, stopping at the end
+ * of its body so that both connections can carry further requests. Until
+ * the response head is complete, the rest of the request body in up is
+ * forwarded as it arrives.
+ * With a capture, a storable response is also copied into it, and a 304
+ * to a revalidation is kept from the client.
+ * @return false if no complete response head arrived; nothing but interim
+ * (1xx) responses has been sent to the client in that case.
+ */
+static bool relay_response(SOCKET server, SOCKET client, const HttpRequest &req, bool keep_alive,
+                           RateLimiter::Handle &shaper, Upload &up, Exchange &ex, CacheCapture *capture)
+{
+    // One pooled buffer carries both the rest of the upload and the response.
+    IoBuffer io = IoBuffer::acquire();
+    char *buf = io.data();
+    std::string head;
+    HttpResponse resp;
+    BodyFramer body;
+    for (;;)
+    {
+        size_t end;
+        while ((end = head.find("\r\n\r\n")) == std::string::npos)
+        {
+            if (head.size() > kMaxHeaderBytes)
+                return false;
+            if (!up.body.done() && !up.body.error())
+            {
+                int ready = wait_readable(server, client, kIdleTimeoutMs);
+                if (ready == 0)
+                    metrics.record_timeout(Metrics::Timeout::Idle);
+                if (ready <= 0)
+                    return false;
+                if (!(ready & 1))
+                {
+                    if (!pump_upload(client, server, up, io))
+                        return false;
+                    continue;
+                }
+            }
+            int r = recv_relay(server, buf, io.size());
+            if (r <= 0)
+                return false;
+            if (!ex.got_response)
+                ex.first_byte = std::chrono::steady_clock::now();
+            ex.got_response = true;
+            head.append(buf, r);
+        }
+        std::string rest = head.substr(end + 4);
+        head.resize(end + 4);
+        resp = HttpResponse();
+        if (!parse_response_head(head, resp))
+            return false;
 
-ProxyServer::~ProxyServer() { stop(); }
+        if (resp.status < 200 && resp.status != 101)
+        {
+            // Interim response (100 Continue, 103 Early Hints): pass it on
+            // and keep waiting for the final one.
+            if (!send_all(client, head.data(), head.size()))
+                return false;
+            ex.bytes += head.size();
+            head = rest;
+            continue;
+        }
 
-void ProxyServer::worker_thread()
-{
-    while (m_isRunning)
+        body = resp.status == 101 ? BodyFramer(BodyFramer::Mode::UntilClose, 0) : response_framer(resp, req.method());
+        bool framed = body.mode() != BodyFramer::Mode::UntilClose;
+        ex.status = resp.status;
+        // An origin that answers before the whole body is in has rejected
+        // it; neither connection is in a known state afterwards.
+        bool uploaded = up.body.done();
+        ex.upstream_reusable = framed && uploaded && response_keep_alive(resp);
+        ex.client_keep_alive = framed && uploaded && keep_alive;
+
+        if (capture && capture->stale && resp.status == 304)
+        {
+            // The caller answers from the refreshed cache entry instead.
+            if (!rest.empty())
+                ex.upstream_reusable = false;
+            capture->resp = resp;
+            capture->head = head;
+            capture->not_modified = true;
+            return true;
+        }
+        if (capture && (!framed || !ResponseCache::storable(req, resp)))
+            capture = nullptr;
+        if (capture)
+        {
+            capture->resp = resp;
+            capture->head = head;
+        }
+
+        std::string out = rewrite_response_head(head, ex.client_keep_alive);
+        size_t n = body.consume(rest.data(), rest.size());
+        if (n < rest.size())
+            ex.upstream_reusable = false; // more than one response: do not trust the stream
+        out.append(rest, 0, n);
+        if (capture)
+            capture->body.assign(rest, 0, n);
+        if (!send_all(client, out.data(), out.size()))
+        {
+            ex.upstream_reusable = ex.client_keep_alive = false;
+            return true;
+        }
+        ex.bytes += out.size();
+        metrics.record_relay((uint64_t)out.size(), false, true);
+        pace(shaper, out.size());
+        break;
+    }
+
+    while (!body.done() && !body.error())
     {
-        SOCKET client;
+        int r = recv_relay(server, buf, io.size());
+        if (r <= 0)
         {
-            std::unique_lock<std::mutex> lock(m_queueMutex);
-            m_condition.wait(lock, [this]
-                             { return !m_jobQueue.empty() || !m_isRunning; });
-            if (!m_isRunning)
-                return;
-            client = m_jobQueue.front();
-            m_jobQueue.pop();
+            // Expected for close-delimited bodies; a truncated framed body
+            // leaves neither side reusable.
+            ex.upstream_reusable = ex.client_keep_alive = false;
+            break;
         }
-        handle_client(client);
+        size_t n = body.consume(buf, (size_t)r);
+        if (n < (size_t)r)
+            ex.upstream_reusable = false;
+        if (capture)
+        {
+            if (capture->head.size() + capture->body.size() + n > capture->limit)
+            {
+                capture->body = std::string();
+                capture = nullptr;
+            }
+            else
+                capture->body.append(buf, n);
+        }
+        if (!send_all(client, buf, n))
+        {
+            ex.upstream_reusable = ex.client_keep_alive = false;
+            break;
+        }
+        ex.bytes += n;
+        metrics.record_relay((uint64_t)n, false, true);
+        pace(shaper, n);
     }
+    if (body.error())
+        ex.upstream_reusable = ex.client_keep_alive = false;
+    if (capture)
+        capture->complete = body.done() && !body.error() &&
+                            capture->head.size() + capture->body.size() <= capture->limit;
+    return true;
 }
 
+static SOCKET open_listener(int port, bool reuse_port)
+{
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+    {
+        std::cerr << "[ERROR] Could not create listening socket: " << socket_error_text() << std::endl;
+        return INVALID_SOCKET;
+    }
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port)
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const char *)&opt, sizeof(opt));
+#else
+    (void)reuse_port;
+#endif
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(s, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(s, SOMAXCONN) == SOCKET_ERROR)
+    {
+        std::cerr << "[ERROR] Could not listen on port " << port << ": " << socket_error_text() << std::endl;
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+ProxyServer::ProxyServer(int port, const ProxyOptions &options)
+    : m_port(port), m_options(options), m_listenSocket(INVALID_SOCKET), m_isRunning(false),
+      m_context(new ProxyContext{filterManager, logger, metrics, rateLimiter, upstreamPool}),
+      m_resolver(new DnsResolver())
+{
+    if (m_options.engine == ProxyOptions::Engine::Threads && m_options.cache_bytes > 0)
+        m_cache.reset(new ResponseCache(m_options.cache_bytes));
+}
+
+ProxyServer::~ProxyServer() { stop(); }
+
 void ProxyServer::stop()
 {
     m_isRunning = false;
-    m_condition.notify_all();
-    for (auto &t : m_workers)
-        if (t.joinable())
-            t.join();
+    m_blocklistWatcher.reset();
+    {
+        // Orders the store above with the predicate check of a waiter.
+        std::lock_guard<std::mutex> lock(m_stateMutex);
+    }
+    m_stopped.notify_all();
+    // Joins the workers; connections still queued are closed unserved.
+    m_workers.reset();
+    for (auto &loop : m_loops)
+        loop->stop();
+    for (SOCKET l : m_shardListeners)
+        closesocket(l);
+    m_shardListeners.clear();
     if (m_listenSocket != INVALID_SOCKET)
     {
         closesocket(m_listenSocket);
         m_listenSocket = INVALID_SOCKET;
     }
-    WSACleanup();
+    net_cleanup();
 }
 
-void ProxyServer::start()
+bool ProxyServer::start()
 {
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
-
-    m_listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    int opt = 1;
-    setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+    net_startup();
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(m_port);
-
-    bind(m_listenSocket, (sockaddr *)&addr, sizeof(addr));
-    listen(m_listenSocket, SOMAXCONN);
+    // In SO_REUSEPORT mode every event loop binds its own listener, and a
+    // plain socket on the same port would make those binds fail.
+    bool sharded = m_options.engine != ProxyOptions::Engine::Threads && m_options.reuse_port;
+    if (!sharded)
+    {
+        m_listenSocket = open_listener(m_port, false);
+        if (m_listenSocket == INVALID_SOCKET)
+            return false;
+    }
 
-    filterManager.load("config/blocked_domains.txt");
-    logger.init("logs/proxy.log");
+    // A snapshot compiled from the current text file is mapped as it is;
+    // otherwise, or once the text changes, the rules are parsed.
+    if (filterManager.load_snapshot(kSnapshotPath, kBlocklistPath))
+    {
+        std::cout << "[INFO] Blocklist mapped from " << kSnapshotPath << ": " << filterManager.get_rule_count()
+                  << " rules" << std::endl;
+        warn_rejected_rules();
+    }
+    else
+        reload_blocklist();
+    m_blocklistWatcher.reset(new FileWatcher(kBlocklistPath, []()
+                                             { reload_blocklist(); }));
+    Logger::Options logOptions;
+    logOptions.flush_ms = m_options.log_flush_ms;
+    logger.init("logs/proxy.log", logOptions);
     metrics.start();
 
     m_isRunning = true;
-    for (int i = 0; i < 20; ++i)
-        m_workers.emplace_back(&ProxyServer::worker_thread, this);
 
     std::thread([this]()
                 {
         SOCKET admin = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int reuse = 1;
+        setsockopt(admin, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
         sockaddr_in a{}; a.sin_family = AF_INET; a.sin_port = htons(8889); a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
         bind(admin, (sockaddr*)&a, sizeof(a));
         listen(admin, 5);
@@ -216,25 +620,109 @@ void ProxyServer::start()
                 std::string body;
                 std::string contentType = "text/plain";
 
-                if (req.find("GET /metrics") != std::string::npos) {
+                if (req.find("GET /metrics/prometheus") != std::string::npos) {
+                    body = prometheus_metrics(m_cache.get());
+                    contentType = "text/plain; version=0.0.4";
+                } else if (req.find("GET /metrics") != std::string::npos) {
                     auto top = metrics.get_top_k(5);
                     std::ostringstream oss;
-                    oss << "{\"rpm\":" << metrics.get_rpm() << ",\"limit\":" << m_maxBytesPerSec.load() << ",\"top\":[";
+                    RateLimiter::Limits lim = rateLimiter.limits();
+                    oss << "{\"rpm\":" << metrics.get_rpm() << ",\"limit\":" << lim.per_connection
+                        << ",\"shaping\":{\"client\":" << lim.per_client << ",\"host\":" << lim.per_host
+                        << ",\"global\":" << lim.global << ",\"deferrals\":" << rateLimiter.get_deferrals() << "}"
+                        << ",\"bytes_zero_copy\":" << metrics.get_zero_copy_bytes()
+                        << ",\"bytes_copied\":" << metrics.get_copied_bytes()
+                        << ",\"upstream_reused\":" << upstreamPool.get_reused()
+                        << ",\"upstream_idle\":" << upstreamPool.get_idle()
+                        << ",\"log_dropped\":" << logger.get_dropped()
+                        << ",\"bytes_in\":" << metrics.get_bytes_in()
+                        << ",\"bytes_out\":" << metrics.get_bytes_out()
+                        << ",\"active_connections\":" << metrics.get_active_connections()
+                        << ",\"latency_us\":{";
+                    for (size_t p = 0; p < kPhaseCount; ++p) {
+                        Metrics::Phase phase = static_cast<Metrics::Phase>(p);
+                        Metrics::LatencySummary l = metrics.get_latency(phase);
+                        oss << (p ? "," : "") << "\"" << Metrics::phase_name(phase) << "\":{\"count\":" << l.count
+                            << ",\"p50\":" << l.p50 << ",\"p90\":" << l.p90 << ",\"p99\":" << l.p99
+                            << ",\"p999\":" << l.p999 << "}";
+                    }
+                    oss << "}";
+                    FilterManager::LoadStats bl = filterManager.get_load_stats();
+                    oss << ",\"blocklist\":{\"rules\":" << bl.rules << ",\"duplicates\":" << bl.duplicates
+                        << ",\"rejected\":" << bl.rejected
+                        << ",\"file_bytes\":" << bl.file_bytes << ",\"memory_bytes\":" << bl.memory_bytes
+                        << ",\"threads\":" << bl.threads << ",\"load_ms\":" << bl.load_us / 1000.0
+                        << ",\"snapshot\":" << (bl.snapshot ? "true" : "false");
+                    FilterManager::FilterStats bf = filterManager.get_filter_stats();
+                    uint64_t negatives = bf.rejected + bf.false_positives;
+                    oss << ",\"filter\":{\"bytes\":" << bf.bytes << ",\"rejected\":" << bf.rejected
+                        << ",\"false_positives\":" << bf.false_positives
+                        << ",\"fp_rate\":" << (negatives ? (double)bf.false_positives / negatives : 0.0)
+                        << ",\"expected_fp_rate\":" << bf.expected_fp_rate << "}}";
+                    DnsResolver::Stats dns = m_resolver->get_stats();
+                    oss << ",\"dns\":{\"hits\":" << dns.hits << ",\"misses\":" << dns.misses
+                        << ",\"negative_hits\":" << dns.negative_hits << ",\"coalesced\":" << dns.coalesced
+                        << ",\"refreshes\":" << dns.refreshes << ",\"entries\":" << dns.entries << "}";
+                    if (m_cache) {
+                        ResponseCache::Stats c = m_cache->get_stats();
+                        uint64_t lookups = c.hits + c.misses;
+                        oss << ",\"cache\":{\"hits\":" << c.hits << ",\"misses\":" << c.misses
+                            << ",\"revalidated\":" << c.revalidated << ",\"collapsed\":" << c.collapsed
+                            << ",\"hit_ratio\":" << (lookups ? (double)c.hits / lookups : 0.0)
+                            << ",\"bytes_saved\":" << c.bytes_saved << ",\"stored\":" << c.stored
+                            << ",\"evicted\":" << c.evicted << ",\"entries\":" << c.entries
+                            << ",\"bytes\":" << c.bytes << "}";
+                    }
+                    PoolStats pool = pool_stats();
+                    oss << ",\"pool\":{\"buffers_allocated\":" << pool.buffers_allocated
+                        << ",\"buffers_reused\":" << pool.buffers_reused << ",\"buffers_in_use\":" << pool.buffers_in_use
+                        << ",\"objects_allocated\":" << pool.objects_allocated
+                        << ",\"objects_reused\":" << pool.objects_reused << "}"
+                        << ",\"timeouts\":{";
+                    for (size_t k = 0; k < kTimeoutCount; ++k) {
+                        Metrics::Timeout kind = static_cast<Metrics::Timeout>(k);
+                        oss << (k ? "," : "") << "\"" << Metrics::timeout_name(kind) << "\":" << metrics.get_timeouts(kind);
+                    }
+                    oss << "},\"top\":[";
                     for(size_t i=0; i<top.size(); ++i) 
                         oss << "[\"" << top[i].first << "\"," << top[i].second << "]" << (i==top.size()-1?"":",");
                     oss << "]}";
                     body = oss.str();
                     contentType = "application/json";
-                } else if (req.find("speed=") != std::string::npos) {
-                    size_t pos = req.find("speed=");
-                    std::string v = req.substr(pos + 6);
-                    size_t space = v.find_first_not_of("0123456789");
-                    if (space != std::string::npos) v = v.substr(0, space);
-                    
-                    if(!v.empty()) { 
-                        m_maxBytesPerSec.store(std::stoul(v)); 
-                        body = "SUCCESS: Speed updated to " + v + " B/s\r\n"; 
+                } else if (req.find("GET /reload") != std::string::npos) {
+                    if (reload_blocklist())
+                        body = "SUCCESS: Blocklist reloaded (" + std::to_string(filterManager.get_rule_count()) + " rules)\r\n";
+                    else
+                        body = "ERROR: Could not read blocklist; current rules kept\r\n";
+                } else if (req.find("speed") != std::string::npos) {
+                    // speed=N shapes each connection on its own; the others
+                    // are shared by every connection of a client, of a
+                    // destination host, or of the whole proxy.
+                    RateLimiter::Limits lim = rateLimiter.limits();
+                    struct { const char *key; size_t *field; const char *name; } settings[] = {
+                        {"speed=", &lim.per_connection, "Speed"},
+                        {"speed_client=", &lim.per_client, "Per-client speed"},
+                        {"speed_host=", &lim.per_host, "Per-host speed"},
+                        {"speed_global=", &lim.global, "Global speed"}};
+                    for (const auto &st : settings) {
+                        size_t pos = req.find(st.key);
+                        if (pos == std::string::npos) continue;
+                        std::string v = req.substr(pos + std::strlen(st.key));
+                        size_t space = v.find_first_not_of("0123456789");
+                        if (space != std::string::npos) v = v.substr(0, space);
+
+                        // The admin thread is detached, so nothing here may throw.
+                        errno = 0;
+                        unsigned long long n = v.empty() ? 0 : std::strtoull(v.c_str(), nullptr, 10);
+                        if (v.empty() || errno == ERANGE || n > kMaxSpeed || n > std::numeric_limits<size_t>::max()) {
+                            body += std::string("ERROR: ") + st.name + " must be a number of B/s up to " +
+                                    std::to_string(kMaxSpeed) + "; not changed\r\n";
+                            continue;
+                        }
+                        *st.field = static_cast<size_t>(n);
+                        body += std::string("SUCCESS: ") + st.name + " updated to " + v + " B/s\r\n";
                     }
+                    rateLimiter.set_limits(lim);
                 }
 
                 if(!body.empty()){
@@ -253,6 +741,19 @@ void ProxyServer::start()
         closesocket(admin); })
         .detach();
 
+#ifdef __linux__
+    if (m_options.engine != ProxyOptions::Engine::Threads)
+        return run_event_loops();
+#endif
+    run_threads();
+    return true;
+}
+
+void ProxyServer::run_threads()
+{
+    m_workers.reset(new ThreadPool(20, m_options.pin_cpus));
+    std::cout << "[INFO] Listening on port " << m_port << std::endl;
+
     while (m_isRunning)
     {
         sockaddr_storage clientAddrStorage{};
@@ -264,194 +765,364 @@ void ProxyServer::start()
             continue;
         }
 
-        {
-            std::lock_guard<std::mutex> lock(m_queueMutex);
-            m_jobQueue.push(client);
-        }
-        m_condition.notify_one();
+        m_workers->enqueue([this, client]()
+                           {
+            if (!m_isRunning)
+            {
+                closesocket(client);
+                return;
+            }
+            handle_client(client); });
     }
 }
 
-void ProxyServer::handle_client(SOCKET clientSocket)
+bool ProxyServer::run_event_loops()
 {
+#ifdef __linux__
+    size_t loops = m_options.event_loops;
+    if (loops == 0)
+        loops = std::max(1u, std::thread::hardware_concurrency());
 
-    std::string client_desc = "unknown";
+    bool uring = m_options.engine == ProxyOptions::Engine::Uring;
+    if (uring)
     {
-        sockaddr_storage peer{};
-        socklen_t plen = sizeof(peer);
-        if (getpeername(clientSocket, reinterpret_cast<sockaddr *>(&peer), &plen) == 0)
+        // Probe once up front so that every loop ends up on the same backend.
+        if (!EventLoop::create_uring(*m_context, *m_resolver, 0))
         {
-            char ipbuf[INET6_ADDRSTRLEN] = {0};
-            uint16_t port = 0;
-            if (peer.ss_family == AF_INET)
-            {
-                sockaddr_in *sa = reinterpret_cast<sockaddr_in *>(&peer);
-                inet_ntop(AF_INET, &sa->sin_addr, ipbuf, sizeof(ipbuf));
-                port = ntohs(sa->sin_port);
-            }
-            else if (peer.ss_family == AF_INET6)
-            {
-                sockaddr_in6 *sa6 = reinterpret_cast<sockaddr_in6 *>(&peer);
-                inet_ntop(AF_INET6, &sa6->sin6_addr, ipbuf, sizeof(ipbuf));
-                port = ntohs(sa6->sin6_port);
-            }
-            if (ipbuf[0] != 0)
-            {
-                std::ostringstream cd;
-                cd << ipbuf << ":" << port;
-                client_desc = cd.str();
-            }
+            std::cerr << "[WARN] io_uring unavailable on this kernel, falling back to epoll" << std::endl;
+            uring = false;
         }
     }
 
-    DWORD timeout = 10000;
-    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
-
-    char buffer[8192];
-    std::string requestData;
-    while (requestData.find("\r\n\r\n") == std::string::npos)
+    // Readiness-based accept needs a non-blocking listener; io_uring parks
+    // the accept in the kernel and is happiest with a blocking one.
+    if (!m_options.reuse_port && !uring)
+        set_nonblocking(m_listenSocket);
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < loops; ++i)
     {
-        int br = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (br <= 0)
+        std::unique_ptr<EventLoop> created = uring ? EventLoop::create_uring(*m_context, *m_resolver, (int)i)
+                                                   : EventLoop::create_epoll(*m_context, *m_resolver, (int)i);
+        if (!created)
         {
-            closesocket(clientSocket);
-            return;
+            std::cerr << "[ERROR] Could not create event loop " << i << std::endl;
+            continue;
         }
-        requestData.append(buffer, br);
-        if (requestData.size() > 65536)
+        m_loops.push_back(std::move(created));
+        EventLoop &loop = *m_loops.back();
+
+        if (m_options.reuse_port)
         {
-            closesocket(clientSocket);
-            return;
+            // The kernel spreads incoming connections across the
+            // SO_REUSEPORT group, so each loop accepts and serves its own
+            // share without any cross-thread hand-off.
+            SOCKET l = open_listener(m_port, true);
+            if (l == INVALID_SOCKET)
+                return false;
+            if (!uring)
+                set_nonblocking(l);
+            m_shardListeners.push_back(l);
+        }
+        SOCKET listener = m_options.reuse_port ? m_shardListeners.back() : m_listenSocket;
+        if (!loop.add_listener(listener))
+        {
+            std::cerr << "[ERROR] Could not register the listener with event loop " << i << ": "
+                      << socket_error_text() << std::endl;
+            return false;
         }
-    }
 
-    std::istringstream rs(requestData);
-    std::string reqLine;
-    std::getline(rs, reqLine);
-    if (!reqLine.empty() && reqLine.back() == '\r')
-        reqLine.pop_back();
-    std::istringstream rl(reqLine);
-    std::string method, target, version;
-    rl >> method >> target >> version;
-
-    std::map<std::string, std::string> headers;
-    std::string line;
-    while (std::getline(rs, line) && line != "\r" && !line.empty())
-    {
-        if (!line.empty() && line.back() == '\r')
-            line.pop_back();
-        size_t pos = line.find(':');
-        if (pos != std::string::npos)
-            headers[to_lower(trim(line.substr(0, pos)))] = trim(line.substr(pos + 1));
+        if (m_options.pin_cpus)
+            loop.pin_to_cpu((int)(i % cpus));
+        loop.start();
     }
+    if (m_loops.empty())
+        return false;
+    std::cout << "[INFO] Listening on port " << m_port << std::endl;
 
-    std::string host, port = (method == "CONNECT" ? "443" : "80");
-    if (method == "CONNECT")
+    std::unique_lock<std::mutex> lock(m_stateMutex);
+    m_stopped.wait(lock, [this]
+                   { return !m_isRunning; });
+#endif
+    return true;
+}
+
+namespace
+{
+/// Keeps the active-connection gauge in step with handle_client().
+struct ConnectionGauge
+{
+    ConnectionGauge() { metrics.connection_opened(); }
+    ~ConnectionGauge() { metrics.connection_closed(); }
+};
+}
+
+/**
+ * Sends the request upstream and relays the response. The head goes out
+ * straight from the client's bytes, together with any body bytes that
+ * arrived with it, in a single gathered write; the rest of the body
+ * follows from relay_response(). extra holds header lines to add, such as
+ * the cache's conditional headers.
+ */
+static bool exchange(SOCKET server, SOCKET client, const HttpRequest &req, std::string_view body,
+                     std::string_view extra, bool keep_alive, RateLimiter::Handle &shaper, Upload &up,
+                     Exchange &ex, CacheCapture *capture)
+{
+    std::string_view pieces[kMaxForwardPieces + 2];
+    size_t n = forward_request_pieces(req, true, pieces);
+    if (!extra.empty())
     {
-        host = (target.find(':') != std::string::npos) ? target.substr(0, target.find(':')) : target;
-        if (target.find(':') != std::string::npos)
-            port = target.substr(target.find(':') + 1);
+        // In front of the closing "Connection: ...\r\n\r\n" piece.
+        pieces[n] = pieces[n - 1];
+        pieces[n - 1] = extra;
+        ++n;
     }
-    else
+    if (!body.empty())
+        pieces[n++] = body;
+    IoSlice slices[kMaxForwardPieces + 2];
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i)
     {
-        auto it = headers.find("host");
-        if (it != headers.end())
-        {
-            host = (it->second.find(':') != std::string::npos) ? it->second.substr(0, it->second.find(':')) : it->second;
-            if (it->second.find(':') != std::string::npos)
-                port = it->second.substr(it->second.find(':') + 1);
-        }
+        slices[i] = make_slice(pieces[i].data(), pieces[i].size());
+        total += pieces[i].size();
     }
+    if (!send_slices(server, slices, n))
+        return false;
+    metrics.record_relay((uint64_t)total, false, false);
+    auto sent = std::chrono::steady_clock::now();
+    bool ok = relay_response(server, client, req, keep_alive, shaper, up, ex, capture);
+    if (ex.got_response)
+        metrics.record_latency(Metrics::Phase::FirstByte, ex.first_byte - sent);
+    return ok;
+}
 
-    if (host.empty())
-    {
-        logger.log(client_desc, "", reqLine, "ERROR", 400, 0);
-        graceful_close(clientSocket);
-        return;
-    }
+/**
+ * Answers a request from the response cache. A client whose own
+ * validators match the stored response gets a 304 without the body.
+ */
+static bool send_cached(SOCKET client, const HttpRequest &req, const ResponseCache::Object &obj, bool keep_alive,
+                        RateLimiter::Handle &shaper, Exchange &ex)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::string head = ResponseCache::not_modified_head(obj, req, now, keep_alive);
+    bool full = head.empty();
+    if (full)
+        head = ResponseCache::response_head(obj, now, keep_alive);
+    IoSlice slices[2] = {make_slice(head.data(), head.size()), make_slice(obj.body.data(), obj.body.size())};
+    ex.status = full ? obj.status : 304;
+    ex.bytes = head.size() + (full ? obj.body.size() : 0);
+    ex.client_keep_alive = keep_alive;
+    if (!send_slices(client, slices, full && !obj.body.empty() ? 2 : 1))
+        return false;
+    metrics.record_relay((uint64_t)ex.bytes, false, true);
+    pace(shaper, ex.bytes);
+    return true;
+}
+
+void ProxyServer::handle_client(SOCKET clientSocket)
+{
+    ConnectionGauge gauge;
+    std::string client_desc = describe_peer(clientSocket);
 
-    metrics.record_request(host);
+    set_recv_timeout(clientSocket, kIdleTimeoutMs);
+    set_nodelay(clientSocket);
+    auto opened = std::chrono::steady_clock::now();
 
-    if (filterManager.is_blocked(host))
+    IoBuffer io = IoBuffer::acquire();
+    char *buffer = io.data();
+    // Bytes the client sent past the current request head: with keep-alive
+    // these are the start of its next (pipelined) request.
+    std::string pending;
+    for (;;)
     {
-        std::string res = "HTTP/1.1 403 Forbidden\r\nContent-Length: 9\r\nConnection: close\r\n\r\nForbidden";
-        send_all(clientSocket, res.data(), res.size());
-        log_request(client_desc, host + ":" + port, reqLine, "BLOCKED", 403, 0);
-        graceful_close(clientSocket);
-        return;
-    }
+        std::string requestData = std::move(pending);
+        pending.clear();
+        auto started = std::chrono::steady_clock::now();
+        if (started - opened >= kMaxLifetime)
+        {
+            metrics.record_timeout(Metrics::Timeout::Lifetime);
+            graceful_close(clientSocket);
+            return;
+        }
+        auto head_deadline = started + std::chrono::milliseconds(kHeaderTimeoutMs);
+        HttpRequest req;
+        RequestParser parser;
+        // Only the head counts against kMaxHeaderBytes: a read that
+        // completes it may carry body bytes or a pipelined request too.
+        RequestParser::Result parsed;
+        while ((parsed = parser.parse(requestData, req)) == RequestParser::Result::Incomplete)
+        {
+            if (requestData.size() > kMaxHeaderBytes)
+            {
+                closesocket(clientSocket);
+                return;
+            }
+            // SO_RCVTIMEO alone would let a client trickle its head in
+            // forever, one byte per interval.
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(head_deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0 || wait_readable(clientSocket, clientSocket, (unsigned)left) == 0)
+            {
+                metrics.record_timeout(Metrics::Timeout::Header);
+                closesocket(clientSocket);
+                return;
+            }
+            int br = recv(clientSocket, buffer, (int)io.size(), 0);
+            if (br <= 0)
+            {
+                closesocket(clientSocket);
+                return;
+            }
+            // Idle keep-alive time before the request is not part of it.
+            if (requestData.empty())
+                started = std::chrono::steady_clock::now();
+            requestData.append(buffer, br);
+        }
+        if (parsed == RequestParser::Result::Complete && parser.head_length() > kMaxHeaderBytes)
+        {
+            closesocket(clientSocket);
+            return;
+        }
+        parser.finish(requestData, req, pending);
+        metrics.record_latency(Metrics::Phase::HeaderRead, std::chrono::steady_clock::now() - started);
 
-    addrinfo hints{}, *res;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
-    {
+        std::string_view reqLine = req.request_line();
+        std::string host(req.host()), port(req.port());
+        const std::string dest = host + ":" + port;
 
-        log_request(client_desc, host + ":" + port, reqLine, "ERROR", 502, 0);
-        graceful_close(clientSocket);
-        return;
-    }
+        switch (route_request(*m_context, req, client_desc))
+        {
+        case RouteAction::BadRequest:
+            graceful_close(clientSocket);
+            return;
+        case RouteAction::Blocked:
+            send_all(clientSocket, kForbiddenResponse, sizeof(kForbiddenResponse) - 1);
+            graceful_close(clientSocket);
+            return;
+        default:
+            break;
+        }
 
-    SOCKET serverSock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    setsockopt(serverSock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
-    if (connect(serverSock, res->ai_addr, (int)res->ai_addrlen) == SOCKET_ERROR)
-    {
-        freeaddrinfo(res);
-        log_request(client_desc, host + ":" + port, reqLine, "ERROR", 502, 0);
-        graceful_close(serverSock);
-        graceful_close(clientSocket);
-        return;
-    }
-    freeaddrinfo(res);
+        std::string_view clientIp = peer_address(client_desc);
+        if (req.method() == "CONNECT")
+        {
+            SOCKET serverSock = connect_upstream(*m_resolver, host, port);
+            if (serverSock == INVALID_SOCKET)
+            {
+                log_request(*m_context, client_desc, dest, reqLine, "ERROR", 502, 0);
+                graceful_close(clientSocket);
+                return;
+            }
 
-    size_t limit = m_maxBytesPerSec.load();
-    if (method == "CONNECT")
-    {
+            log_request(*m_context, client_desc, dest, reqLine, "FORWARD", 200, 0);
 
-        log_request(client_desc, host + ":" + port, reqLine, "FORWARD", 200, 0);
+            send_all(clientSocket, kConnectEstablished, sizeof(kConnectEstablished) - 1);
+            run_tunnel(clientSocket, serverSock, clientIp, host);
+            return;
+        }
 
-        std::string ok = "HTTP/1.1 200 Connection Established\r\n\r\n";
-        send_all(clientSocket, ok.data(), ok.size());
-        run_tunnel(clientSocket, serverSock, limit);
-    }
-    else
-    {
-        std::ostringstream reqOut;
+        // pending starts with whatever part of the body came with the head;
+        // the remainder is streamed by relay_response().
+        RateLimiter::Handle shaper = rateLimiter.attach(clientIp, host);
+        Upload upload;
+        upload.body = request_framer(req);
+        upload.shaper = rateLimiter.attach(clientIp, host);
+        bool keepAlive = request_keep_alive(req) && !upload.body.error();
+        std::string_view body(pending.data(), upload.body.consume(pending.data(), pending.size()));
 
-        reqOut << method << " " << target << " " << version << "\r\n";
-        for (auto const &kv : headers)
+        // Plain GETs are answered from the response cache when it holds a
+        // fresh copy; otherwise the response may refill it.
+        ResponseCache::Lookup cached;
+        CacheCapture capture;
+        std::string conditional;
+        if (m_cache && upload.body.done() && ResponseCache::cacheable_request(req))
         {
-            const std::string &k = kv.first;
-            const std::string &v = kv.second;
-            if (k != "connection" && k != "proxy-connection")
-                reqOut << k << ": " << v << "\r\n";
+            cached = m_cache->lookup(req);
+            if (cached.fresh)
+            {
+                Exchange hit;
+                bool sent = send_cached(clientSocket, req, *cached.object, keepAlive, shaper, hit);
+                metrics.record_latency(Metrics::Phase::Total, std::chrono::steady_clock::now() - started);
+                log_request(*m_context, client_desc, dest, reqLine, "CACHE", hit.status, hit.bytes);
+                if (!sent || !keepAlive)
+                {
+                    graceful_close(clientSocket);
+                    return;
+                }
+                continue;
+            }
+            if (cached.fill && cached.object)
+            {
+                conditional = ResponseCache::revalidation_headers(req, *cached.object);
+                if (!conditional.empty())
+                    capture.stale = cached.object;
+            }
+            capture.limit = m_cache->max_object_size();
         }
-        reqOut << "Connection: close\r\n\r\n";
-        std::string finalReq = reqOut.str();
-        send_all(serverSock, finalReq.data(), finalReq.size());
+        CacheCapture *fill = cached.fill ? &capture : nullptr;
+        auto asked = std::chrono::steady_clock::now();
 
-        size_t total = 0;
-        auto r_start = std::chrono::steady_clock::now();
-        while (true)
+        Exchange ex;
+        bool ok = false;
+        SOCKET serverSock = m_context->upstreams.acquire(dest);
+        if (serverSock != INVALID_SOCKET)
         {
-            int r = recv(serverSock, buffer, sizeof(buffer), 0);
-            if (r <= 0)
-                break;
-            if (!send_all(clientSocket, buffer, (size_t)r))
-                break;
-            total += (size_t)r;
-            if (limit > 0)
+            ok = exchange(serverSock, clientSocket, req, body, conditional, keepAlive, shaper, upload, ex, fill);
+            if (!ok && !ex.got_response && !upload.started)
             {
-                auto now = std::chrono::steady_clock::now();
-                auto elap = std::chrono::duration_cast<std::chrono::milliseconds>(now - r_start).count();
-                double exp = (total / (double)limit) * 1000.0;
-                if (elap < exp)
-                    std::this_thread::sleep_for(std::chrono::milliseconds((int)(exp - elap)));
+                // The origin closed the pooled connection while our request
+                // was in flight; nothing reached the client and the body can
+                // still be sent again, so retry fresh.
+                closesocket(serverSock);
+                serverSock = INVALID_SOCKET;
+                ex = Exchange();
             }
         }
+        if (serverSock == INVALID_SOCKET)
+        {
+            serverSock = connect_upstream(*m_resolver, host, port);
+            if (serverSock != INVALID_SOCKET)
+                ok = exchange(serverSock, clientSocket, req, body, conditional, keepAlive, shaper, upload, ex, fill);
+        }
+
+        if (!ok)
+        {
+            log_request(*m_context, client_desc, dest, reqLine, "ERROR", 502, 0);
+            if (serverSock != INVALID_SOCKET)
+                closesocket(serverSock);
+            graceful_close(clientSocket);
+            return;
+        }
 
-        log_request(client_desc, host + ":" + port, reqLine, "FORWARD", 200, total);
-        graceful_close(serverSock);
-        graceful_close(clientSocket);
+        const char *action = "FORWARD";
+        if (capture.not_modified)
+        {
+            // Only the 304 came back: the client gets the refreshed copy.
+            ResponseCache::ObjectPtr fresh = m_cache->refresh(cached.fill, req, capture.stale, capture.resp,
+                                                              capture.head, asked);
+            bool upstream_reusable = ex.upstream_reusable;
+            if (!send_cached(clientSocket, req, *fresh, ex.client_keep_alive, shaper, ex))
+                ex.client_keep_alive = false;
+            ex.upstream_reusable = upstream_reusable;
+            action = "REVALIDATED";
+        }
+        else if (capture.complete)
+            m_cache->store(cached.fill, req, capture.resp, std::move(capture.head), std::move(capture.body), asked);
+        else if (m_cache && ex.status < 400 && req.method() != "GET" && req.method() != "HEAD" &&
+                 req.method() != "OPTIONS" && req.method() != "TRACE")
+            m_cache->invalidate(req); // RFC 9111 section 4.4
+
+        metrics.record_latency(Metrics::Phase::Total, std::chrono::steady_clock::now() - started);
+        log_request(*m_context, client_desc, dest, reqLine, action, ex.status, ex.bytes);
+        if (ex.upstream_reusable)
+            m_context->upstreams.release(dest, serverSock);
+        else
+            closesocket(serverSock);
+
+        if (!ex.client_keep_alive)
+        {
+            graceful_close(clientSocket);
+            return;
+        }
+        pending.erase(0, body.size());
+        pending += upload.after;
     }
 }
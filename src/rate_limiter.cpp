@@ -0,0 +1,157 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+constexpr size_t kPruneEvery = 1024; ///< Attaches between sweeps of unused shared buckets.
+
+int64_t to_ns(RateLimiter::Clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+const int64_t kBurstNs = std::chrono::duration_cast<std::chrono::nanoseconds>(RateLimiter::kBurst).count();
+
+int64_t cost_ns(size_t bytes, size_t rate)
+{
+    return static_cast<int64_t>(static_cast<double>(bytes) * 1e9 / static_cast<double>(rate));
+}
+
+void charge_tat(std::atomic<int64_t> &tat, int64_t cost, int64_t now)
+{
+    int64_t old = tat.load(std::memory_order_relaxed);
+    while (!tat.compare_exchange_weak(old, std::max(old, now) + cost, std::memory_order_relaxed))
+        ;
+}
+
+int64_t ahead_ns(int64_t tat, int64_t now)
+{
+    return tat - now - kBurstNs;
+}
+}
+
+struct RateLimiter::Impl
+{
+    std::atomic<size_t> global{0};
+    std::atomic<size_t> per_client{0};
+    std::atomic<size_t> per_host{0};
+    std::atomic<size_t> per_connection{0};
+    Bucket global_bucket;
+    std::atomic<uint64_t> deferrals{0};
+
+    using BucketMap = std::unordered_map<std::string, std::weak_ptr<Bucket>>;
+    std::mutex m; ///< Guards the maps; taken only by attach().
+    BucketMap clients;
+    BucketMap hosts;
+    size_t attaches = 0;
+
+    static std::shared_ptr<Bucket> find_or_add(BucketMap &map, std::string key)
+    {
+        std::weak_ptr<Bucket> &slot = map[std::move(key)];
+        std::shared_ptr<Bucket> b = slot.lock();
+        if (!b)
+        {
+            b = std::make_shared<Bucket>();
+            slot = b;
+        }
+        return b;
+    }
+
+    static void prune(BucketMap &map)
+    {
+        for (auto it = map.begin(); it != map.end();)
+            it = it->second.expired() ? map.erase(it) : std::next(it);
+    }
+};
+
+RateLimiter::RateLimiter() : pimpl(new Impl()) {}
+
+RateLimiter::~RateLimiter() { delete pimpl; }
+
+RateLimiter::Handle RateLimiter::attach(std::string_view client, std::string_view host)
+{
+    Handle h;
+    bool by_client = pimpl->per_client.load(std::memory_order_relaxed) > 0;
+    bool by_host = pimpl->per_host.load(std::memory_order_relaxed) > 0;
+    if (!by_client && !by_host)
+        return h;
+
+    std::string host_key(host);
+    std::transform(host_key.begin(), host_key.end(), host_key.begin(), [](unsigned char c)
+                   { return (char)std::tolower(c); });
+    std::lock_guard<std::mutex> lg(pimpl->m);
+    if (by_client)
+        h.m_client = Impl::find_or_add(pimpl->clients, std::string(client));
+    if (by_host)
+        h.m_host = Impl::find_or_add(pimpl->hosts, std::move(host_key));
+    if (++pimpl->attaches % kPruneEvery == 0)
+    {
+        Impl::prune(pimpl->clients);
+        Impl::prune(pimpl->hosts);
+    }
+    return h;
+}
+
+void RateLimiter::charge(Handle &h, size_t n, Clock::time_point now)
+{
+    int64_t t = to_ns(now);
+    if (size_t rate = pimpl->global.load(std::memory_order_relaxed))
+        charge_tat(pimpl->global_bucket.tat, cost_ns(n, rate), t);
+    if (size_t rate = pimpl->per_client.load(std::memory_order_relaxed); rate && h.m_client)
+        charge_tat(h.m_client->tat, cost_ns(n, rate), t);
+    if (size_t rate = pimpl->per_host.load(std::memory_order_relaxed); rate && h.m_host)
+        charge_tat(h.m_host->tat, cost_ns(n, rate), t);
+    if (size_t rate = pimpl->per_connection.load(std::memory_order_relaxed))
+        h.m_own = std::max(h.m_own, t) + cost_ns(n, rate);
+}
+
+RateLimiter::Clock::duration RateLimiter::delay(const Handle &h, Clock::time_point now)
+{
+    int64_t t = to_ns(now);
+    int64_t wait = 0;
+    if (pimpl->global.load(std::memory_order_relaxed))
+        wait = std::max(wait, ahead_ns(pimpl->global_bucket.tat.load(std::memory_order_relaxed), t));
+    if (h.m_client && pimpl->per_client.load(std::memory_order_relaxed))
+        wait = std::max(wait, ahead_ns(h.m_client->tat.load(std::memory_order_relaxed), t));
+    if (h.m_host && pimpl->per_host.load(std::memory_order_relaxed))
+        wait = std::max(wait, ahead_ns(h.m_host->tat.load(std::memory_order_relaxed), t));
+    if (pimpl->per_connection.load(std::memory_order_relaxed))
+        wait = std::max(wait, ahead_ns(h.m_own, t));
+    if (wait == 0)
+        return Clock::duration::zero();
+    pimpl->deferrals.fetch_add(1, std::memory_order_relaxed);
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(wait));
+}
+
+bool RateLimiter::active() const
+{
+    return pimpl->global.load(std::memory_order_relaxed) || pimpl->per_client.load(std::memory_order_relaxed) ||
+           pimpl->per_host.load(std::memory_order_relaxed) || pimpl->per_connection.load(std::memory_order_relaxed);
+}
+
+void RateLimiter::set_limits(const Limits &limits)
+{
+    pimpl->global.store(limits.global, std::memory_order_relaxed);
+    pimpl->per_client.store(limits.per_client, std::memory_order_relaxed);
+    pimpl->per_host.store(limits.per_host, std::memory_order_relaxed);
+    pimpl->per_connection.store(limits.per_connection, std::memory_order_relaxed);
+}
+
+RateLimiter::Limits RateLimiter::limits() const
+{
+    Limits l;
+    l.global = pimpl->global.load(std::memory_order_relaxed);
+    l.per_client = pimpl->per_client.load(std::memory_order_relaxed);
+    l.per_host = pimpl->per_host.load(std::memory_order_relaxed);
+    l.per_connection = pimpl->per_connection.load(std::memory_order_relaxed);
+    return l;
+}
+
+uint64_t RateLimiter::get_deferrals() const
+{
+    return pimpl->deferrals.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,74 @@
+#include "request_handler.h"
+#include <sstream>
+
+#include "filter_manager.h"
+#include "http_request.h"
+#include "logger.h"
+#include "metrics.h"
+
+RouteAction route_request(ProxyContext &ctx, const HttpRequest &req, const std::string &client_desc)
+{
+    if (req.host().empty())
+    {
+        ctx.logger.log(client_desc, "", req.request_line(), "ERROR", 400, 0);
+        return RouteAction::BadRequest;
+    }
+
+    ctx.metrics.record_request(req.host());
+
+    if (ctx.filter.is_blocked(req.host()))
+    {
+        std::string dest(req.host());
+        dest.append(":").append(req.port());
+        log_request(ctx, client_desc, dest, req.request_line(), "BLOCKED", 403, 0);
+        return RouteAction::Blocked;
+    }
+
+    return req.method() == "CONNECT" ? RouteAction::Tunnel : RouteAction::Forward;
+}
+
+void log_request(ProxyContext &ctx,
+                 std::string_view client_desc,
+                 std::string_view dest,
+                 std::string_view reqline,
+                 std::string_view action,
+                 int status,
+                 size_t bytes)
+{
+    ctx.logger.log(client_desc, dest, reqline, action, status, bytes);
+}
+
+std::string describe_peer(SOCKET s)
+{
+    sockaddr_storage peer{};
+    socklen_t plen = sizeof(peer);
+    if (getpeername(s, reinterpret_cast<sockaddr *>(&peer), &plen) != 0)
+        return "unknown";
+
+    char ipbuf[INET6_ADDRSTRLEN] = {0};
+    uint16_t port = 0;
+    if (peer.ss_family == AF_INET)
+    {
+        sockaddr_in *sa = reinterpret_cast<sockaddr_in *>(&peer);
+        inet_ntop(AF_INET, &sa->sin_addr, ipbuf, sizeof(ipbuf));
+        port = ntohs(sa->sin_port);
+    }
+    else if (peer.ss_family == AF_INET6)
+    {
+        sockaddr_in6 *sa6 = reinterpret_cast<sockaddr_in6 *>(&peer);
+        inet_ntop(AF_INET6, &sa6->sin6_addr, ipbuf, sizeof(ipbuf));
+        port = ntohs(sa6->sin6_port);
+    }
+    if (ipbuf[0] == 0)
+        return "unknown";
+
+    std::ostringstream cd;
+    cd << ipbuf << ":" << port;
+    return cd.str();
+}
+
+std::string_view peer_address(std::string_view client_desc)
+{
+    size_t colon = client_desc.rfind(':');
+    return colon == std::string_view::npos ? client_desc : client_desc.substr(0, colon);
+}
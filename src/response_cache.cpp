@@ -0,0 +1,843 @@
+#include "response_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "http_request.h"
+#include "http_response.h"
+
+using Clock = ResponseCache::Clock;
+using Object = ResponseCache::Object;
+using ObjectPtr = ResponseCache::ObjectPtr;
+
+namespace
+{
+constexpr size_t kShards = 16;
+constexpr size_t kNodeOverhead = 128;                  ///< Charged per entry on top of its bytes.
+constexpr std::chrono::seconds kCollapseWait{10};       ///< Longest a miss waits for another request's fill.
+constexpr std::chrono::seconds kPassTime{10};           ///< How long a URL that was not stored skips collapsing.
+constexpr std::chrono::seconds kMaxHeuristic{24 * 3600}; ///< Cap on Last-Modified based freshness.
+constexpr uint8_t kMaxFreq = 3;
+
+// Statuses RFC 9110 section 15.1 calls heuristically cacheable, minus 206:
+// ranges are never stored.
+bool cacheable_status(int status)
+{
+    switch (status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::string lower(std::string_view s)
+{
+    std::string out(s);
+    for (char &ch : out)
+        ch = (char)std::tolower((unsigned char)ch);
+    return out;
+}
+
+std::string_view trim(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+/// Calls f(name, value) for each comma-separated element of a list header.
+template <typename F>
+void for_each_element(std::string_view list, F f)
+{
+    while (!list.empty())
+    {
+        size_t comma = list.find(',');
+        std::string_view item = trim(list.substr(0, comma));
+        if (!item.empty())
+        {
+            size_t eq = item.find('=');
+            std::string_view name = trim(item.substr(0, eq));
+            std::string_view value = eq == std::string_view::npos ? std::string_view() : trim(item.substr(eq + 1));
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                value = value.substr(1, value.size() - 2);
+            f(lower(name), value);
+        }
+        if (comma == std::string_view::npos)
+            break;
+        list.remove_prefix(comma + 1);
+    }
+}
+
+/// The Cache-Control directives the cache acts on.
+struct Directives
+{
+    bool no_store = false;
+    bool no_cache = false;
+    bool is_private = false;
+    bool is_public = false;
+    bool must_revalidate = false;
+    long max_age = -1;
+    long s_maxage = -1;
+    long min_fresh = -1;
+};
+
+long delta_seconds(std::string_view v)
+{
+    if (v.empty() || !std::isdigit((unsigned char)v.front()))
+        return -1;
+    long n = 0;
+    for (char ch : v)
+    {
+        if (!std::isdigit((unsigned char)ch))
+            break;
+        n = n > 100000000L ? n : n * 10 + (ch - '0'); // saturate instead of overflowing
+    }
+    return n;
+}
+
+Directives parse_directives(std::string_view value)
+{
+    Directives d;
+    for_each_element(value, [&d](const std::string &name, std::string_view arg)
+                     {
+        if (name == "no-store")
+            d.no_store = true;
+        else if (name == "no-cache")
+            d.no_cache = true; // with a field list it still means "revalidate"
+        else if (name == "private")
+            d.is_private = true;
+        else if (name == "public")
+            d.is_public = true;
+        else if (name == "must-revalidate" || name == "proxy-revalidate")
+            d.must_revalidate = true;
+        else if (name == "max-age")
+            d.max_age = delta_seconds(arg);
+        else if (name == "s-maxage")
+            d.s_maxage = delta_seconds(arg);
+        else if (name == "min-fresh")
+            d.min_fresh = delta_seconds(arg); });
+    return d;
+}
+
+std::string_view header_of(const HttpResponse &resp, const char *name)
+{
+    auto it = resp.headers.find(name);
+    return it == resp.headers.end() ? std::string_view() : std::string_view(it->second);
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date.
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+/**
+ * Parses an HTTP-date in any of the three formats RFC 9110 section 5.6.7
+ * requires recipients to accept: IMF-fixdate, RFC 850 and asctime.
+ * @return false if value is not a date, which callers treat as the past.
+ */
+bool parse_http_date(std::string_view value, int64_t &out)
+{
+    static const char *const kMonths[] = {"jan", "feb", "mar", "apr", "may", "jun",
+                                          "jul", "aug", "sep", "oct", "nov", "dec"};
+    int numbers[2] = {-1, -1};
+    size_t nnumbers = 0;
+    int month = -1, hh = -1, mm = -1, ss = -1;
+    while (!value.empty())
+    {
+        size_t end = value.find_first_of(" ,-");
+        std::string_view tok = value.substr(0, end);
+        value.remove_prefix(end == std::string_view::npos ? value.size() : end + 1);
+        if (tok.empty())
+            continue;
+        if (tok.find(':') != std::string_view::npos)
+        {
+            if (tok.size() != 8 || tok[2] != ':' || tok[5] != ':')
+                return false;
+            hh = (int)delta_seconds(tok.substr(0, 2));
+            mm = (int)delta_seconds(tok.substr(3, 2));
+            ss = (int)delta_seconds(tok.substr(6, 2));
+        }
+        else if (std::isdigit((unsigned char)tok.front()))
+        {
+            if (nnumbers == 2)
+                return false;
+            numbers[nnumbers++] = (int)delta_seconds(tok);
+        }
+        else if (tok.size() == 3 && month < 0)
+        {
+            std::string m = lower(tok);
+            for (int i = 0; i < 12; ++i)
+                if (m == kMonths[i])
+                    month = i + 1;
+        }
+    }
+    // Every format has the day of the month before the year.
+    int day = numbers[0], year = numbers[1];
+    if (nnumbers != 2 || month < 0 || hh < 0 || mm < 0 || ss < 0 || day < 1 || day > 31 || hh > 23 || mm > 59 ||
+        ss > 60)
+        return false;
+    if (year < 100)
+        year += year < 70 ? 2000 : 1900; // RFC 850 two-digit years
+    out = days_from_civil(year, (unsigned)month, (unsigned)day) * 86400 + hh * 3600 + mm * 60 + ss;
+    return true;
+}
+
+/// Calls f(lower-cased name, whole line with CRLF) for each field line of a raw head.
+template <typename F>
+void for_each_field(const std::string &head, F f)
+{
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos)
+    {
+        pos += 2;
+        size_t eol = head.find("\r\n", pos);
+        if (eol == std::string::npos || eol == pos)
+            break;
+        std::string_view line(head.data() + pos, eol + 2 - pos);
+        size_t colon = line.find(':');
+        if (colon != std::string_view::npos)
+            f(lower(trim(line.substr(0, colon))), line);
+        pos = eol;
+    }
+}
+
+std::string status_line_of(const std::string &head)
+{
+    return head.substr(0, head.find("\r\n") + 2);
+}
+
+// RFC 9110 section 8.8.3.2, weak comparison.
+bool etag_matches(std::string_view list, std::string_view etag)
+{
+    auto strip = [](std::string_view t)
+    { return t.substr(0, 2) == "W/" ? t.substr(2) : t; };
+    bool match = false;
+    std::string_view rest = list;
+    while (!rest.empty() && !match)
+    {
+        size_t comma = rest.find(',');
+        std::string_view tag = trim(rest.substr(0, comma));
+        match = tag == "*" || (!tag.empty() && strip(tag) == strip(etag));
+        rest.remove_prefix(comma == std::string_view::npos ? rest.size() : comma + 1);
+    }
+    return match;
+}
+
+ObjectPtr make_object(const HttpResponse &resp, std::string head, std::string body, Clock::time_point request_time,
+                      Clock::time_point response_time)
+{
+    auto obj = std::make_shared<Object>();
+    obj->head = std::move(head);
+    obj->body = std::move(body);
+    obj->status = resp.status;
+    obj->etag = std::string(header_of(resp, "etag"));
+    obj->last_modified = std::string(header_of(resp, "last-modified"));
+    for_each_element(header_of(resp, "vary"), [&obj](const std::string &name, std::string_view)
+                     { obj->vary.push_back(name); });
+    obj->response_time = response_time;
+
+    // RFC 9111 section 4.2.3.
+    int64_t now = (int64_t)std::time(nullptr);
+    int64_t date = now;
+    if (!parse_http_date(header_of(resp, "date"), date))
+        date = now;
+    int64_t apparent = now > date ? now - date : 0;
+    long age_value = delta_seconds(header_of(resp, "age"));
+    auto delay = std::chrono::ceil<std::chrono::seconds>(response_time - request_time).count();
+    int64_t corrected = (age_value < 0 ? 0 : age_value) + delay;
+    obj->initial_age = std::chrono::seconds(apparent > corrected ? apparent : corrected);
+
+    // RFC 9111 section 4.2.1; a shared cache prefers s-maxage.
+    Directives cc = parse_directives(header_of(resp, "cache-control"));
+    int64_t lifetime = 0;
+    int64_t when = 0;
+    if (cc.s_maxage >= 0)
+        lifetime = cc.s_maxage;
+    else if (cc.max_age >= 0)
+        lifetime = cc.max_age;
+    else if (resp.headers.count("expires"))
+        lifetime = parse_http_date(header_of(resp, "expires"), when) && when > date ? when - date : 0;
+    else if (parse_http_date(obj->last_modified, when) && when < date)
+        lifetime = std::min<int64_t>((date - when) / 10, kMaxHeuristic.count());
+    if (cc.no_cache)
+        lifetime = 0;
+    obj->lifetime = std::chrono::seconds(lifetime);
+    return obj;
+}
+
+/// primary + the values of the request headers named by vary.
+std::string variant_key(const std::string &primary, const std::vector<std::string> &vary, const HttpRequest &req)
+{
+    std::string key = primary;
+    for (const std::string &name : vary)
+    {
+        key += '\0';
+        key += trim(req.header(name));
+    }
+    return key;
+}
+
+struct Node
+{
+    std::string key;
+    std::string primary;
+    ObjectPtr object;
+    size_t size = 0;
+    std::atomic<uint8_t> freq{0}; ///< Reads since insertion or the last pass over it, capped.
+    bool main = false;            ///< In the main FIFO rather than the small one.
+};
+
+struct Variants
+{
+    std::vector<std::string> vary; ///< From the most recently stored response.
+    std::vector<std::string> keys;
+};
+
+struct Shard
+{
+    std::shared_mutex m;
+    size_t capacity = 0;
+    std::list<Node> small, main; ///< Newest at the front.
+    size_t small_bytes = 0, main_bytes = 0;
+    std::unordered_map<std::string, std::list<Node>::iterator> index;
+    std::unordered_map<std::string, Variants> variants; ///< By primary key.
+    std::deque<size_t> ghost;                           ///< Hashes of keys recently evicted from small.
+    std::unordered_multiset<size_t> ghost_set;
+
+    // Fills in flight, and the URLs that skip collapsing. Taken before m
+    // when both are needed.
+    std::mutex fill_m;
+    std::condition_variable filled;
+    std::unordered_set<std::string> filling;
+    std::unordered_map<std::string, Clock::time_point> passing;
+};
+}
+
+std::chrono::seconds ResponseCache::Object::age(Clock::time_point now) const
+{
+    return initial_age + std::chrono::duration_cast<std::chrono::seconds>(now - response_time);
+}
+
+struct ResponseCache::Impl
+{
+    size_t max_object = 0;
+    Shard shards[kShards];
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> revalidated{0};
+    std::atomic<uint64_t> collapsed{0};
+    std::atomic<uint64_t> stored{0};
+    std::atomic<uint64_t> evicted{0};
+    std::atomic<uint64_t> bytes_saved{0};
+
+    static std::string primary_key(const HttpRequest &req)
+    {
+        std::string key(req.host());
+        key += ':';
+        key += req.port();
+        key += ' ';
+        key += req.target();
+        return key;
+    }
+
+    size_t shard_index(const std::string &primary) const
+    {
+        return std::hash<std::string>()(primary) % kShards;
+    }
+
+    // Finds the variant of primary that req selects. Caller holds s.m.
+    ObjectPtr find(Shard &s, const std::string &primary, const HttpRequest &req, std::string &key)
+    {
+        auto v = s.variants.find(primary);
+        key = v == s.variants.end() ? primary : variant_key(primary, v->second.vary, req);
+        auto it = s.index.find(key);
+        if (it == s.index.end())
+            return nullptr;
+        Node &n = *it->second;
+        if (n.freq.load(std::memory_order_relaxed) < kMaxFreq)
+            n.freq.fetch_add(1, std::memory_order_relaxed);
+        return n.object;
+    }
+
+    // RFC 9111 section 4.2, with the request's own freshness demands.
+    static bool usable(const Object &obj, const HttpRequest &req, Clock::time_point now)
+    {
+        std::string_view rcc = req.header("cache-control");
+        if (rcc.empty() && header_has_token(req.header("pragma"), "no-cache"))
+            return false;
+        Directives d = parse_directives(rcc);
+        if (d.no_cache)
+            return false;
+        auto age = obj.age(now);
+        if (d.max_age >= 0 && age.count() > d.max_age)
+            return false;
+        auto left = obj.lifetime - age;
+        return left.count() > (d.min_fresh > 0 ? d.min_fresh : 0);
+    }
+
+    // Caller holds s.m exclusively.
+    void remove(Shard &s, std::list<Node>::iterator it)
+    {
+        auto v = s.variants.find(it->primary);
+        if (v != s.variants.end())
+        {
+            auto &keys = v->second.keys;
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                if (keys[i] == it->key)
+                {
+                    keys[i] = std::move(keys.back());
+                    keys.pop_back();
+                    break;
+                }
+            }
+            if (keys.empty())
+                s.variants.erase(v);
+        }
+        s.index.erase(it->key);
+        if (it->main)
+        {
+            s.main_bytes -= it->size;
+            s.main.erase(it);
+        }
+        else
+        {
+            s.small_bytes -= it->size;
+            s.small.erase(it);
+        }
+    }
+
+    void remember_ghost(Shard &s, size_t hash)
+    {
+        s.ghost.push_back(hash);
+        s.ghost_set.insert(hash);
+        // About as many ghosts as live entries, like the paper's main-sized ghost queue.
+        size_t limit = s.index.size() > 64 ? s.index.size() : 64;
+        while (s.ghost.size() > limit)
+        {
+            s.ghost_set.erase(s.ghost_set.find(s.ghost.front()));
+            s.ghost.pop_front();
+        }
+    }
+
+    // One S3-FIFO eviction step. Caller holds s.m exclusively.
+    void evict_one(Shard &s)
+    {
+        if (!s.small.empty() && (s.small_bytes > s.capacity / 10 || s.main.empty()))
+        {
+            auto it = std::prev(s.small.end());
+            if (it->freq.load(std::memory_order_relaxed) > 0)
+            {
+                // Read again while in small: promote it.
+                it->freq.store(0, std::memory_order_relaxed);
+                it->main = true;
+                s.small_bytes -= it->size;
+                s.main_bytes += it->size;
+                s.main.splice(s.main.begin(), s.small, it);
+                return;
+            }
+            remember_ghost(s, std::hash<std::string>()(it->key));
+            remove(s, it);
+        }
+        else
+        {
+            auto it = std::prev(s.main.end());
+            uint8_t f = it->freq.load(std::memory_order_relaxed);
+            if (f > 0)
+            {
+                it->freq.store(f - 1, std::memory_order_relaxed);
+                s.main.splice(s.main.begin(), s.main, it);
+                return;
+            }
+            remove(s, it);
+        }
+        evicted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void insert(Shard &s, const std::string &primary, const HttpRequest &req, const ObjectPtr &obj)
+    {
+        std::unique_lock<std::shared_mutex> lock(s.m);
+        Variants &v = s.variants[primary];
+        if (v.vary != obj->vary)
+        {
+            // The origin changed what it varies on; the old variants are unreachable.
+            std::vector<std::string> old = v.keys;
+            for (const std::string &k : old)
+            {
+                auto it = s.index.find(k);
+                if (it != s.index.end())
+                    remove(s, it->second);
+            }
+            Variants &fresh = s.variants[primary];
+            fresh.vary = obj->vary;
+        }
+        std::string key = variant_key(primary, obj->vary, req);
+        size_t size = obj->size() + key.size() + primary.size() + kNodeOverhead;
+
+        auto found = s.index.find(key);
+        if (found != s.index.end())
+        {
+            Node &n = *found->second;
+            (n.main ? s.main_bytes : s.small_bytes) += size - n.size;
+            n.size = size;
+            n.object = obj;
+        }
+        else
+        {
+            size_t hash = std::hash<std::string>()(key);
+            auto ghost = s.ghost_set.find(hash);
+            bool main = ghost != s.ghost_set.end();
+            if (main)
+                s.ghost_set.erase(ghost); // its entry in the deque ages out harmlessly
+            std::list<Node> &queue = main ? s.main : s.small;
+            queue.emplace_front();
+            Node &n = queue.front();
+            n.key = key;
+            n.primary = primary;
+            n.object = obj;
+            n.size = size;
+            n.main = main;
+            (main ? s.main_bytes : s.small_bytes) += size;
+            s.index[key] = queue.begin();
+            s.variants[primary].keys.push_back(key);
+        }
+        while (s.small_bytes + s.main_bytes > s.capacity && !s.index.empty())
+            evict_one(s);
+    }
+};
+
+ResponseCache::Fill::Fill(Fill &&other) noexcept
+    : m_cache(other.m_cache), m_shard(other.m_shard), m_key(std::move(other.m_key))
+{
+    other.m_cache = nullptr;
+}
+
+ResponseCache::Fill &ResponseCache::Fill::operator=(Fill &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (m_cache)
+            m_cache->release(*this, false);
+        m_cache = other.m_cache;
+        m_shard = other.m_shard;
+        m_key = std::move(other.m_key);
+        other.m_cache = nullptr;
+    }
+    return *this;
+}
+
+ResponseCache::Fill::~Fill()
+{
+    if (m_cache)
+        m_cache->release(*this, false);
+}
+
+ResponseCache::ResponseCache(size_t capacity) : pimpl(new Impl())
+{
+    for (Shard &s : pimpl->shards)
+        s.capacity = capacity / kShards;
+    pimpl->max_object = capacity / kShards / 4;
+}
+
+ResponseCache::~ResponseCache()
+{
+    delete pimpl;
+}
+
+bool ResponseCache::cacheable_request(const HttpRequest &req)
+{
+    if (req.method() != "GET" || req.has_header("range") || req.has_header("if-match") ||
+        req.has_header("if-unmodified-since") || req.has_header("transfer-encoding"))
+        return false;
+    std::string_view length = req.header("content-length");
+    if (!length.empty() && trim(length) != "0")
+        return false;
+    return !parse_directives(req.header("cache-control")).no_store;
+}
+
+bool ResponseCache::storable(const HttpRequest &req, const HttpResponse &resp)
+{
+    if (!cacheable_status(resp.status) || resp.headers.count("set-cookie"))
+        return false;
+    Directives cc = parse_directives(header_of(resp, "cache-control"));
+    if (cc.no_store || cc.is_private)
+        return false;
+    bool star = false;
+    for_each_element(header_of(resp, "vary"), [&star](const std::string &name, std::string_view)
+                     { star = star || name == "*"; });
+    if (star)
+        return false;
+    // RFC 9111 section 3.5.
+    if (req.has_header("authorization") && !cc.is_public && !cc.must_revalidate && cc.s_maxage < 0)
+        return false;
+    return cc.max_age >= 0 || cc.s_maxage >= 0 || resp.headers.count("expires") || resp.headers.count("etag") ||
+           resp.headers.count("last-modified");
+}
+
+size_t ResponseCache::max_object_size() const
+{
+    return pimpl->max_object;
+}
+
+ResponseCache::Lookup ResponseCache::lookup(const HttpRequest &req)
+{
+    Lookup out;
+    std::string primary = Impl::primary_key(req);
+    size_t index = pimpl->shard_index(primary);
+    Shard &s = pimpl->shards[index];
+    auto deadline = Clock::now() + kCollapseWait;
+    bool waited = false;
+
+    auto hit = [&](ObjectPtr obj)
+    {
+        pimpl->hits.fetch_add(1, std::memory_order_relaxed);
+        pimpl->bytes_saved.fetch_add(obj->size(), std::memory_order_relaxed);
+        if (waited)
+            pimpl->collapsed.fetch_add(1, std::memory_order_relaxed);
+        out.object = std::move(obj);
+        out.fresh = true;
+    };
+
+    for (;;)
+    {
+        std::string key;
+        ObjectPtr obj;
+        {
+            std::shared_lock<std::shared_mutex> lock(s.m);
+            obj = pimpl->find(s, primary, req, key);
+        }
+        auto now = Clock::now();
+        if (obj && Impl::usable(*obj, req, now))
+        {
+            hit(std::move(obj));
+            return out;
+        }
+
+        std::unique_lock<std::mutex> lock(s.fill_m);
+        auto pass = s.passing.find(key);
+        if (pass != s.passing.end())
+        {
+            if (pass->second > now)
+                break;
+            s.passing.erase(pass);
+        }
+        if (!s.filling.count(key))
+        {
+            // A fill may have finished since the lookup above.
+            {
+                std::shared_lock<std::shared_mutex> shared(s.m);
+                obj = pimpl->find(s, primary, req, key);
+            }
+            if (obj && Impl::usable(*obj, req, now))
+            {
+                hit(std::move(obj));
+                return out;
+            }
+            s.filling.insert(key);
+            out.object = std::move(obj);
+            out.fill.m_cache = this;
+            out.fill.m_shard = index;
+            out.fill.m_key = key;
+            break;
+        }
+        if (now >= deadline)
+            break;
+        waited = true;
+        s.filled.wait_until(lock, deadline);
+    }
+    pimpl->misses.fetch_add(1, std::memory_order_relaxed);
+    return out;
+}
+
+void ResponseCache::store(Fill &fill, const HttpRequest &req, const HttpResponse &resp, std::string head,
+                          std::string body, Clock::time_point request_time)
+{
+    if (!fill)
+        return;
+    if (!storable(req, resp) || head.size() + body.size() > pimpl->max_object)
+    {
+        pass(fill);
+        return;
+    }
+    ObjectPtr obj = make_object(resp, std::move(head), std::move(body), request_time, Clock::now());
+    std::string primary = Impl::primary_key(req);
+    pimpl->insert(pimpl->shards[pimpl->shard_index(primary)], primary, req, obj);
+    pimpl->stored.fetch_add(1, std::memory_order_relaxed);
+    release(fill, true);
+}
+
+ResponseCache::ObjectPtr ResponseCache::refresh(Fill &fill, const HttpRequest &req, const ObjectPtr &stale,
+                                                const HttpResponse &resp, const std::string &head,
+                                                Clock::time_point request_time)
+{
+    // Header fields of the 304 replace the stored ones of the same name,
+    // except those describing the body it does not have.
+    std::unordered_set<std::string> updated;
+    std::string added;
+    for_each_field(head, [&](const std::string &name, std::string_view line)
+                   {
+        if (name == "content-length" || name == "transfer-encoding" || name == "content-encoding" ||
+            name == "content-range" || name == "connection" || name == "keep-alive" || name == "proxy-connection")
+            return;
+        updated.insert(name);
+        added += line; });
+    std::string merged = status_line_of(stale->head);
+    for_each_field(stale->head, [&](const std::string &name, std::string_view line)
+                   {
+        if (!updated.count(name))
+            merged += line; });
+    merged += added;
+    merged += "\r\n";
+
+    HttpResponse parsed;
+    if (!parse_response_head(merged, parsed))
+        parsed = resp;
+    ObjectPtr obj = make_object(parsed, std::move(merged), stale->body, request_time, Clock::now());
+    pimpl->revalidated.fetch_add(1, std::memory_order_relaxed);
+    pimpl->bytes_saved.fetch_add(stale->body.size(), std::memory_order_relaxed);
+    if (fill)
+    {
+        std::string primary = Impl::primary_key(req);
+        pimpl->insert(pimpl->shards[pimpl->shard_index(primary)], primary, req, obj);
+        release(fill, true);
+    }
+    return obj;
+}
+
+void ResponseCache::pass(Fill &fill)
+{
+    if (fill)
+        release(fill, false);
+}
+
+void ResponseCache::release(Fill &fill, bool stored)
+{
+    Shard &s = pimpl->shards[fill.m_shard];
+    {
+        std::lock_guard<std::mutex> lock(s.fill_m);
+        s.filling.erase(fill.m_key);
+        if (!stored)
+        {
+            auto now = Clock::now();
+            if (s.passing.size() >= 1024)
+            {
+                for (auto it = s.passing.begin(); it != s.passing.end();)
+                    it = it->second <= now ? s.passing.erase(it) : std::next(it);
+            }
+            s.passing[fill.m_key] = now + kPassTime;
+        }
+    }
+    s.filled.notify_all();
+    fill.m_cache = nullptr;
+    fill.m_key.clear();
+}
+
+void ResponseCache::invalidate(const HttpRequest &req)
+{
+    std::string primary = Impl::primary_key(req);
+    Shard &s = pimpl->shards[pimpl->shard_index(primary)];
+    std::unique_lock<std::shared_mutex> lock(s.m);
+    auto v = s.variants.find(primary);
+    if (v == s.variants.end())
+        return;
+    std::vector<std::string> keys = v->second.keys;
+    for (const std::string &k : keys)
+    {
+        auto it = s.index.find(k);
+        if (it != s.index.end())
+            pimpl->remove(s, it->second);
+    }
+    s.variants.erase(primary);
+}
+
+std::string ResponseCache::revalidation_headers(const HttpRequest &req, const Object &stale)
+{
+    if (req.has_header("if-none-match") || req.has_header("if-modified-since"))
+        return std::string();
+    std::string out;
+    if (!stale.etag.empty())
+        out += "If-None-Match: " + stale.etag + "\r\n";
+    if (!stale.last_modified.empty())
+        out += "If-Modified-Since: " + stale.last_modified + "\r\n";
+    return out;
+}
+
+std::string ResponseCache::response_head(const Object &obj, Clock::time_point now, bool keep_alive)
+{
+    std::string head = status_line_of(obj.head);
+    for_each_field(obj.head, [&head](const std::string &name, std::string_view line)
+                   {
+        if (name != "age")
+            head += line; });
+    head += "Age: " + std::to_string(obj.age(now).count()) + "\r\n\r\n";
+    return rewrite_response_head(head, keep_alive);
+}
+
+std::string ResponseCache::not_modified_head(const Object &obj, const HttpRequest &req, Clock::time_point now,
+                                             bool keep_alive)
+{
+    if (obj.status != 200)
+        return std::string();
+    // RFC 9110 section 13.2.2: If-None-Match takes precedence.
+    bool match = false;
+    if (req.has_header("if-none-match"))
+        match = !obj.etag.empty() && etag_matches(req.header("if-none-match"), obj.etag);
+    else if (req.has_header("if-modified-since"))
+    {
+        int64_t since = 0, modified = 0;
+        match = parse_http_date(req.header("if-modified-since"), since) &&
+                parse_http_date(obj.last_modified, modified) && modified <= since;
+    }
+    if (!match)
+        return std::string();
+
+    std::string head = "HTTP/1.1 304 Not Modified\r\n";
+    for_each_field(obj.head, [&head](const std::string &name, std::string_view line)
+                   {
+        if (name == "cache-control" || name == "content-location" || name == "date" || name == "etag" ||
+            name == "expires" || name == "last-modified" || name == "vary")
+            head += line; });
+    head += "Age: " + std::to_string(obj.age(now).count()) + "\r\n\r\n";
+    return rewrite_response_head(head, keep_alive);
+}
+
+ResponseCache::Stats ResponseCache::get_stats() const
+{
+    Stats st;
+    st.hits = pimpl->hits.load(std::memory_order_relaxed);
+    st.misses = pimpl->misses.load(std::memory_order_relaxed);
+    st.revalidated = pimpl->revalidated.load(std::memory_order_relaxed);
+    st.collapsed = pimpl->collapsed.load(std::memory_order_relaxed);
+    st.stored = pimpl->stored.load(std::memory_order_relaxed);
+    st.evicted = pimpl->evicted.load(std::memory_order_relaxed);
+    st.bytes_saved = pimpl->bytes_saved.load(std::memory_order_relaxed);
+    for (Shard &s : pimpl->shards)
+    {
+        std::shared_lock<std::shared_mutex> lock(s.m);
+        st.entries += s.index.size();
+        st.bytes += s.small_bytes + s.main_bytes;
+    }
+    return st;
+}
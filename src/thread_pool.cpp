@@ -1,35 +1,451 @@
 #include "thread_pool.h"
 
-ThreadPool::ThreadPool(size_t threads) : stop(false) {
-    for(size_t i = 0; i < threads; ++i)
-        workers.emplace_back([this] {
-            for(;;) {
-                std::function<void()> task;
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+constexpr size_t kCacheLine = 64;
+constexpr size_t kDequeCapacity = 256;       ///< Initial slots per worker deque; it grows as needed.
+constexpr size_t kInjectCapacity = 1 << 14;  ///< Beyond this, external tasks spill into a locked list.
+constexpr size_t kNodeCache = 1024;          ///< Spare task nodes each worker keeps.
+constexpr int kSpinRounds = 64;              ///< Empty scans before a worker goes to sleep.
+
+struct Node
+{
+    Task task;
+    Node *next = nullptr;
+};
+
+/**
+ * Chase-Lev work-stealing deque (the weak-memory-model version by Lê et
+ * al.). The owner pushes and pops at the bottom; thieves take from the
+ * top. Arrays replaced by a grow are kept until the deque dies, because a
+ * thief may still be reading one.
+ */
+class WorkDeque
+{
+public:
+    WorkDeque()
+    {
+        m_arrays.emplace_back(new Array(kDequeCapacity));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(Node *n)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array *a = m_array.load(std::memory_order_relaxed);
+        if (b - t > (int64_t)a->mask)
+            a = grow(a, t, b);
+        a->put(b, n);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    Node *pop()
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if (t > b)
+        {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Node *n = a->get(b);
+        if (t == b)
+        {
+            // Last task: race the thieves for it.
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                n = nullptr;
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    Node *steal()
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        Node *n = m_array.load(std::memory_order_acquire)->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return n;
+    }
+
+    bool empty() const
+    {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array
+    {
+        explicit Array(size_t capacity) : mask(capacity - 1), slots(new std::atomic<Node *>[capacity]) {}
+        Node *get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, Node *n) { slots[i & mask].store(n, std::memory_order_relaxed); }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<Node *>[]> slots;
+    };
+
+    Array *grow(Array *a, int64_t t, int64_t b)
+    {
+        m_arrays.emplace_back(new Array((a->mask + 1) * 2));
+        Array *bigger = m_arrays.back().get();
+        for (int64_t i = t; i < b; ++i)
+            bigger->put(i, a->get(i));
+        m_array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(kCacheLine) std::atomic<int64_t> m_top{0};
+    alignas(kCacheLine) std::atomic<int64_t> m_bottom{0};
+    std::atomic<Array *> m_array{nullptr};
+    std::vector<std::unique_ptr<Array>> m_arrays; ///< Owner only.
+};
+
+/**
+ * Bounded multi-producer, multi-consumer queue (Vyukov): each cell carries
+ * a sequence number telling producers and consumers whose turn it is, so
+ * both sides claim a cell with one compare-and-swap.
+ */
+class InjectQueue
+{
+public:
+    InjectQueue() : m_cells(new Cell[kInjectCapacity])
+    {
+        for (size_t i = 0; i < kInjectCapacity; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(Node *n)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = m_cells[pos & (kInjectCapacity - 1)];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
                 {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this]{ return this->stop || !this->tasks.empty(); });
-                    if(this->stop && this->tasks.empty()) return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
+                    cell.node = n;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
                 }
-                task();
             }
-        });
+            else if (diff < 0)
+                return false; // full
+            else
+                pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    Node *pop()
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = m_cells[pos & (kInjectCapacity - 1)];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    Node *n = cell.node;
+                    cell.seq.store(pos + kInjectCapacity, std::memory_order_release);
+                    return n;
+                }
+            }
+            else if (diff < 0)
+                return nullptr; // empty
+            else
+                pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_relaxed) >= m_tail.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        Node *node = nullptr;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(kCacheLine) std::atomic<size_t> m_head{0};
+    alignas(kCacheLine) std::atomic<size_t> m_tail{0};
+};
+
+void pin_current_thread(unsigned cpu)
+{
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (cpu % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
+struct ThreadPool::Impl
+{
+    struct alignas(kCacheLine) Worker
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push(std::move(task));
+        WorkDeque deque;
+        Node *spare = nullptr; ///< Recycled nodes, used by this worker only.
+        size_t spare_count = 0;
+        uint64_t seed = 0;     ///< Picks steal victims.
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    InjectQueue inject;
+
+    // Only used once the injection queue is full.
+    std::mutex overflow_mutex;
+    std::deque<Node *> overflow;
+    std::atomic<size_t> overflow_size{0};
+
+    // Parking. sleepers is read on every enqueue; the mutex is only taken
+    // when it is not zero.
+    std::mutex park_mutex;
+    std::condition_variable park;
+    std::atomic<int> sleepers{0};
+    uint64_t wakeups = 0; ///< Guarded by park_mutex.
+    bool stop = false;    ///< Guarded by park_mutex.
+
+    std::atomic<uint64_t> steals{0};
+
+    static thread_local Impl *current_pool;
+    static thread_local Worker *current_worker;
+
+    Node *take_external()
+    {
+        if (Node *n = inject.pop())
+            return n;
+        if (overflow_size.load(std::memory_order_relaxed) == 0)
+            return nullptr;
+        std::lock_guard<std::mutex> lock(overflow_mutex);
+        if (overflow.empty())
+            return nullptr;
+        Node *n = overflow.front();
+        overflow.pop_front();
+        overflow_size.fetch_sub(1, std::memory_order_relaxed);
+        return n;
     }
-    condition.notify_one();
+
+    Node *steal(Worker &self)
+    {
+        size_t count = workers.size();
+        // xorshift; a random starting victim spreads the thieves out.
+        self.seed ^= self.seed << 13;
+        self.seed ^= self.seed >> 7;
+        self.seed ^= self.seed << 17;
+        size_t start = self.seed % count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            Worker &victim = *workers[(start + i) % count];
+            if (&victim == &self)
+                continue;
+            if (Node *n = victim.deque.steal())
+            {
+                steals.fetch_add(1, std::memory_order_relaxed);
+                return n;
+            }
+        }
+        return nullptr;
+    }
+
+    Node *find_work(Worker &self)
+    {
+        if (Node *n = self.deque.pop())
+            return n;
+        if (Node *n = take_external())
+            return n;
+        return steal(self);
+    }
+
+    bool has_work() const
+    {
+        if (!inject.empty() || overflow_size.load(std::memory_order_relaxed) != 0)
+            return true;
+        for (const auto &w : workers)
+            if (!w->deque.empty())
+                return true;
+        return false;
+    }
+
+    void run(Worker &self)
+    {
+        current_pool = this;
+        current_worker = &self;
+        int idle = 0;
+        for (;;)
+        {
+            if (Node *n = find_work(self))
+            {
+                idle = 0;
+                n->task();
+                recycle(self, n);
+                continue;
+            }
+            if (++idle < kSpinRounds)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            idle = 0;
+
+            std::unique_lock<std::mutex> lock(park_mutex);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            // Pairs with the fence in notify(): either this scan sees the
+            // new task or the producer sees this sleeper.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!has_work())
+            {
+                if (stop)
+                {
+                    sleepers.fetch_sub(1, std::memory_order_relaxed);
+                    return;
+                }
+                uint64_t seen = wakeups;
+                park.wait(lock, [&]
+                          { return stop || wakeups != seen; });
+            }
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            ++wakeups;
+        }
+        park.notify_one();
+    }
+
+    Node *make_node(Task &&task)
+    {
+        Worker *w = current_pool == this ? current_worker : nullptr;
+        Node *n;
+        if (w && w->spare)
+        {
+            n = w->spare;
+            w->spare = n->next;
+            --w->spare_count;
+        }
+        else
+            n = new Node();
+        n->task = std::move(task);
+        return n;
+    }
+
+    void recycle(Worker &self, Node *n)
+    {
+        n->task = Task(); // release the closure's captures now
+        if (self.spare_count >= kNodeCache)
+        {
+            delete n;
+            return;
+        }
+        n->next = self.spare;
+        self.spare = n;
+        ++self.spare_count;
+    }
+};
+
+thread_local ThreadPool::Impl *ThreadPool::Impl::current_pool = nullptr;
+thread_local ThreadPool::Impl::Worker *ThreadPool::Impl::current_worker = nullptr;
+
+ThreadPool::ThreadPool(size_t threads, bool pin_cpus) : pimpl(new Impl())
+{
+    if (threads == 0)
+        threads = 1;
+    unsigned cpus = std::thread::hardware_concurrency();
+    if (cpus == 0)
+        cpus = 1;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        pimpl->workers.emplace_back(new Impl::Worker());
+        pimpl->workers.back()->seed = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+    for (size_t i = 0; i < threads; ++i)
+        pimpl->threads.emplace_back([this, i, pin_cpus, cpus]
+                                    {
+            if (pin_cpus)
+                pin_current_thread((unsigned)(i % cpus));
+            pimpl->run(*pimpl->workers[i]); });
 }
 
-ThreadPool::~ThreadPool() {
+void ThreadPool::enqueue(Task task)
+{
+    Impl &p = *pimpl;
+    Node *n = p.make_node(std::move(task));
+    if (Impl::current_pool == pimpl)
+        Impl::current_worker->deque.push(n);
+    else if (!p.inject.push(n))
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        std::lock_guard<std::mutex> lock(p.overflow_mutex);
+        p.overflow.push_back(n);
+        p.overflow_size.fetch_add(1, std::memory_order_relaxed);
     }
-    condition.notify_all();
-    for(std::thread &worker: workers) worker.join();
-}
\ No newline at end of file
+    p.notify();
+}
+
+uint64_t ThreadPool::get_steals() const
+{
+    return pimpl->steals.load(std::memory_order_relaxed);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(pimpl->park_mutex);
+        pimpl->stop = true;
+    }
+    pimpl->park.notify_all();
+    for (std::thread &worker : pimpl->threads)
+        worker.join();
+    for (auto &w : pimpl->workers)
+        while (Node *n = w->spare)
+        {
+            w->spare = n->next;
+            delete n;
+        }
+    delete pimpl;
+}
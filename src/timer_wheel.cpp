@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+namespace
+{
+constexpr unsigned kTopBits = TimerWheel::kLevelBits * TimerWheel::kLevels;
+constexpr uint64_t kSlotMask = TimerWheel::kSlots - 1;
+}
+
+TimerWheel::TimerWheel(Clock::time_point now) : m_origin(now)
+{
+    for (auto &level : m_slots)
+        for (Timer &head : level)
+            head.prev = head.next = &head;
+}
+
+TimerWheel::~TimerWheel()
+{
+    // Detach whatever is still scheduled, so that the owners of those
+    // timers can be destroyed after the wheel.
+    for (auto &level : m_slots)
+        for (Timer &head : level)
+        {
+            Timer *t = head.next;
+            while (t != &head)
+            {
+                Timer *next = t->next;
+                t->prev = t->next = nullptr;
+                t = next;
+            }
+            head.prev = head.next = nullptr;
+        }
+}
+
+uint64_t TimerWheel::tick_at(Clock::time_point t) const
+{
+    if (t <= m_origin)
+        return 0;
+    return static_cast<uint64_t>((t - m_origin) / kTick);
+}
+
+TimerWheel::Clock::time_point TimerWheel::time_of(uint64_t tick) const
+{
+    return m_origin + kTick * static_cast<Clock::rep>(tick);
+}
+
+void TimerWheel::schedule(Timer &t, Clock::time_point when)
+{
+    t.cancel();
+    // Round up, so that a timer never fires before its time.
+    uint64_t tick = tick_at(when);
+    if (time_of(tick) < when)
+        ++tick;
+    t.expires = tick;
+    link(t);
+}
+
+void TimerWheel::link(Timer &t)
+{
+    if (t.expires < m_next)
+        t.expires = m_next;
+    // A timer beyond the top level waits at its far end. expires is kept,
+    // so the cascade that reaches it links it again instead of firing it.
+    uint64_t delta = t.expires - m_next;
+    uint64_t at = t.expires;
+    if (delta >> kTopBits)
+    {
+        delta = (uint64_t(1) << kTopBits) - 1;
+        at = m_next + delta;
+    }
+
+    // The lowest level whose span covers the delay; see the class comment.
+    unsigned level = 0;
+    while (level + 1 < kLevels && (delta >> (kLevelBits * (level + 1))))
+        ++level;
+    uint64_t slot = (at >> (kLevelBits * level)) & kSlotMask;
+
+    Timer &head = m_slots[level][slot];
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+    m_occupied[level] |= uint64_t(1) << slot;
+}
+
+void TimerWheel::cascade()
+{
+    for (unsigned level = 1; level < kLevels; ++level)
+    {
+        unsigned shift = kLevelBits * level;
+        if (m_next & ((uint64_t(1) << shift) - 1))
+            return;
+        uint64_t slot = (m_next >> shift) & kSlotMask;
+        Timer &head = m_slots[level][slot];
+        m_occupied[level] &= ~(uint64_t(1) << slot);
+        while (head.next != &head)
+        {
+            Timer *t = head.next;
+            t->cancel();
+            link(*t);
+        }
+    }
+}
+
+TimerWheel::Clock::time_point TimerWheel::next_expiry()
+{
+    uint64_t best = UINT64_MAX;
+    for (unsigned level = 0; level < kLevels; ++level)
+    {
+        unsigned shift = kLevelBits * level;
+        uint64_t base = m_next >> shift;
+        uint64_t bits = m_occupied[level];
+        while (bits)
+        {
+            uint64_t slot = (uint64_t)__builtin_ctzll(bits);
+            bits &= bits - 1;
+            Timer &head = m_slots[level][slot];
+            if (head.next == &head)
+            {
+                m_occupied[level] &= ~(uint64_t(1) << slot); // emptied by cancel()
+                continue;
+            }
+            // The tick at which this slot is reached: it fires (level 0)
+            // or is cascaded (higher levels).
+            uint64_t tick = (base + ((slot - base) & kSlotMask)) << shift;
+            if (tick < m_next)
+                tick += uint64_t(1) << (shift + kLevelBits);
+            if (tick < best)
+                best = tick;
+        }
+    }
+    return best == UINT64_MAX ? Clock::time_point::max() : time_of(best);
+}
@@ -0,0 +1,126 @@
+#include "upstream_pool.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+struct IdleConn
+{
+    SOCKET sock;
+    Clock::time_point since;
+};
+}
+
+struct UpstreamPool::Impl
+{
+    size_t max_idle;
+    std::chrono::seconds timeout;
+    mutable std::mutex m;
+    std::unordered_map<std::string, std::vector<IdleConn>> idle; ///< Oldest first.
+    size_t idle_count = 0;
+    Clock::time_point last_prune;
+    std::atomic<uint64_t> reused{0};
+
+    // Caller holds m. Expired connections sit at the front of every list.
+    void prune_locked(Clock::time_point now)
+    {
+        last_prune = now;
+        for (auto it = idle.begin(); it != idle.end();)
+        {
+            auto &list = it->second;
+            size_t expired = 0;
+            while (expired < list.size() && now - list[expired].since >= timeout)
+                closesocket(list[expired++].sock);
+            list.erase(list.begin(), list.begin() + expired);
+            idle_count -= expired;
+            if (list.empty())
+                it = idle.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+UpstreamPool::UpstreamPool(size_t max_idle_per_host, std::chrono::seconds idle_timeout) : pimpl(new Impl())
+{
+    pimpl->max_idle = max_idle_per_host;
+    pimpl->timeout = idle_timeout;
+    pimpl->last_prune = Clock::now();
+}
+
+UpstreamPool::~UpstreamPool()
+{
+    for (auto &kv : pimpl->idle)
+        for (auto &c : kv.second)
+            closesocket(c.sock);
+    delete pimpl;
+}
+
+SOCKET UpstreamPool::acquire(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(pimpl->m);
+    auto now = Clock::now();
+    if (now - pimpl->last_prune >= std::chrono::seconds(1))
+        pimpl->prune_locked(now);
+
+    auto it = pimpl->idle.find(key);
+    if (it == pimpl->idle.end())
+        return INVALID_SOCKET;
+    auto &list = it->second;
+    while (!list.empty())
+    {
+        IdleConn c = list.back();
+        list.pop_back();
+        --pimpl->idle_count;
+        if (now - c.since < pimpl->timeout && socket_is_quiet(c.sock))
+        {
+            if (list.empty())
+                pimpl->idle.erase(it);
+            pimpl->reused.fetch_add(1, std::memory_order_relaxed);
+            return c.sock;
+        }
+        closesocket(c.sock);
+    }
+    pimpl->idle.erase(it);
+    return INVALID_SOCKET;
+}
+
+void UpstreamPool::release(const std::string &key, SOCKET s)
+{
+    if (pimpl->max_idle == 0)
+    {
+        closesocket(s);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pimpl->m);
+    auto &list = pimpl->idle[key];
+    if (list.size() >= pimpl->max_idle)
+    {
+        closesocket(list.front().sock);
+        list.erase(list.begin());
+        --pimpl->idle_count;
+    }
+    list.push_back(IdleConn{s, Clock::now()});
+    ++pimpl->idle_count;
+}
+
+void UpstreamPool::prune()
+{
+    std::lock_guard<std::mutex> lock(pimpl->m);
+    pimpl->prune_locked(Clock::now());
+}
+
+uint64_t UpstreamPool::get_reused() const
+{
+    return pimpl->reused.load(std::memory_order_relaxed);
+}
+
+size_t UpstreamPool::get_idle() const
+{
+    std::lock_guard<std::mutex> lock(pimpl->m);
+    return pimpl->idle_count;
+}
@@ -0,0 +1,1509 @@
+#ifdef __linux__
+
+#include "event_loop.h"
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "body_framer.h"
+#include "buffer_pool.h"
+#include "dns_resolver.h"
+#include "happy_eyeballs.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "net_compat.h"
+#include "rate_limiter.h"
+#include "request_handler.h"
+#include "timer_wheel.h"
+#include "upstream_pool.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+constexpr unsigned kRingEntries = 1024;
+constexpr unsigned kBufCount = 1024; ///< Provided buffers per loop.
+constexpr unsigned kBufSize = 16384;
+constexpr unsigned kFlowDepth = 4; ///< Provided buffers one flow may hold between recv and send.
+constexpr uint16_t kBufGroup = 0;
+
+// user_data packs a connection id (or listener fd) with the operation kind
+// and, for connects, which attempt of the race it is.
+enum Op : uint64_t
+{
+    OpWake,
+    OpAccept,
+    OpRecvClient,
+    OpRecvUpstream,
+    OpSendClient,
+    OpSendUpstream,
+    OpConnect,
+    OpCancel,
+    OpProvide
+};
+
+inline uint64_t udata(uint64_t id, Op op, uint64_t slot = 0) { return (id << 8) | (slot << 4) | op; }
+
+int sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned submit, unsigned wait_nr, unsigned flags, const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait_nr, flags, arg, argsz);
+}
+
+/**
+ * Minimal io_uring wrapper over the raw syscalls. SQEs are queued with
+ * get_sqe() and only handed to the kernel by enter(), so everything
+ * prepared while handling one batch of completions goes out in a single
+ * io_uring_enter().
+ */
+class Ring
+{
+public:
+    ~Ring()
+    {
+        if (sqes)
+            munmap(sqes, sqes_sz);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_sz);
+        if (sq_ptr)
+            munmap(sq_ptr, sq_sz);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool init(unsigned entries)
+    {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 8;
+        fd = sys_io_uring_setup(entries, &p);
+        if (fd < 0)
+            return false;
+        if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+            return false;
+
+        sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_sz = cq_sz = std::max(sq_sz, cq_sz);
+
+        void *sq = mmap(nullptr, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED)
+            return false;
+        sq_ptr = static_cast<char *>(sq);
+        if (single)
+            cq_ptr = sq_ptr;
+        else
+        {
+            void *cq = mmap(nullptr, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED)
+                return false;
+            cq_ptr = static_cast<char *>(cq);
+        }
+        sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+        void *e = mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (e == MAP_FAILED)
+            return false;
+        sqes = static_cast<io_uring_sqe *>(e);
+
+        sq_head = reinterpret_cast<unsigned *>(sq_ptr + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq_ptr + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq_ptr + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        unsigned *array = reinterpret_cast<unsigned *>(sq_ptr + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i)
+            array[i] = i;
+        cq_head = reinterpret_cast<unsigned *>(cq_ptr + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq_ptr + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq_ptr + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq_ptr + p.cq_off.cqes);
+        local_tail = *sq_tail;
+        return true;
+    }
+
+    io_uring_sqe *get_sqe()
+    {
+        if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            enter(0, nullptr);
+            if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+                return nullptr;
+        }
+        io_uring_sqe *sqe = &sqes[local_tail & sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++local_tail;
+        return sqe;
+    }
+
+    /**
+     * Submits everything queued so far and, if wait_nr > 0, blocks until
+     * that many completions are available or the timeout expires.
+     */
+    int enter(unsigned wait_nr, const __kernel_timespec *ts)
+    {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && wait_nr == 0)
+            return 0;
+        unsigned flags = 0;
+        io_uring_getevents_arg arg{};
+        if (wait_nr > 0)
+        {
+            flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uint64_t>(ts);
+        }
+        return sys_io_uring_enter(fd, to_submit, wait_nr, flags, wait_nr ? &arg : nullptr, wait_nr ? sizeof(arg) : 0);
+    }
+
+    /**
+     * Pops one completion, copying it out so the slot can be reused at once.
+     */
+    bool pop_cqe(io_uring_cqe &out)
+    {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        out = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    int fd = -1;
+
+private:
+    char *sq_ptr = nullptr;
+    char *cq_ptr = nullptr;
+    size_t sq_sz = 0;
+    size_t cq_sz = 0;
+    size_t sqes_sz = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned local_tail = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+
+/**
+ * Pool of provided buffers (IORING_OP_PROVIDE_BUFFERS). Receives pick a
+ * buffer only when data actually arrives, so idle connections pin no
+ * memory. Returning a buffer costs one SQE, which rides along with the
+ * next io_uring_enter() instead of a syscall of its own.
+ */
+class BufferPool
+{
+public:
+    ~BufferPool()
+    {
+        if (data)
+            munmap(data, (size_t)kBufCount * kBufSize);
+    }
+
+    bool init(Ring &r)
+    {
+        ring = &r;
+        void *d = mmap(nullptr, (size_t)kBufCount * kBufSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (d == MAP_FAILED)
+            return false;
+        data = static_cast<char *>(d);
+        return provide(0, kBufCount);
+    }
+
+    char *buf(uint16_t bid) { return data + (size_t)bid * kBufSize; }
+
+    void recycle(uint16_t bid)
+    {
+        provide(bid, 1);
+        ++recycled;
+    }
+
+    uint64_t recycled = 0; ///< Bumped on every return; lets the loop notice freed buffers.
+
+private:
+    bool provide(uint16_t first, unsigned count)
+    {
+        io_uring_sqe *sqe = ring->get_sqe();
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = reinterpret_cast<uint64_t>(buf(first));
+        sqe->len = kBufSize;
+        sqe->off = first;
+        sqe->buf_group = kBufGroup;
+        sqe->user_data = OpProvide;
+        return true;
+    }
+
+    Ring *ring = nullptr;
+    char *data = nullptr;
+};
+
+// What a TimerWheel::Timer of this loop is for.
+enum TimerKind : unsigned
+{
+    TimerDeadline, ///< Connection::timeout: header, connect or idle deadline.
+    TimerLifetime, ///< Connection::lifetime
+    TimerWake,     ///< Connection::wake: resume flows parked by shaping.
+    TimerAttempt,  ///< Connection::stagger: start the next connection attempt.
+    TimerPrune     ///< Closes stale pooled upstreams (loop 0 only).
+};
+
+enum class ConnState
+{
+    ReadingHead,
+    Resolving,
+    Connecting,
+    Relaying,
+    Rejecting ///< Flushing a canned error response before closing.
+};
+
+/// Most entries a Flow queues: a forwarded request head and body prefix, or kFlowDepth buffers and an owned head.
+constexpr size_t kFlowSlots = kMaxForwardPieces + 1 + kFlowDepth;
+
+/**
+ * One relay direction. Bytes to send queue up in 'iov' and go out with
+ * one SENDMSG, while the next recv is already posted, so a flow keeps up
+ * to kFlowDepth buffers moving per round trip. An entry points into a
+ * provided buffer or borrows from 'owned', the request head or
+ * Connection::pending. Those are only written by a recv completion, so no
+ * recv is posted while a borrowed entry is queued.
+ */
+struct Flow
+{
+    std::string owned;      ///< Built rather than received: a canned or rewritten response head.
+    std::vector<iovec> iov; ///< Bytes to send, oldest first. Reserved to kFlowSlots, never reallocated.
+    std::vector<int> bids;  ///< Provided buffer behind each entry of iov, or -1 if borrowed.
+    size_t iov_at = 0;      ///< First entry of iov with bytes left.
+    unsigned held = 0;      ///< Queued entries backed by a provided buffer.
+    unsigned borrowed = 0;  ///< Queued entries that are not.
+    msghdr msg{};           ///< Argument of the SENDMSG in flight.
+    bool recv_pending = false;
+    bool send_pending = false;
+    bool reads = true;
+    bool eof = false;
+    bool shut = false;
+    bool starved = false; ///< Last recv failed with ENOBUFS.
+    size_t total = 0;
+    RateLimiter::Handle shaper; ///< Buckets this flow is paced by.
+
+    bool queued() const { return iov_at < iov.size(); }
+
+    /// Like a new Flow, but owned, iov and bids keep their capacity.
+    void reset()
+    {
+        std::string keep_owned;
+        std::vector<iovec> keep_iov;
+        std::vector<int> keep_bids;
+        keep_owned.swap(owned);
+        keep_iov.swap(iov);
+        keep_bids.swap(bids);
+        *this = Flow();
+        owned.swap(keep_owned);
+        iov.swap(keep_iov);
+        bids.swap(keep_bids);
+        owned.clear();
+        iov.clear();
+        bids.clear();
+    }
+};
+
+/**
+ * Where the current plain-HTTP response stands. The head is held back
+ * until complete so its connection headers can be rewritten; the body is
+ * relayed as it arrives, up to the end found by the framer.
+ */
+struct ResponseState
+{
+    /// Starts over for the next response, keeping the capacity of head.
+    void clear()
+    {
+        std::string keep;
+        keep.swap(head);
+        *this = ResponseState();
+        head.swap(keep);
+        head.clear();
+    }
+
+    std::string head;
+    bool head_done = false;
+    bool done = false;     ///< The whole response has been read from upstream.
+    bool reusable = false; ///< Upstream may go back to the pool afterwards.
+    int status = 0;
+    BodyFramer body;
+    size_t raw = 0; ///< Bytes received from upstream so far.
+};
+
+struct Connection
+{
+    Connection()
+    {
+        timeout.kind = TimerDeadline;
+        lifetime.kind = TimerLifetime;
+        wake.kind = TimerWake;
+        stagger.kind = TimerAttempt;
+        std::fill(std::begin(racing), std::end(racing), -1);
+        for (Flow *f : {&up, &down})
+        {
+            f->iov.reserve(kFlowSlots);
+            f->bids.reserve(kFlowSlots);
+        }
+    }
+
+    uint64_t id = 0;
+    int client = -1;
+    int upstream = -1;
+    ConnState state = ConnState::ReadingHead;
+    std::string head;     ///< Request head as it arrives; moved into req once complete.
+    RequestParser parser; ///< Resumes over head on every read.
+    HttpRequest req;
+    std::string pending;        ///< Client bytes past the request head (body, or the next pipelined request).
+    size_t body_prefix = 0;     ///< Leading bytes of pending that belong to the request body.
+    BodyFramer req_body;        ///< The rest of the body is relayed up to its end.
+    bool body_streamed = false; ///< Body bytes were read after the head, so no retry is possible.
+    ResponseState resp;
+    std::string client_desc;
+    std::string dest;
+    bool tunnel = false;
+    bool keep_alive = false; ///< Client connection carries on after this exchange.
+    bool reused = false;     ///< Upstream came from the pool.
+    Flow up;   ///< client -> upstream
+    Flow down; ///< upstream -> client
+    DnsResolver::Addresses addrs; ///< Kept while plan points into it.
+    ConnectPlan plan;
+    size_t attempts = 0;                    ///< Entries of plan started so far.
+    int racing[ConnectPlan::kMaxAddresses]; ///< Sockets whose connect has not completed; -1 if none.
+    TimerWheel::Timer stagger;              ///< Starts the next attempt unless one finishes first.
+    unsigned inflight = 0; ///< Submitted operations that have not completed yet.
+    bool closing = false;
+    Clock::time_point deadline; ///< Of the current phase; relay progress pushes it back.
+    TimerWheel::Timer timeout;  ///< Catches up with deadline lazily when it fires.
+    TimerWheel::Timer lifetime; ///< Accept time plus kMaxLifetime.
+    TimerWheel::Timer wake;     ///< Set while a flow is parked by shaping.
+    Clock::time_point started;  ///< First byte of the request.
+    Clock::time_point phase_at; ///< Start of the latency phase in progress.
+
+    /// Back to a just-accepted state for Slab reuse; strings keep their capacity.
+    void reset()
+    {
+        client = upstream = -1;
+        state = ConnState::ReadingHead;
+        head.clear();
+        parser.reset();
+        req.clear();
+        pending.clear();
+        body_prefix = 0;
+        req_body = BodyFramer();
+        body_streamed = false;
+        resp.clear();
+        client_desc.clear();
+        dest.clear();
+        tunnel = keep_alive = reused = false;
+        up.reset();
+        down.reset();
+        addrs.reset();
+        attempts = 0;
+        std::fill(std::begin(racing), std::end(racing), -1);
+        inflight = 0;
+        closing = false;
+        timeout.cancel();
+        lifetime.cancel();
+        wake.cancel();
+        stagger.cancel();
+    }
+};
+
+bool racing_any(const Connection &c)
+{
+    for (int fd : c.racing)
+        if (fd >= 0)
+            return true;
+    return false;
+}
+
+using AddrList = DnsResolver::Addresses;
+
+/**
+ * io_uring backend: multishot accept, receives into a provided buffer
+ * ring, and sends issued straight from the buffer that was filled.
+ */
+class UringLoop final : public EventLoop
+{
+public:
+    ProxyContext &ctx;
+    DnsResolver &resolver;
+    int index;
+    int cpu = -1;
+    Ring ring;
+    BufferPool bufs;
+    int wakefd = -1;
+    uint64_t wake_value = 0;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::vector<int> listeners;
+
+    Slab<Connection> conns;
+    std::vector<uint64_t> starved;
+    uint64_t seen_recycled = 0;
+
+    std::mutex post_mtx;
+    std::vector<std::function<void()>> posted;
+
+    TimerWheel timers;
+    TimerWheel::Timer prune;
+
+    UringLoop(ProxyContext &c, DnsResolver &r, int i) : ctx(c), resolver(r), index(i) {}
+
+    ~UringLoop() override
+    {
+        stop();
+        conns.for_each([](Connection &c)
+                       {
+            if (c.client >= 0)
+                close(c.client);
+            if (c.upstream >= 0)
+                close(c.upstream);
+            for (int fd : c.racing)
+                if (fd >= 0)
+                    close(fd); });
+        if (wakefd >= 0)
+            close(wakefd);
+    }
+
+    bool init()
+    {
+        if (!ring.init(kRingEntries) || !bufs.init(ring))
+            return false;
+        wakefd = eventfd(0, EFD_CLOEXEC);
+        return wakefd >= 0;
+    }
+
+    bool add_listener(int fd) override;
+    void pin_to_cpu(int cpu) override;
+    void start() override;
+    void stop() override;
+    void post(std::function<void()> task) override;
+
+    void run();
+    io_uring_sqe *sqe_for(Connection *c, uint64_t user_data);
+    void arm_accept(int lfd);
+    void arm_wake();
+    void submit_recv(Connection &c, int fd, Op op);
+    void submit_sendmsg(Connection &c, int fd, Op op, Flow &f);
+    void on_cqe(const io_uring_cqe &cqe);
+    void on_accept(const io_uring_cqe &cqe, int lfd);
+    void on_head(Connection &c);
+    void begin_resolve(Connection &c);
+    void on_resolved(uint64_t id, AddrList addrs, int rc);
+    bool start_attempt(Connection &c);
+    void on_attempt(Connection &c, size_t slot, int res);
+    void cancel_fd(int fd);
+    void on_connected(Connection &c);
+    bool frame_response(Connection &c, const char *data, size_t n, int bid);
+    void finish_exchange(Connection &c);
+    bool can_retry(const Connection &c) const;
+    void retry_fresh(Connection &c);
+    void log_exchange(Connection &c);
+    void reset_flow(Flow &f);
+    void queue(Flow &f, const char *data, size_t len, int bid);
+    void release_buffers(Flow &f);
+    void advance(Connection &c, Flow &f, int src, int dst, Op recv_op, Op send_op);
+    void drive(Connection &c);
+    void fail_upstream(Connection &c);
+    void abort_relay(Connection &c);
+    void close_conn(Connection &c);
+    bool maybe_free(Connection &c);
+    void retry_starved();
+    void arm_deadline(Connection &c, Clock::time_point when);
+    void on_timer(TimerWheel::Timer &t, Clock::time_point now);
+};
+
+io_uring_sqe *UringLoop::sqe_for(Connection *c, uint64_t user_data)
+{
+    io_uring_sqe *sqe = ring.get_sqe();
+    if (!sqe)
+        return nullptr;
+    sqe->user_data = user_data;
+    if (c)
+        ++c->inflight;
+    return sqe;
+}
+
+void UringLoop::arm_accept(int lfd)
+{
+    io_uring_sqe *sqe = sqe_for(nullptr, udata((uint64_t)lfd, OpAccept));
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void UringLoop::arm_wake()
+{
+    io_uring_sqe *sqe = sqe_for(nullptr, udata(0, OpWake));
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+    sqe->len = sizeof(wake_value);
+}
+
+void UringLoop::submit_recv(Connection &c, int fd, Op op)
+{
+    io_uring_sqe *sqe = sqe_for(&c, udata(c.id, op));
+    if (!sqe)
+    {
+        close_conn(c);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = kBufSize;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+}
+
+void UringLoop::submit_sendmsg(Connection &c, int fd, Op op, Flow &f)
+{
+    io_uring_sqe *sqe = sqe_for(&c, udata(c.id, op));
+    if (!sqe)
+    {
+        close_conn(c);
+        return;
+    }
+    // Nothing is in flight, so sent entries can be dropped from the front.
+    f.iov.erase(f.iov.begin(), f.iov.begin() + (std::ptrdiff_t)f.iov_at);
+    f.bids.erase(f.bids.begin(), f.bids.begin() + (std::ptrdiff_t)f.iov_at);
+    f.iov_at = 0;
+    f.msg = msghdr{};
+    f.msg.msg_iov = f.iov.data();
+    f.msg.msg_iovlen = f.iov.size();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&f.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void UringLoop::run()
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    arm_wake();
+    for (int lfd : listeners)
+        arm_accept(lfd);
+    if (index == 0)
+    {
+        prune.kind = TimerPrune;
+        timers.schedule(prune, Clock::now() + kPruneInterval);
+    }
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        auto now = Clock::now();
+        auto next = timers.next_expiry();
+        auto wait = next > now ? std::chrono::duration_cast<std::chrono::nanoseconds>(next - now) : std::chrono::nanoseconds(0);
+        __kernel_timespec ts{};
+        ts.tv_sec = wait.count() / 1000000000;
+        ts.tv_nsec = wait.count() % 1000000000;
+
+        int rc = ring.enter(1, next == Clock::time_point::max() ? nullptr : &ts);
+        if (rc < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+
+        io_uring_cqe cqe;
+        while (ring.pop_cqe(cqe))
+            on_cqe(cqe);
+        retry_starved();
+
+        now = Clock::now();
+        timers.advance(now, [this, now](TimerWheel::Timer &t)
+                       { on_timer(t, now); });
+    }
+}
+
+void UringLoop::on_cqe(const io_uring_cqe &cqe)
+{
+    uint64_t id = cqe.user_data >> 8;
+    Op op = (Op)(cqe.user_data & 15);
+    size_t slot = (size_t)((cqe.user_data >> 4) & 15);
+    int bid = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+    switch (op)
+    {
+    case OpWake:
+    {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lg(post_mtx);
+            tasks.swap(posted);
+        }
+        for (auto &t : tasks)
+            t();
+        if (running.load(std::memory_order_relaxed))
+            arm_wake();
+        return;
+    }
+    case OpAccept:
+        on_accept(cqe, (int)id);
+        return;
+    case OpCancel:
+    case OpProvide:
+        return;
+    default:
+        break;
+    }
+
+    Connection *found = conns.find(id);
+    if (!found)
+    {
+        if (bid >= 0)
+            bufs.recycle((uint16_t)bid);
+        return;
+    }
+    Connection &c = *found;
+    --c.inflight;
+
+    if (c.closing)
+    {
+        if (bid >= 0)
+            bufs.recycle((uint16_t)bid);
+        if (op == OpSendClient || op == OpSendUpstream)
+        {
+            Flow &f = op == OpSendUpstream ? c.up : c.down;
+            f.send_pending = false;
+            release_buffers(f);
+        }
+        maybe_free(c);
+        return;
+    }
+
+    int res = cqe.res;
+    switch (op)
+    {
+    case OpRecvClient:
+    case OpRecvUpstream:
+    {
+        if (c.state == ConnState::ReadingHead)
+        {
+            if (res <= 0)
+            {
+                if (bid >= 0)
+                    bufs.recycle((uint16_t)bid);
+                if (res == -ENOBUFS)
+                {
+                    c.up.starved = true;
+                    starved.push_back(c.id);
+                    return;
+                }
+                close_conn(c);
+                return;
+            }
+            if (c.head.empty())
+                c.started = Clock::now();
+            c.head.append(bufs.buf((uint16_t)bid), (size_t)res);
+            bufs.recycle((uint16_t)bid);
+            on_head(c);
+            return;
+        }
+
+        Flow &f = op == OpRecvClient ? c.up : c.down;
+        f.recv_pending = false;
+        if (res > 0)
+        {
+            const char *data = bufs.buf((uint16_t)bid);
+            if (&f == &c.down && !c.tunnel)
+            {
+                if (!frame_response(c, data, (size_t)res, bid))
+                {
+                    abort_relay(c);
+                    return;
+                }
+            }
+            else if (!c.tunnel)
+            {
+                // Request body: bytes past its end start the next request.
+                c.body_streamed = true;
+                size_t used = c.req_body.consume(data, (size_t)res);
+                c.pending.append(data + used, (size_t)res - used);
+                queue(f, data, used, bid);
+                if (c.req_body.error())
+                {
+                    abort_relay(c);
+                    return;
+                }
+                if (c.req_body.done())
+                    f.reads = false;
+            }
+            else
+                queue(f, data, (size_t)res, bid);
+        }
+        else
+        {
+            if (bid >= 0)
+                bufs.recycle((uint16_t)bid);
+            if (res == -ENOBUFS)
+            {
+                f.starved = true;
+                starved.push_back(c.id);
+                return;
+            }
+            if (&f == &c.down && can_retry(c))
+            {
+                retry_fresh(c); // pooled connection went stale
+                return;
+            }
+            if (res < 0)
+            {
+                abort_relay(c);
+                return;
+            }
+            f.eof = true;
+        }
+        drive(c);
+        return;
+    }
+    case OpSendClient:
+    case OpSendUpstream:
+    {
+        Flow &f = op == OpSendUpstream ? c.up : c.down;
+        f.send_pending = false;
+        if (res < 0)
+        {
+            abort_relay(c);
+            return;
+        }
+        size_t sent = consume_slices(&f.iov[f.iov_at], f.iov.size() - f.iov_at, (size_t)res);
+        for (size_t i = f.iov_at; i < f.iov_at + sent; ++i)
+        {
+            if (f.bids[i] >= 0)
+            {
+                bufs.recycle((uint16_t)f.bids[i]);
+                --f.held;
+            }
+            else
+                --f.borrowed;
+        }
+        f.iov_at += sent;
+        f.total += (size_t)res;
+        auto now = Clock::now();
+        if (ctx.limiter.active())
+            ctx.limiter.charge(f.shaper, (size_t)res, now);
+        c.deadline = now + kIdleTimeout;
+        ctx.metrics.record_relay((uint64_t)res, false, op == OpSendClient);
+        drive(c);
+        return;
+    }
+    case OpConnect:
+        on_attempt(c, slot, res);
+        return;
+    default:
+        return;
+    }
+}
+
+void UringLoop::on_accept(const io_uring_cqe &cqe, int lfd)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE) && running.load(std::memory_order_relaxed))
+        arm_accept(lfd); // multishot terminated (e.g. out of descriptors): re-arm
+    if (cqe.res < 0)
+        return;
+
+    set_nodelay(cqe.res);
+    Connection &c = *conns.acquire();
+    c.client = cqe.res;
+    c.client_desc = describe_peer(c.client);
+    c.timeout.owner = c.lifetime.owner = c.wake.owner = c.stagger.owner = c.id;
+    auto now = Clock::now();
+    arm_deadline(c, now + kHeaderTimeout);
+    timers.schedule(c.lifetime, now + kMaxLifetime);
+    ctx.metrics.connection_opened();
+    submit_recv(c, c.client, OpRecvClient);
+}
+
+void UringLoop::on_head(Connection &c)
+{
+    if (c.parser.parse(c.head, c.req) == RequestParser::Result::Incomplete)
+    {
+        if (c.head.size() > kMaxHeaderBytes)
+            close_conn(c);
+        else
+            submit_recv(c, c.client, OpRecvClient);
+        return;
+    }
+    if (c.parser.head_length() > kMaxHeaderBytes)
+    {
+        close_conn(c);
+        return;
+    }
+
+    c.parser.finish(c.head, c.req, c.pending);
+    ctx.metrics.record_latency(Metrics::Phase::HeaderRead, Clock::now() - c.started);
+    switch (route_request(ctx, c.req, c.client_desc))
+    {
+    case RouteAction::BadRequest:
+        close_conn(c);
+        return;
+    case RouteAction::Blocked:
+        c.state = ConnState::Rejecting;
+        c.up.reads = false;
+        c.down.reads = false;
+        c.down.eof = true;
+        c.down.owned = kForbiddenResponse;
+        queue(c.down, c.down.owned.data(), c.down.owned.size(), -1);
+        drive(c);
+        return;
+    case RouteAction::Tunnel:
+        c.tunnel = true;
+        break;
+    case RouteAction::Forward:
+        c.tunnel = false;
+        break;
+    }
+    c.dest.assign(c.req.host()).append(":").append(c.req.port());
+    if (!c.tunnel)
+    {
+        // Body bytes that came with the head go out with it; the rest is
+        // relayed by the up flow, which stops at the end of the body.
+        c.req_body = request_framer(c.req);
+        c.keep_alive = request_keep_alive(c.req) && !c.req_body.error();
+        c.body_prefix = c.req_body.consume(c.pending.data(), c.pending.size());
+
+        int fd = ctx.upstreams.acquire(c.dest);
+        if (fd >= 0)
+        {
+            c.upstream = fd;
+            c.reused = true;
+            on_connected(c);
+            return;
+        }
+    }
+    begin_resolve(c);
+}
+
+void UringLoop::begin_resolve(Connection &c)
+{
+    c.state = ConnState::Resolving;
+    c.phase_at = Clock::now();
+    arm_deadline(c, c.phase_at + kConnectTimeout);
+
+    // Cache hits are answered inline; misses complete on a resolver thread
+    // and are posted back to this loop.
+    UringLoop *self = this;
+    uint64_t id = c.id;
+    AddrList addrs;
+    int rc = 0;
+    if (resolver.resolve(std::string(c.req.host()), std::string(c.req.port()), addrs, rc, [self, id](AddrList a, int r)
+                         { self->post([self, id, a, r]() { self->on_resolved(id, a, r); }); }))
+        on_resolved(id, addrs, rc);
+}
+
+void UringLoop::on_resolved(uint64_t id, AddrList addrs, int rc)
+{
+    Connection *found = conns.find(id);
+    if (!found || found->closing)
+        return;
+    Connection &c = *found;
+    auto now = Clock::now();
+    ctx.metrics.record_latency(Metrics::Phase::Dns, now - c.phase_at);
+    c.phase_at = now;
+    if (rc != 0 || !addrs)
+    {
+        fail_upstream(c);
+        return;
+    }
+
+    // The addresses stay alive with the connection, so connects still in
+    // flight never see them freed.
+    c.addrs = std::move(addrs);
+    plan_connect(c.addrs.get(), resolver.preferred_family(std::string(c.req.host()), std::string(c.req.port())),
+                 c.plan);
+    c.attempts = 0;
+    c.state = ConnState::Connecting;
+    if (!start_attempt(c))
+        fail_upstream(c);
+}
+
+bool UringLoop::start_attempt(Connection &c)
+{
+    while (c.attempts < c.plan.count)
+    {
+        size_t i = c.attempts++;
+        const addrinfo *ai = c.plan.addrs[i];
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        set_nodelay(fd);
+        io_uring_sqe *sqe = sqe_for(&c, udata(c.id, OpConnect, i));
+        if (!sqe)
+        {
+            close(fd);
+            return false;
+        }
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(ai->ai_addr);
+        sqe->off = ai->ai_addrlen;
+        c.racing[i] = fd;
+        if (c.attempts < c.plan.count)
+            timers.schedule(c.stagger, Clock::now() + kAttemptDelay);
+        return true;
+    }
+    return false;
+}
+
+void UringLoop::on_attempt(Connection &c, size_t slot, int res)
+{
+    int fd = c.racing[slot];
+    c.racing[slot] = -1;
+    if (c.state != ConnState::Connecting)
+    {
+        close(fd); // lost the race
+        return;
+    }
+    if (res < 0)
+    {
+        // A failed attempt hands over to the next address at once.
+        close(fd);
+        if (!start_attempt(c) && !racing_any(c))
+            fail_upstream(c);
+        return;
+    }
+
+    c.upstream = fd;
+    c.stagger.cancel();
+    for (int other : c.racing)
+        if (other >= 0)
+            cancel_fd(other); // completes with an error and is closed then
+    resolver.record_family(std::string(c.req.host()), std::string(c.req.port()), c.plan.addrs[slot]->ai_family);
+    on_connected(c);
+}
+
+void UringLoop::cancel_fd(int fd)
+{
+    shutdown(fd, SHUT_RDWR);
+    io_uring_sqe *sqe = sqe_for(nullptr, udata(0, OpCancel));
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+}
+
+void UringLoop::on_connected(Connection &c)
+{
+    auto now = Clock::now();
+    if (c.state == ConnState::Connecting)
+        ctx.metrics.record_latency(Metrics::Phase::Connect, now - c.phase_at);
+    c.state = ConnState::Relaying;
+    c.phase_at = now; // time to first byte counts from here
+    arm_deadline(c, now + kIdleTimeout);
+    if (ctx.limiter.active())
+    {
+        std::string_view client = peer_address(c.client_desc);
+        c.up.shaper = ctx.limiter.attach(client, c.req.host());
+        c.down.shaper = ctx.limiter.attach(client, c.req.host());
+    }
+
+    if (c.tunnel)
+    {
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "FORWARD", 200, 0);
+        c.down.owned = kConnectEstablished;
+        queue(c.down, c.down.owned.data(), c.down.owned.size(), -1);
+    }
+    else
+    {
+        // Sent straight from the client's bytes; see forward_request_pieces().
+        // pending is not appended to until these slices have gone out.
+        std::string_view pieces[kMaxForwardPieces + 1];
+        size_t n = forward_request_pieces(c.req, true, pieces);
+        if (c.body_prefix > 0)
+            pieces[n++] = std::string_view(c.pending.data(), c.body_prefix);
+        for (size_t i = 0; i < n; ++i)
+            queue(c.up, pieces[i].data(), pieces[i].size(), -1);
+        c.up.reads = !c.req_body.done() && !c.req_body.error();
+    }
+    drive(c);
+}
+
+void UringLoop::advance(Connection &c, Flow &f, int src, int dst, Op recv_op, Op send_op)
+{
+    if (c.closing)
+        return;
+
+    if (!f.send_pending && f.queued())
+    {
+        f.send_pending = true;
+        submit_sendmsg(c, dst, send_op, f);
+        if (c.closing)
+            return;
+    }
+    if (f.recv_pending || f.starved)
+        return;
+
+    if (f.eof)
+    {
+        if (!f.shut && !f.send_pending && !f.queued())
+        {
+            shutdown(dst, SHUT_WR);
+            f.shut = true;
+        }
+        return;
+    }
+    // The next recv overlaps the send in flight, unless the queue is full
+    // or still borrows memory that a recv completion may rewrite.
+    if (!f.reads || f.held >= kFlowDepth || f.borrowed > 0)
+        return;
+
+    if (ctx.limiter.active())
+    {
+        auto now = Clock::now();
+        auto wait = ctx.limiter.delay(f.shaper, now);
+        if (wait > Clock::duration::zero())
+        {
+            // One wake-up drives both flows, so one queued is enough.
+            if (!c.wake.pending())
+                timers.schedule(c.wake, now + wait);
+            return;
+        }
+    }
+
+    f.recv_pending = true;
+    submit_recv(c, src, recv_op);
+}
+
+void UringLoop::drive(Connection &c)
+{
+    if (c.state == ConnState::Rejecting)
+    {
+        advance(c, c.down, c.upstream, c.client, OpRecvUpstream, OpSendClient);
+        if (!c.closing && c.down.shut)
+            close_conn(c);
+        return;
+    }
+
+    advance(c, c.up, c.client, c.upstream, OpRecvClient, OpSendUpstream);
+    advance(c, c.down, c.upstream, c.client, OpRecvUpstream, OpSendClient);
+    if (c.closing)
+        return;
+
+    if (!c.tunnel && c.resp.done && !c.down.send_pending && !c.down.queued())
+    {
+        finish_exchange(c);
+        return;
+    }
+
+    if (c.tunnel ? (c.up.shut && c.down.shut) : c.down.shut)
+    {
+        if (!c.tunnel)
+            log_exchange(c);
+        close_conn(c);
+    }
+}
+
+bool UringLoop::frame_response(Connection &c, const char *data, size_t n, int bid)
+{
+    Flow &d = c.down;
+    ResponseState &r = c.resp;
+    if (r.raw == 0)
+        ctx.metrics.record_latency(Metrics::Phase::FirstByte, Clock::now() - c.phase_at);
+    r.raw += n;
+    if (r.head_done)
+    {
+        size_t used = r.body.consume(data, n);
+        if (used < n)
+            r.reusable = false; // bytes past the end of the response
+        queue(d, data, used, bid);
+    }
+    else
+    {
+        // The head is collected apart from the provided buffers, which go
+        // back to the ring at once.
+        r.head.append(data, n);
+        bufs.recycle((uint16_t)bid);
+        std::string &out = d.owned; // not queued: no recv is posted while it is
+        out.clear();
+        for (;;)
+        {
+            size_t end = r.head.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                if (r.head.size() > kMaxHeaderBytes)
+                    return false;
+                break;
+            }
+            std::string head = r.head.substr(0, end + 4);
+            std::string rest = r.head.substr(end + 4);
+            HttpResponse resp;
+            if (!parse_response_head(head, resp))
+                return false;
+            if (resp.status < 200 && resp.status != 101)
+            {
+                // Interim response: pass it on and wait for the final one.
+                out += head;
+                r.head = std::move(rest);
+                continue;
+            }
+
+            r.body = resp.status == 101 ? BodyFramer(BodyFramer::Mode::UntilClose, 0) : response_framer(resp, c.req.method());
+            bool framed = r.body.mode() != BodyFramer::Mode::UntilClose;
+            r.status = resp.status;
+            r.reusable = framed && response_keep_alive(resp);
+            c.keep_alive = c.keep_alive && framed;
+            if (!c.req_body.done())
+            {
+                // Answered before the whole body was sent: the origin has
+                // rejected it, and the rest of it is not relayed.
+                r.reusable = c.keep_alive = false;
+                c.up.reads = false;
+            }
+            out += rewrite_response_head(head, c.keep_alive);
+            size_t used = r.body.consume(rest.data(), rest.size());
+            if (used < rest.size())
+                r.reusable = false;
+            out.append(rest, 0, used);
+            r.head_done = true;
+            r.head.clear();
+            break;
+        }
+        queue(d, out.data(), out.size(), -1);
+    }
+
+    if (r.body.error())
+        return false;
+    if (r.head_done && r.body.done())
+    {
+        r.done = true;
+        d.reads = false;
+    }
+    return true;
+}
+
+void UringLoop::finish_exchange(Connection &c)
+{
+    log_exchange(c);
+
+    // The upstream can only be handed on with nothing in flight on it. A
+    // request body still being sent, or a connect that lost the race,
+    // costs the keep-alive instead.
+    bool quiet = !c.up.recv_pending && !c.up.send_pending && !c.down.recv_pending && !racing_any(c);
+    if (quiet)
+    {
+        if (c.resp.reusable)
+            ctx.upstreams.release(c.dest, c.upstream);
+        else
+            close(c.upstream);
+        c.upstream = -1;
+    }
+    if (!c.keep_alive || !quiet)
+    {
+        shutdown(c.client, SHUT_WR);
+        close_conn(c);
+        return;
+    }
+
+    // Back to waiting for the next request on the same client connection;
+    // whatever the client pipelined behind this request is parsed first.
+    reset_flow(c.up);
+    reset_flow(c.down);
+    c.wake.cancel();
+    c.resp.clear();
+    c.req.clear();
+    c.pending.erase(0, c.body_prefix);
+    c.head.swap(c.pending);
+    c.pending.clear();
+    c.body_prefix = 0;
+    c.req_body = BodyFramer();
+    c.body_streamed = false;
+    if (!c.head.empty())
+        c.started = Clock::now(); // pipelined: already waiting in the buffer
+    c.parser.reset();
+    c.tunnel = c.reused = false;
+    c.state = ConnState::ReadingHead;
+    arm_deadline(c, Clock::now() + kHeaderTimeout);
+    if (c.head.empty())
+        submit_recv(c, c.client, OpRecvClient);
+    else
+        on_head(c);
+}
+
+bool UringLoop::can_retry(const Connection &c) const
+{
+    // Nothing of the response has arrived, nothing of the request is lost
+    // and no operation still refers to the old socket or the request.
+    return !c.tunnel && c.reused && c.resp.raw == 0 && !c.body_streamed && !c.up.recv_pending &&
+           !c.up.send_pending && !c.down.recv_pending && !c.down.send_pending;
+}
+
+void UringLoop::retry_fresh(Connection &c)
+{
+    close(c.upstream);
+    c.upstream = -1;
+    reset_flow(c.up);
+    reset_flow(c.down);
+    c.wake.cancel();
+    c.resp = ResponseState();
+    c.reused = false;
+    begin_resolve(c);
+}
+
+void UringLoop::log_exchange(Connection &c)
+{
+    if (c.resp.status != 0)
+    {
+        ctx.metrics.record_latency(Metrics::Phase::Total, Clock::now() - c.started);
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "FORWARD", c.resp.status, c.down.total);
+    }
+    else
+        log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "ERROR", 502, 0);
+}
+
+void UringLoop::reset_flow(Flow &f)
+{
+    release_buffers(f);
+    f.reset();
+}
+
+void UringLoop::queue(Flow &f, const char *data, size_t len, int bid)
+{
+    if (len == 0)
+    {
+        if (bid >= 0)
+            bufs.recycle((uint16_t)bid);
+        return;
+    }
+    f.iov.push_back(make_slice(data, len));
+    f.bids.push_back(bid);
+    if (bid >= 0)
+        ++f.held;
+    else
+        ++f.borrowed;
+}
+
+void UringLoop::release_buffers(Flow &f)
+{
+    for (size_t i = f.iov_at; i < f.bids.size(); ++i)
+    {
+        if (f.bids[i] >= 0)
+            bufs.recycle((uint16_t)f.bids[i]);
+        f.bids[i] = -1;
+    }
+    f.held = 0;
+}
+
+void UringLoop::fail_upstream(Connection &c)
+{
+    log_request(ctx, c.client_desc, c.dest, c.req.request_line(), "ERROR", 502, 0);
+    close_conn(c);
+}
+
+void UringLoop::abort_relay(Connection &c)
+{
+    if (c.state == ConnState::Relaying && !c.tunnel)
+        log_exchange(c);
+    close_conn(c);
+}
+
+void UringLoop::close_conn(Connection &c)
+{
+    if (c.closing)
+        return;
+    c.closing = true;
+    c.timeout.cancel();
+    c.lifetime.cancel();
+    c.wake.cancel();
+    c.stagger.cancel();
+
+    // Operations still in flight reference this connection's memory, so it
+    // is only freed once they have all completed. Shutting the sockets down
+    // and cancelling by fd makes that happen promptly.
+    for (int fd : {c.client, c.upstream})
+        if (fd >= 0)
+            cancel_fd(fd);
+    for (int fd : c.racing)
+        if (fd >= 0)
+            cancel_fd(fd);
+    for (Flow *f : {&c.up, &c.down})
+        if (!f->send_pending)
+            release_buffers(*f); // otherwise once the send completes
+    maybe_free(c);
+}
+
+bool UringLoop::maybe_free(Connection &c)
+{
+    if (!c.closing || c.inflight > 0)
+        return false;
+    if (c.upstream >= 0)
+        close(c.upstream);
+    if (c.client >= 0)
+        close(c.client);
+    for (int fd : c.racing)
+        if (fd >= 0)
+            close(fd);
+    conns.release(&c);
+    ctx.metrics.connection_closed();
+    return true;
+}
+
+void UringLoop::retry_starved()
+{
+    if (starved.empty() || bufs.recycled == seen_recycled)
+        return;
+    seen_recycled = bufs.recycled;
+    std::vector<uint64_t> ids;
+    ids.swap(starved);
+    for (uint64_t id : ids)
+    {
+        Connection *found = conns.find(id);
+        if (!found || found->closing)
+            continue;
+        Connection &c = *found;
+        c.up.starved = c.down.starved = false;
+        if (c.state == ConnState::ReadingHead)
+            submit_recv(c, c.client, OpRecvClient);
+        else
+            drive(c);
+    }
+}
+
+void UringLoop::arm_deadline(Connection &c, Clock::time_point when)
+{
+    c.deadline = when;
+    timers.schedule(c.timeout, when);
+}
+
+void UringLoop::on_timer(TimerWheel::Timer &t, Clock::time_point now)
+{
+    if (t.kind == TimerPrune)
+    {
+        ctx.upstreams.prune(); // the pool is shared, one loop is enough
+        timers.schedule(t, now + kPruneInterval);
+        return;
+    }
+    // close_conn() cancels a connection's timers, so the owner is alive and
+    // not closing.
+    Connection &c = *conns.find(t.owner);
+    Metrics::Timeout kind;
+    switch (t.kind)
+    {
+    case TimerWake:
+        drive(c);
+        return;
+    case TimerAttempt:
+        if (!start_attempt(c) && !racing_any(c))
+            fail_upstream(c);
+        return;
+    case TimerLifetime:
+        kind = Metrics::Timeout::Lifetime;
+        break;
+    default:
+        // Relay progress only moves the deadline; the timer follows here.
+        if (c.deadline > now)
+        {
+            timers.schedule(t, c.deadline);
+            return;
+        }
+        if (c.state == ConnState::ReadingHead)
+            kind = Metrics::Timeout::Header;
+        else if (c.state == ConnState::Resolving || c.state == ConnState::Connecting)
+            kind = Metrics::Timeout::Connect;
+        else
+            kind = Metrics::Timeout::Idle;
+        break;
+    }
+    ctx.metrics.record_timeout(kind);
+    if (c.state == ConnState::Resolving || c.state == ConnState::Connecting)
+        fail_upstream(c);
+    else
+        abort_relay(c);
+}
+
+bool UringLoop::add_listener(int fd)
+{
+    listeners.push_back(fd);
+    return true;
+}
+
+void UringLoop::pin_to_cpu(int c)
+{
+    cpu = c;
+}
+
+void UringLoop::start()
+{
+    bool expected = false;
+    if (!running.compare_exchange_strong(expected, true))
+        return;
+    thread = std::thread([this]()
+                         { run(); });
+}
+
+void UringLoop::stop()
+{
+    bool expected = true;
+    if (running.compare_exchange_strong(expected, false))
+    {
+        uint64_t one = 1;
+        ssize_t w = write(wakefd, &one, sizeof(one));
+        (void)w;
+        if (thread.joinable())
+            thread.join();
+    }
+}
+
+void UringLoop::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lg(post_mtx);
+        posted.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    ssize_t w = write(wakefd, &one, sizeof(one));
+    (void)w;
+}
+} // namespace
+
+std::unique_ptr<EventLoop> EventLoop::create_uring(ProxyContext &ctx, DnsResolver &resolver, int index)
+{
+    std::unique_ptr<UringLoop> loop(new UringLoop(ctx, resolver, index));
+    if (!loop->init())
+        return nullptr;
+    return std::unique_ptr<EventLoop>(loop.release());
+}
+
+#endif // __linux__